@@ -0,0 +1,53 @@
+package com.shockwave.pdfium;
+
+import android.os.ParcelFileDescriptor;
+
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * Description of new documents built from pages of open documents, for
+ * {@link PdfiumCore#assembleDocuments(PdfAssembly)}.
+ * <p>
+ * Example splitting a manual into two chapters and merging two documents:
+ * <pre>
+ * new PdfAssembly()
+ *         .addOutput(chapter1Fd).addPages(manual, "1-10")
+ *         .addOutput(chapter2Fd).addPages(manual, "11-")
+ *         .addOutput(binderFd).addPages(first, null).addPages(second, null);
+ * </pre>
+ * Page ranges are 1-based, e.g. "1-10,45,60-"; a range without end runs to the last page.
+ */
+public class PdfAssembly {
+    /*package*/ final List<PdfDocument> sources = new ArrayList<>();
+    /*package*/ final List<ParcelFileDescriptor> outputs = new ArrayList<>();
+    /*package*/ final List<Integer> partSources = new ArrayList<>();
+    /*package*/ final List<String> partRanges = new ArrayList<>();
+    /*package*/ final List<Integer> partOutputs = new ArrayList<>();
+
+    /** Start new output document, written from current position of the descriptor */
+    public PdfAssembly addOutput(ParcelFileDescriptor fd) {
+        outputs.add(fd);
+        return this;
+    }
+
+    /**
+     * Append pages to the last added output
+     *
+     * @param pageRange page range spec, null for all pages
+     */
+    public PdfAssembly addPages(PdfDocument source, String pageRange) {
+        if (outputs.isEmpty()) {
+            throw new IllegalStateException("No output added");
+        }
+        int sourceIndex = sources.indexOf(source);
+        if (sourceIndex < 0) {
+            sourceIndex = sources.size();
+            sources.add(source);
+        }
+        partSources.add(sourceIndex);
+        partRanges.add(pageRange);
+        partOutputs.add(outputs.size() - 1);
+        return this;
+    }
+}
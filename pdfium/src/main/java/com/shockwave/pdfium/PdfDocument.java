@@ -7,6 +7,7 @@ import android.util.ArrayMap;
 import java.util.ArrayList;
 import java.util.List;
 import java.util.Map;
+import java.util.concurrent.locks.ReentrantReadWriteLock;
 
 public class PdfDocument {
 
@@ -104,11 +105,32 @@ public class PdfDocument {
     }
 
     /*package*/ long mNativeDocPtr;
+    /*package*/ long mNativePrefetcherPtr;
+    /*package*/ long mNativeSearchPtr;
+
+    /*package*/ long mNativeRenderFarmPtr;
+    /* renders through workers hold read lock, starting and stopping workers hold write lock */
+    /*package*/ final ReentrantReadWriteLock renderFarmLock = new ReentrantReadWriteLock();
     /*package*/ ParcelFileDescriptor parcelFileDescriptor;
 
     /*package*/ final Map<Integer, Long> mNativePagesPtr = new ArrayMap<>();
 
+    /*package*/ String renderCacheKey;
+
     public boolean hasPage(int index) {
         return mNativePagesPtr.containsKey(index);
     }
+
+    /**
+     * Set stable identity of this document used by the render cache, see
+     * {@link PdfiumCore#setRenderCache(java.io.File, long)}. Rendered pages are cached only for
+     * documents with a key. Key must change whenever document content changes.
+     */
+    public void setRenderCacheKey(String key) {
+        renderCacheKey = key;
+    }
+
+    public String getRenderCacheKey() {
+        return renderCacheKey;
+    }
 }
@@ -0,0 +1,65 @@
+package com.shockwave.pdfium;
+
+import android.os.ParcelFileDescriptor;
+
+/**
+ * Document open running in background, see
+ * {@link PdfiumCore#newDocumentAsync(ParcelFileDescriptor, String, PdfiumCore.OnDocumentOpenListener)}
+ */
+public class PdfOpenTask {
+    final ParcelFileDescriptor fd;
+    final PdfiumCore.OnDocumentOpenListener listener;
+    private final PdfiumCore core;
+    private long mNativeOpenPtr;
+    private boolean mDone;
+    private boolean mCancelled;
+
+    /*package*/ PdfOpenTask(PdfiumCore core, ParcelFileDescriptor fd,
+                            PdfiumCore.OnDocumentOpenListener listener) {
+        this.core = core;
+        this.fd = fd;
+        this.listener = listener;
+    }
+
+    /**
+     * Stop opening. Listener receives
+     * {@link PdfiumCore.OnDocumentOpenListener#onDocumentOpenCancelled()} unless it was already
+     * called with a result.
+     *
+     * @return false if the task already finished
+     */
+    public synchronized boolean cancel() {
+        if (mDone) {
+            return false;
+        }
+        mCancelled = true;
+        if (mNativeOpenPtr != 0) {
+            core.cancelOpen(mNativeOpenPtr);
+        }
+        return true;
+    }
+
+    public synchronized boolean isCancelled() {
+        return mCancelled;
+    }
+
+    public synchronized boolean isDone() {
+        return mDone;
+    }
+
+    /*package*/ synchronized void setNativeOpenPtr(long openPtr) {
+        if (mDone) {
+            return; // result was delivered before the open call returned
+        }
+        mNativeOpenPtr = openPtr;
+        if (mCancelled) {
+            core.cancelOpen(openPtr);
+        }
+    }
+
+    /* native object is deleted after the result is delivered */
+    /*package*/ synchronized void finish() {
+        mDone = true;
+        mNativeOpenPtr = 0;
+    }
+}
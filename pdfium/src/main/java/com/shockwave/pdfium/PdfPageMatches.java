@@ -0,0 +1,55 @@
+package com.shockwave.pdfium;
+
+import android.graphics.RectF;
+
+/**
+ * Matches of a search on one page, see
+ * {@link PdfiumCore#startRegexSearch(PdfDocument, String, int, int, int, PdfiumCore.OnSearchListener)}.
+ * <p>
+ * Each match is a range of page character indexes with highlight rects in page coordinates, one
+ * per line the match spans.
+ */
+public class PdfPageMatches {
+    final int pageIndex;
+    /* start, end and end of the rects of each match */
+    final int[] matches;
+    /* left, top, right, bottom of each rect */
+    final float[] rects;
+
+    /* created from search callback */
+    PdfPageMatches(int pageIndex, int[] matches, float[] rects) {
+        this.pageIndex = pageIndex;
+        this.matches = matches;
+        this.rects = rects;
+    }
+
+    public int getPageIndex() {
+        return pageIndex;
+    }
+
+    public int getMatchCount() {
+        return matches.length / 3;
+    }
+
+    /** @return index of the first character of the match */
+    public int getMatchStart(int match) {
+        return matches[match * 3];
+    }
+
+    /** @return index after the last character of the match */
+    public int getMatchEnd(int match) {
+        return matches[match * 3 + 1];
+    }
+
+    public int getRectCount(int match) {
+        int first = match == 0 ? 0 : matches[match * 3 - 1];
+        return matches[match * 3 + 2] - first;
+    }
+
+    /** @return highlight rect of the match in page coordinates */
+    public RectF getRect(int match, int rect) {
+        int index = (match == 0 ? 0 : matches[match * 3 - 1]) + rect;
+        return new RectF(rects[index * 4], rects[index * 4 + 1], rects[index * 4 + 2],
+                rects[index * 4 + 3]);
+    }
+}
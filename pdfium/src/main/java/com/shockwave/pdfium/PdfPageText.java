@@ -0,0 +1,45 @@
+package com.shockwave.pdfium;
+
+/**
+ * Text of a page, see {@link PdfiumCore#getPageText(PdfDocument, int, boolean)}.
+ * <p>
+ * Breaks are detected from character positions, so they follow the page layout also where the
+ * text has no line separators of its own. Each break is the UTF-16 offset in {@link #getText()}
+ * of the first character of a new line; a paragraph break also starts a new paragraph.
+ */
+public class PdfPageText {
+    /* must match native TEXT_BREAK_PARAGRAPH */
+    private static final int BREAK_PARAGRAPH = 1;
+
+    final String text;
+    /* offset << 1 | BREAK_PARAGRAPH, null if breaks were not requested */
+    final int[] breaks;
+
+    /* created from native code */
+    PdfPageText(String text, int[] breaks) {
+        this.text = text;
+        this.breaks = breaks;
+    }
+
+    public String getText() {
+        return text;
+    }
+
+    /** @return false if breaks were not requested */
+    public boolean hasBreaks() {
+        return breaks != null;
+    }
+
+    public int getBreakCount() {
+        return breaks != null ? breaks.length : 0;
+    }
+
+    /** @return offset in {@link #getText()} where line {@code index + 1} starts */
+    public int getBreakOffset(int index) {
+        return breaks[index] >>> 1;
+    }
+
+    public boolean isParagraphBreak(int index) {
+        return (breaks[index] & BREAK_PARAGRAPH) != 0;
+    }
+}
@@ -0,0 +1,90 @@
+package com.shockwave.pdfium;
+
+import android.graphics.Bitmap;
+
+/**
+ * Single page render request for {@link PdfiumCore#renderPagesBitmap(PdfDocument, PdfRenderJob[])}.
+ * <p>
+ * Page placement ({@code startX}, {@code startY}, {@code drawSizeX}, {@code drawSizeY}) is given in
+ * bitmap coordinates, exactly like in {@link PdfiumCore#renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int)}.
+ * Destination rect limits drawing (including background fill) to part of the bitmap, so several
+ * jobs can compose one frame in a shared bitmap.
+ */
+public class PdfRenderJob {
+    public static final int STATUS_NOT_RENDERED = -1;
+    public static final int STATUS_OK = 0;
+    /** Page could not be opened, or was closed while rendering */
+    public static final int STATUS_PAGE_ERROR = 1;
+    public static final int STATUS_BITMAP_ERROR = 2;
+    public static final int STATUS_INVALID_PARAMS = 3;
+    /** Render buffers could not be allocated */
+    public static final int STATUS_OUT_OF_MEMORY = 4;
+
+    /*package*/ static final int FLAG_ANNOT = 0x1;
+
+    /*package*/ static final int PARAM_COUNT = 9;
+
+    final int pageIndex;
+    final Bitmap bitmap;
+    final int destX;
+    final int destY;
+    final int destWidth;
+    final int destHeight;
+    final int startX;
+    final int startY;
+    final int drawSizeX;
+    final int drawSizeY;
+    final boolean renderAnnot;
+    int status = STATUS_NOT_RENDERED;
+
+    /** Render job drawing into the whole bitmap */
+    public PdfRenderJob(int pageIndex, Bitmap bitmap, int startX, int startY,
+                        int drawSizeX, int drawSizeY, boolean renderAnnot) {
+        this(pageIndex, bitmap, 0, 0, 0, 0, startX, startY, drawSizeX, drawSizeY, renderAnnot);
+    }
+
+    /**
+     * Render job drawing into part of the bitmap.
+     * Destination width or height lower or equal to 0 means up to the bitmap edge.
+     */
+    public PdfRenderJob(int pageIndex, Bitmap bitmap, int destX, int destY, int destWidth,
+                        int destHeight, int startX, int startY, int drawSizeX, int drawSizeY,
+                        boolean renderAnnot) {
+        this.pageIndex = pageIndex;
+        this.bitmap = bitmap;
+        this.destX = destX;
+        this.destY = destY;
+        this.destWidth = destWidth;
+        this.destHeight = destHeight;
+        this.startX = startX;
+        this.startY = startY;
+        this.drawSizeX = drawSizeX;
+        this.drawSizeY = drawSizeY;
+        this.renderAnnot = renderAnnot;
+    }
+
+    public int getPageIndex() {
+        return pageIndex;
+    }
+
+    public Bitmap getBitmap() {
+        return bitmap;
+    }
+
+    /** @return one of STATUS_* constants, {@link #STATUS_NOT_RENDERED} before rendering */
+    public int getStatus() {
+        return status;
+    }
+
+    /*package*/ void writeParams(int[] params, int offset) {
+        params[offset] = destX;
+        params[offset + 1] = destY;
+        params[offset + 2] = destWidth;
+        params[offset + 3] = destHeight;
+        params[offset + 4] = startX;
+        params[offset + 5] = startY;
+        params[offset + 6] = drawSizeX;
+        params[offset + 7] = drawSizeY;
+        params[offset + 8] = renderAnnot ? FLAG_ANNOT : 0;
+    }
+}
@@ -0,0 +1,61 @@
+package com.shockwave.pdfium;
+
+import android.graphics.RectF;
+
+/**
+ * Search match starting on one page and ending on the next, see
+ * {@link PdfiumCore.OnSearchListener#onSearchSpanningMatch(PdfSpanningMatch)}.
+ * <p>
+ * The match runs from {@link #getStart()} to the end of page {@link #getPageIndex()}, then from
+ * the start of the next page to {@link #getEnd()}. Rects are in page coordinates of their page.
+ */
+public class PdfSpanningMatch {
+    final int pageIndex;
+    final int start;
+    final int end;
+    final float[] rects;
+    final float[] nextPageRects;
+
+    /* created from search callback */
+    PdfSpanningMatch(int pageIndex, int start, int end, float[] rects, float[] nextPageRects) {
+        this.pageIndex = pageIndex;
+        this.start = start;
+        this.end = end;
+        this.rects = rects;
+        this.nextPageRects = nextPageRects;
+    }
+
+    /** @return index of the page the match starts on */
+    public int getPageIndex() {
+        return pageIndex;
+    }
+
+    /** @return index of the first character on the first page */
+    public int getStart() {
+        return start;
+    }
+
+    /** @return index after the last character on the next page */
+    public int getEnd() {
+        return end;
+    }
+
+    /** @return highlight rects on the first page */
+    public RectF[] getRects() {
+        return toRects(rects);
+    }
+
+    /** @return highlight rects on the next page */
+    public RectF[] getNextPageRects() {
+        return toRects(nextPageRects);
+    }
+
+    private static RectF[] toRects(float[] values) {
+        RectF[] rects = new RectF[values.length / 4];
+        for (int i = 0; i < rects.length; i++) {
+            rects[i] = new RectF(values[i * 4], values[i * 4 + 1], values[i * 4 + 2],
+                    values[i * 4 + 3]);
+        }
+        return rects;
+    }
+}
@@ -0,0 +1,45 @@
+package com.shockwave.pdfium;
+
+import android.graphics.RectF;
+
+/**
+ * Word of a page, see {@link PdfiumCore#getWordAt(PdfDocument, int, int)}.
+ * <p>
+ * Character indexes are page character indexes, as used by pdfium's text layer. A word
+ * hyphenated at the end of a line includes the hyphen and {@link #joinsNext()} the word
+ * continuing on the next line.
+ */
+public class PdfWord {
+    final int start;
+    final int end;
+    final RectF bounds;
+    final boolean joinsNext;
+
+    /* created from native code */
+    PdfWord(int start, int end, float left, float top, float right, float bottom,
+            boolean joinsNext) {
+        this.start = start;
+        this.end = end;
+        this.bounds = new RectF(left, top, right, bottom);
+        this.joinsNext = joinsNext;
+    }
+
+    /** @return index of the first character */
+    public int getStart() {
+        return start;
+    }
+
+    /** @return index after the last character */
+    public int getEnd() {
+        return end;
+    }
+
+    /** @return union of the character boxes in page coordinates, empty if none has a box */
+    public RectF getBounds() {
+        return bounds;
+    }
+
+    public boolean joinsNext() {
+        return joinsNext;
+    }
+}
@@ -10,14 +10,173 @@ import android.view.Surface;
 
 import com.shockwave.pdfium.util.Size;
 
+import java.io.File;
 import java.io.FileDescriptor;
 import java.io.IOException;
 import java.lang.reflect.Field;
+import java.nio.ByteBuffer;
 import java.util.ArrayList;
+import java.util.HashMap;
 import java.util.List;
+import java.util.Map;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.locks.ReentrantReadWriteLock;
 
 public class PdfiumCore {
     private static final String TAG = PdfiumCore.class.getName();
+
+    /** Fast preview: half resolution, no anti-aliasing */
+    public static final int QUALITY_DRAFT = 0;
+    /** Final rendering */
+    public static final int QUALITY_FULL = 1;
+
+    /** Append changes to original file content */
+    public static final int SAVE_INCREMENTAL = 1;
+    /** Rewrite whole document */
+    public static final int SAVE_NO_INCREMENTAL = 2;
+    /** Rewrite whole document without encryption */
+    public static final int SAVE_REMOVE_SECURITY = 3;
+
+    /** Statistics of {@link #saveDocument(PdfDocument, ParcelFileDescriptor, int)} */
+    public static class SaveResult {
+        final long bytesWritten;
+        final long durationNanos;
+
+        SaveResult(long bytesWritten, long durationNanos) {
+            this.bytesWritten = bytesWritten;
+            this.durationNanos = durationNanos;
+        }
+
+        public long getBytesWritten() {
+            return bytesWritten;
+        }
+
+        public long getDurationNanos() {
+            return durationNanos;
+        }
+    }
+
+    /**
+     * Use of the native pdfium lock, see {@link #getLockStats(boolean)}. Only pdfium calls run
+     * under the lock; bitmap locking, pixel conversion and result marshalling do not.
+     */
+    public static class LockStats {
+        final long acquisitions;
+        final long totalHoldNanos;
+        final long maxHoldNanos;
+        final long totalWaitNanos;
+        final long maxWaitNanos;
+
+        LockStats(long[] stats) {
+            acquisitions = stats[0];
+            totalHoldNanos = stats[1];
+            maxHoldNanos = stats[2];
+            totalWaitNanos = stats[3];
+            maxWaitNanos = stats[4];
+        }
+
+        public long getAcquisitions() {
+            return acquisitions;
+        }
+
+        public long getTotalHoldNanos() {
+            return totalHoldNanos;
+        }
+
+        public long getMaxHoldNanos() {
+            return maxHoldNanos;
+        }
+
+        public long getTotalWaitNanos() {
+            return totalWaitNanos;
+        }
+
+        public long getMaxWaitNanos() {
+            return maxWaitNanos;
+        }
+    }
+
+    /** Flatten annotations as displayed on screen */
+    public static final int FLATTEN_DISPLAY = 0;
+    /** Flatten annotations as printed */
+    public static final int FLATTEN_PRINT = 1;
+
+    /** Render pages in their own colors, see {@link #setColorMode(int)} */
+    public static final int COLOR_MODE_NORMAL = 0;
+    /** Render pages with inverted colors */
+    public static final int COLOR_MODE_INVERT = 1;
+    /**
+     * Render pages with inverted lightness for night reading: black and white swap, but hue and
+     * saturation are kept, so colored text and images stay recognizable
+     */
+    public static final int COLOR_MODE_INVERT_LIGHTNESS = 2;
+    /** Render pages in sepia tones */
+    public static final int COLOR_MODE_SEPIA = 3;
+    /** Render pages through the matrix set by {@link #setColorMatrix(float[])} */
+    public static final int COLOR_MODE_MATRIX = 4;
+
+    /** Write text as UTF-8, format of {@link #dumpText} */
+    public static final int DUMP_TEXT_UTF8 = 0;
+    /** Write text as UTF-16 little-endian without byte order mark, format of {@link #dumpText} */
+    public static final int DUMP_TEXT_UTF16LE = 1;
+
+    /** Search ignoring case, flag of {@link #searchPage} */
+    public static final int SEARCH_IGNORE_CASE = 1;
+    /** Search ignoring accents and other diacritics, flag of {@link #searchPage} */
+    public static final int SEARCH_IGNORE_DIACRITICS = 2;
+
+    /** Progress of {@link #flattenDocument}, called on the calling thread */
+    public interface OnFlattenProgressListener {
+        /** @return false to cancel */
+        boolean onFlattenProgress(int pagesDone, int pageCount);
+    }
+
+    /**
+     * Callback of {@link #startRegexSearch}, called on the search thread. Must not wait for the
+     * thread calling {@link #stopSearch} or {@link #closeDocument}.
+     */
+    public interface OnSearchListener {
+        /** Matches of one page, pages are reported in order and only if they have matches */
+        void onSearchMatches(PdfPageMatches matches);
+
+        /**
+         * Match starting near the end of a page and continuing on the next page, called before
+         * the matches of the next page
+         */
+        void onSearchSpanningMatch(PdfSpanningMatch match);
+
+        /** Called last, also when stopped */
+        void onSearchFinished(boolean cancelled);
+    }
+
+    /* must match native OPEN_CANCELLED and FPDF_ERR_PASSWORD */
+    private static final int OPEN_CANCELLED = -1;
+    private static final int OPEN_ERROR_PASSWORD = 4;
+
+    /**
+     * Callback of {@link #newDocumentAsync(ParcelFileDescriptor, String, OnDocumentOpenListener)},
+     * called on background thread. Exactly one of the methods is called.
+     */
+    public interface OnDocumentOpenListener {
+        void onDocumentOpened(PdfDocument document);
+
+        /** @param error {@link PdfPasswordException} if password is required or incorrect */
+        void onDocumentOpenFailed(IOException error);
+
+        void onDocumentOpenCancelled();
+    }
+
+    /** Callback of {@link #renderPageBitmapProgressive} */
+    public interface OnPageRenderListener {
+        /**
+         * Called after each pass drew into the bitmap
+         *
+         * @param quality {@link #QUALITY_DRAFT} or {@link #QUALITY_FULL}
+         */
+        void onPageRendered(int pageIndex, Bitmap bitmap, int quality);
+    }
+
     private static final Class FD_CLASS = FileDescriptor.class;
     private static final String FD_FIELD_NAME = "descriptor";
 
@@ -35,6 +194,10 @@ public class PdfiumCore {
 
     private native long nativeOpenDocument(int fd, String password);
 
+    private native long nativeOpenDocumentAsync(int fd, String password, PdfOpenTask task);
+
+    private native void nativeCancelOpen(long openPtr);
+
     private native long nativeOpenMemDocument(byte[] data, String password);
 
     private native void nativeCloseDocument(long docPtr);
@@ -62,12 +225,53 @@ public class PdfiumCore {
     private native void nativeRenderPage(long pagePtr, Surface surface, int dpi,
                                          int startX, int startY,
                                          int drawSizeHor, int drawSizeVer,
-                                         boolean renderAnnot);
+                                         boolean renderAnnot, int colorMode,
+                                         float[] colorMatrix);
+
+    private native int nativeRenderPageBitmap(long pagePtr, Bitmap bitmap, int dpi,
+                                              int startX, int startY,
+                                              int drawSizeHor, int drawSizeVer,
+                                              boolean renderAnnot, int quality,
+                                              boolean offscreen, long cachePtr,
+                                              String cacheKey, float[] highlightRects,
+                                              int[] highlightColors, int colorMode,
+                                              float[] colorMatrix);
+
+    private native boolean nativeRenderPageGray(long pagePtr, ByteBuffer buffer, int width,
+                                                int height, int stride, int startX, int startY,
+                                                int drawSizeHor, int drawSizeVer,
+                                                boolean renderAnnot, long cachePtr,
+                                                String cacheKey);
+
+    private native int[] nativeRenderPagesBitmap(long docPtr, int[] pageIndices, long[] pagesPtr,
+                                                 Bitmap[] bitmaps, int[] jobParams, long cachePtr,
+                                                 String docCacheKey, int colorMode,
+                                                 float[] colorMatrix);
+
+    private native long nativeOpenRenderCache(String directory, long maxBytes);
+
+    private native void nativeCloseRenderCache(long cachePtr);
+
+    private native void nativeClearRenderCache(long cachePtr);
 
-    private native void nativeRenderPageBitmap(long pagePtr, Bitmap bitmap, int dpi,
-                                               int startX, int startY,
-                                               int drawSizeHor, int drawSizeVer,
-                                               boolean renderAnnot);
+    private native float[] nativeEstimateRenderCost(long docPtr, int[] pageIndices,
+                                                    float pixelsPerPoint, int width, int height);
+
+    private native long[] nativeSaveDocument(long docPtr, int fd, int flags, int fileVersion)
+            throws IOException;
+
+    private native long[] nativeAssembleDocuments(long[] sourcePtrs, int[] outputFds,
+                                                  int[] partSources, String[] partRanges,
+                                                  int[] partOutputs) throws IOException;
+
+    private native int nativeFlattenDocument(long docPtr, int fd, int mode,
+                                             OnFlattenProgressListener listener)
+            throws IOException;
+
+    private native long nativeDumpText(long docPtr, int fd, int format, int boxesFd)
+            throws IOException;
+
+    private native String nativeGetFingerprint(int fd, boolean fullHash) throws IOException;
 
     private native String nativeGetDocumentMetaText(long docPtr, String tag);
 
@@ -83,6 +287,28 @@ public class PdfiumCore {
 
     private native long[] nativeGetPageLinks(long pagePtr);
 
+    private native PdfPageText nativeGetPageText(long pagePtr, boolean withBreaks);
+
+    private native int nativeGetWordCount(long pagePtr);
+
+    private native PdfWord nativeGetWord(long pagePtr, int charIndex, double pageX, double pageY,
+                                         double tolerance);
+
+    private native int nativeSelectRange(long pagePtr, double x1, double y1, double x2, double y2,
+                                         double tolerance, float[] out);
+
+    private native String nativeGetTextRange(long pagePtr, int start, int end);
+
+    private native String nativeGetTextInRects(long pagePtr, float[] rects, boolean sortLines);
+
+    private native int[] nativeSearchPage(long pagePtr, String query, int flags);
+
+    private native long nativeStartRegexSearch(long docPtr, String pattern, int flags,
+                                               int fromPage, int toPage,
+                                               OnSearchListener listener);
+
+    private native void nativeStopSearch(long searchPtr);
+
     private native Integer nativeGetDestPageIndex(long docPtr, long linkPtr);
 
     private native String nativeGetLinkURI(long docPtr, long linkPtr);
@@ -92,11 +318,51 @@ public class PdfiumCore {
     private native Point nativePageCoordsToDevice(long pagePtr, int startX, int startY, int sizeX,
                                                   int sizeY, int rotate, double pageX, double pageY);
 
+    private native boolean nativeMapPageCoordsToDevice(long pagePtr, int startX, int startY, int sizeX,
+                                                       int sizeY, int rotate, float[] pageCoords,
+                                                       float[] deviceCoords);
+
+    private native boolean nativeMapDeviceCoordsToPage(long pagePtr, int startX, int startY, int sizeX,
+                                                       int sizeY, int rotate, float[] deviceCoords,
+                                                       float[] pageCoords);
+
+    private native long nativeStartPrefetcher(long docPtr, int maxPages, boolean loadText,
+                                              long memoryBudget);
+
+    private native void nativeUpdatePrefetcher(long prefetcherPtr, int firstVisible,
+                                               int lastVisible, float velocity);
+
+    private native void nativeStopPrefetcher(long prefetcherPtr);
+
+    private native long nativeStartRenderFarm(long docPtr, int workerCount, long slotBytes);
 
-    /* synchronize native methods */
+    private native void nativeStopRenderFarm(long farmPtr);
+
+    private native boolean nativeRenderPageBitmapFarm(long farmPtr, Bitmap bitmap, int pageIndex,
+                                                      int startX, int startY, int drawSizeHor,
+                                                      int drawSizeVer, boolean renderAnnot,
+                                                      int colorMode, float[] colorMatrix);
+
+    private native long[] nativeGetLockStats(boolean reset);
+
+
+    /*
+     * Guards page maps of documents and fields below. Native methods serialize pdfium calls
+     * themselves, so renders run without it.
+     */
     private static final Object lock = new Object();
     private static Field mFdField = null;
     private int mCurrentDpi;
+    /* matrix is set before the mode and read after it, so matrix mode always has its matrix */
+    private volatile int mColorMode = COLOR_MODE_NORMAL;
+    private volatile float[] mColorMatrix;
+    private long mRenderCachePtr;
+    /* held for reading by renders using the render cache, for writing to replace it */
+    private final ReentrantReadWriteLock mRenderCacheLock = new ReentrantReadWriteLock();
+    private ExecutorService mRefineExecutor;
+    /* latest progressive render of each bitmap, older refine passes are dropped */
+    private final Map<Bitmap, Integer> mRefineGenerations = new HashMap<>();
+    private int mRefineGeneration;
 
     public static int getNumFd(ParcelFileDescriptor fdObj) {
         try {
@@ -138,6 +404,63 @@ public class PdfiumCore {
         return document;
     }
 
+    /**
+     * Open document from file in background. File regions needed for parsing are read before
+     * taking the render lock, so rendering of other documents continues meanwhile; the lock is
+     * held only while pdfium parses the document structure.<br>
+     * File descriptor is owned by the document once opened, as with
+     * {@link #newDocument(ParcelFileDescriptor, String)}.
+     *
+     * @return task which can cancel the open
+     */
+    public PdfOpenTask newDocumentAsync(ParcelFileDescriptor fd, String password,
+                                        OnDocumentOpenListener listener) {
+        PdfOpenTask task = new PdfOpenTask(this, fd, listener);
+        task.setNativeOpenPtr(nativeOpenDocumentAsync(getNumFd(fd), password, task));
+        return task;
+    }
+
+    /*package*/ void cancelOpen(long openPtr) {
+        nativeCancelOpen(openPtr);
+    }
+
+    /* called from native open thread */
+    private void onDocumentOpenResult(PdfOpenTask task, long docPtr, int error, String message) {
+        task.finish();
+        if (docPtr != 0) {
+            PdfDocument document = new PdfDocument();
+            document.parcelFileDescriptor = task.fd;
+            document.mNativeDocPtr = docPtr;
+            task.listener.onDocumentOpened(document);
+        } else if (error == OPEN_CANCELLED) {
+            task.listener.onDocumentOpenCancelled();
+        } else if (error == OPEN_ERROR_PASSWORD) {
+            task.listener.onDocumentOpenFailed(
+                    new PdfPasswordException("Password required or incorrect password."));
+        } else {
+            task.listener.onDocumentOpenFailed(
+                    new IOException("cannot create document: " + message));
+        }
+    }
+
+    /* called from native search thread */
+    private void onSearchMatches(OnSearchListener listener, int pageIndex, int[] matches,
+                                 float[] rects) {
+        listener.onSearchMatches(new PdfPageMatches(pageIndex, matches, rects));
+    }
+
+    /* called from native search thread */
+    private void onSearchSpanningMatch(OnSearchListener listener, int pageIndex, int start,
+                                       int end, float[] rects, float[] nextPageRects) {
+        listener.onSearchSpanningMatch(new PdfSpanningMatch(pageIndex, start, end, rects,
+                nextPageRects));
+    }
+
+    /* called from native search thread */
+    private void onSearchFinished(OnSearchListener listener, boolean cancelled) {
+        listener.onSearchFinished(cancelled);
+    }
+
     /** Create new document from bytearray */
     public PdfDocument newDocument(byte[] data) throws IOException {
         return newDocument(data, null);
@@ -152,6 +475,31 @@ public class PdfiumCore {
         return document;
     }
 
+    /**
+     * Compute stable identity of document file, e.g. for {@link PdfDocument#setRenderCacheKey(String)}.
+     * Does not wait for rendering and can be called from any thread.<br>
+     * Default mode hashes file size, header, trailer, cross-reference section and sampled blocks,
+     * which takes milliseconds regardless of file size. Full mode hashes whole file.
+     *
+     * @param fullHash hash every byte instead of sampling
+     * @return hex string, different for sampled and full mode
+     */
+    public String getDocumentFingerprint(ParcelFileDescriptor fd, boolean fullHash)
+            throws IOException {
+        return nativeGetFingerprint(getNumFd(fd), fullHash);
+    }
+
+    /**
+     * Compute identity of document opened from file, see
+     * {@link #getDocumentFingerprint(ParcelFileDescriptor, boolean)}
+     */
+    public String getDocumentFingerprint(PdfDocument doc, boolean fullHash) throws IOException {
+        if (doc.parcelFileDescriptor == null) {
+            throw new IllegalArgumentException("Document was not opened from file");
+        }
+        return getDocumentFingerprint(doc.parcelFileDescriptor, fullHash);
+    }
+
     /** Get total numer of pages in document */
     public int getPageCount(PdfDocument doc) {
         synchronized (lock) {
@@ -161,13 +509,11 @@ public class PdfiumCore {
 
     /** Open page and store native pointer in {@link PdfDocument} */
     public long openPage(PdfDocument doc, int pageIndex) {
-        long pagePtr;
         synchronized (lock) {
-            pagePtr = nativeLoadPage(doc.mNativeDocPtr, pageIndex);
+            long pagePtr = nativeLoadPage(doc.mNativeDocPtr, pageIndex);
             doc.mNativePagesPtr.put(pageIndex, pagePtr);
             return pagePtr;
         }
-
     }
 
     /** Open range of pages and store native pointers in {@link PdfDocument} */
@@ -268,18 +614,17 @@ public class PdfiumCore {
     public void renderPage(PdfDocument doc, Surface surface, int pageIndex,
                            int startX, int startY, int drawSizeX, int drawSizeY,
                            boolean renderAnnot) {
-        synchronized (lock) {
-            try {
-                //nativeRenderPage(doc.mNativePagesPtr.get(pageIndex), surface, mCurrentDpi);
-                nativeRenderPage(doc.mNativePagesPtr.get(pageIndex), surface, mCurrentDpi,
-                        startX, startY, drawSizeX, drawSizeY, renderAnnot);
-            } catch (NullPointerException e) {
-                Log.e(TAG, "mContext may be null");
-                e.printStackTrace();
-            } catch (Exception e) {
-                Log.e(TAG, "Exception throw from native");
-                e.printStackTrace();
-            }
+        try {
+            //nativeRenderPage(doc.mNativePagesPtr.get(pageIndex), surface, mCurrentDpi);
+            int colorMode = mColorMode;
+            nativeRenderPage(getPagePtr(doc, pageIndex), surface, mCurrentDpi,
+                    startX, startY, drawSizeX, drawSizeY, renderAnnot, colorMode, mColorMatrix);
+        } catch (NullPointerException e) {
+            Log.e(TAG, "mContext may be null");
+            e.printStackTrace();
+        } catch (Exception e) {
+            Log.e(TAG, "Exception throw from native");
+            e.printStackTrace();
         }
     }
 
@@ -291,6 +636,7 @@ public class PdfiumCore {
      * <ul>
      * <li>ARGB_8888 - best quality, high memory usage, higher possibility of OutOfMemoryError
      * <li>RGB_565 - little worse quality, twice less memory usage
+     * <li>ALPHA_8 - luminance only, quarter of ARGB_8888 memory usage, e.g. for e-ink or OCR
      * </ul>
      */
     public void renderPageBitmap(PdfDocument doc, Bitmap bitmap, int pageIndex,
@@ -307,22 +653,517 @@ public class PdfiumCore {
     public void renderPageBitmap(PdfDocument doc, Bitmap bitmap, int pageIndex,
                                  int startX, int startY, int drawSizeX, int drawSizeY,
                                  boolean renderAnnot) {
+        renderPageBitmap(doc, bitmap, pageIndex, startX, startY, drawSizeX, drawSizeY,
+                renderAnnot, null, null);
+    }
+
+    /**
+     * Render page fragment on {@link Bitmap} with highlights, e.g. search matches or selection,
+     * blended over the page. Highlights become part of the rendered page, including the copy in
+     * the render cache, so they need not be drawn over the bitmap on every frame.<br>
+     * Page must be opened before rendering.
+     * <p>
+     * For more info see {@link PdfiumCore#renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int)}
+     *
+     * @param highlightRects  left, top, right, bottom of each highlight in page coordinates, as
+     *                        returned by {@link PdfPageMatches} and {@link #selectRange}; may be
+     *                        null
+     * @param highlightColors ARGB color of each highlight, alpha is its opacity
+     * @throws IllegalArgumentException if there is not one color per rect
+     */
+    public void renderPageBitmap(PdfDocument doc, Bitmap bitmap, int pageIndex,
+                                 int startX, int startY, int drawSizeX, int drawSizeY,
+                                 boolean renderAnnot, float[] highlightRects,
+                                 int[] highlightColors) {
+        checkHighlights(highlightRects, highlightColors);
+        cancelRefine(bitmap);
+        int colorMode = mColorMode;
+        float[] colorMatrix = mColorMatrix;
+        mRenderCacheLock.readLock().lock();
+        try {
+            nativeRenderPageBitmap(getPagePtr(doc, pageIndex), bitmap, mCurrentDpi,
+                    startX, startY, drawSizeX, drawSizeY, renderAnnot, QUALITY_FULL, false,
+                    mRenderCachePtr, getPageCacheKey(doc, pageIndex), highlightRects,
+                    highlightColors, colorMode, colorMatrix);
+        } catch (NullPointerException e) {
+            Log.e(TAG, "mContext may be null");
+            e.printStackTrace();
+        } catch (Exception e) {
+            Log.e(TAG, "Exception throw from native");
+            e.printStackTrace();
+        } finally {
+            mRenderCacheLock.readLock().unlock();
+        }
+    }
+
+    /**
+     * Render page fragment on {@link Bitmap} in two passes, e.g. during fling.<br>
+     * Draft pass renders synchronously at half resolution without anti-aliasing and is upscaled
+     * into the bitmap. Full quality pass is queued on a background thread and replaces draft
+     * when finished; it is dropped if the bitmap is rendered again or the page is closed first.
+     * Listener is called after each pass, on the calling thread for draft and on the background
+     * thread for full quality. If full quality render is available from render cache, only one
+     * pass is made.
+     * <p>
+     * For more info see {@link PdfiumCore#renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int)}
+     */
+    public void renderPageBitmapProgressive(final PdfDocument doc, final Bitmap bitmap,
+                                            final int pageIndex, final int startX,
+                                            final int startY, final int drawSizeX,
+                                            final int drawSizeY, final boolean renderAnnot,
+                                            final OnPageRenderListener listener) {
+        renderPageBitmapProgressive(doc, bitmap, pageIndex, startX, startY, drawSizeX,
+                drawSizeY, renderAnnot, null, null, listener);
+    }
+
+    /**
+     * Render page fragment on {@link Bitmap} in two passes with highlights blended over the page,
+     * see {@link #renderPageBitmapProgressive(PdfDocument, Bitmap, int, int, int, int, int, boolean, OnPageRenderListener)}
+     * and {@link #renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int, boolean, float[], int[])}.
+     */
+    public void renderPageBitmapProgressive(final PdfDocument doc, final Bitmap bitmap,
+                                            final int pageIndex, final int startX,
+                                            final int startY, final int drawSizeX,
+                                            final int drawSizeY, final boolean renderAnnot,
+                                            final float[] highlightRects,
+                                            final int[] highlightColors,
+                                            final OnPageRenderListener listener) {
+        checkHighlights(highlightRects, highlightColors);
+        // Copied for the full quality pass, the caller may reuse its arrays meanwhile
+        final float[] rects = highlightRects != null ? highlightRects.clone() : null;
+        final int[] colors = highlightColors != null ? highlightColors.clone() : null;
+        // Both passes use the colors current when the render was requested
+        final int colorMode = mColorMode;
+        final float[] colorMatrix = mColorMatrix;
+        final int generation = nextRefineGeneration(bitmap);
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return;
+        }
+        int quality;
+        mRenderCacheLock.readLock().lock();
+        try {
+            quality = nativeRenderPageBitmap(pagePtr, bitmap, mCurrentDpi, startX, startY,
+                    drawSizeX, drawSizeY, renderAnnot, QUALITY_DRAFT, false,
+                    mRenderCachePtr, getPageCacheKey(doc, pageIndex), rects, colors,
+                    colorMode, colorMatrix);
+        } finally {
+            mRenderCacheLock.readLock().unlock();
+        }
+        if (quality < 0) {
+            return;
+        }
+        listener.onPageRendered(pageIndex, bitmap, quality);
+        if (quality == QUALITY_FULL) {
+            finishRefine(bitmap, generation);
+            return;
+        }
+
+        getRefineExecutor().execute(new Runnable() {
+            @Override
+            public void run() {
+                if (!isCurrentRefine(bitmap, generation)) {
+                    return;
+                }
+                Long pagePtr = getPagePtr(doc, pageIndex);
+                if (pagePtr == null || !isCurrentRefine(bitmap, generation)) {
+                    return;
+                }
+                int quality;
+                mRenderCacheLock.readLock().lock();
+                try {
+                    // Bitmap may be on screen, so it is replaced only by a complete page
+                    quality = nativeRenderPageBitmap(pagePtr, bitmap, mCurrentDpi, startX,
+                            startY, drawSizeX, drawSizeY, renderAnnot, QUALITY_FULL, true,
+                            mRenderCachePtr, getPageCacheKey(doc, pageIndex), rects, colors,
+                            colorMode, colorMatrix);
+                } finally {
+                    mRenderCacheLock.readLock().unlock();
+                }
+                if (quality == QUALITY_FULL && finishRefine(bitmap, generation)) {
+                    listener.onPageRendered(pageIndex, bitmap, quality);
+                }
+            }
+        });
+    }
+
+    private static void checkHighlights(float[] rects, int[] colors) {
+        if (rects != null && (colors == null || rects.length != colors.length * 4)) {
+            throw new IllegalArgumentException("Highlights need one color per rect");
+        }
+    }
+
+    private synchronized ExecutorService getRefineExecutor() {
+        if (mRefineExecutor == null) {
+            mRefineExecutor = Executors.newSingleThreadExecutor();
+        }
+        return mRefineExecutor;
+    }
+
+    private int nextRefineGeneration(Bitmap bitmap) {
+        synchronized (mRefineGenerations) {
+            int generation = ++mRefineGeneration;
+            mRefineGenerations.put(bitmap, generation);
+            return generation;
+        }
+    }
+
+    private void cancelRefine(Bitmap bitmap) {
+        synchronized (mRefineGenerations) {
+            mRefineGenerations.remove(bitmap);
+        }
+    }
+
+    private boolean isCurrentRefine(Bitmap bitmap, int generation) {
+        synchronized (mRefineGenerations) {
+            Integer current = mRefineGenerations.get(bitmap);
+            return current != null && current == generation;
+        }
+    }
+
+    /** @return true if refine was not superseded */
+    private boolean finishRefine(Bitmap bitmap, int generation) {
+        synchronized (mRefineGenerations) {
+            if (!isCurrentRefine(bitmap, generation)) {
+                return false;
+            }
+            mRefineGenerations.remove(bitmap);
+            return true;
+        }
+    }
+
+    /**
+     * Render page fragment as 8-bit luminance into direct {@link ByteBuffer}, one byte per pixel,
+     * rows {@code stride} bytes apart. Page must be opened before rendering.<br>
+     * Page placement is the same as in
+     * {@link PdfiumCore#renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int)}.
+     *
+     * @return true if page was rendered
+     */
+    public boolean renderPageGray(PdfDocument doc, ByteBuffer buffer, int pageIndex,
+                                  int width, int height, int stride,
+                                  int startX, int startY, int drawSizeX, int drawSizeY,
+                                  boolean renderAnnot) {
+        if (!buffer.isDirect()) {
+            throw new IllegalArgumentException("Buffer must be direct");
+        }
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return false;
+        }
+        mRenderCacheLock.readLock().lock();
+        try {
+            return nativeRenderPageGray(pagePtr, buffer, width, height, stride,
+                    startX, startY, drawSizeX, drawSizeY, renderAnnot, mRenderCachePtr,
+                    getPageCacheKey(doc, pageIndex));
+        } finally {
+            mRenderCacheLock.readLock().unlock();
+        }
+    }
+
+    /**
+     * Render several page fragments in one native call, e.g. all pages visible in a
+     * continuous-scroll frame.<br>
+     * Pages which are not opened yet are opened and kept in {@link PdfDocument}, like with
+     * {@link PdfiumCore#openPage(PdfDocument, int)}. Jobs are executed in order, so a later job
+     * may draw over an earlier one sharing the same bitmap.
+     * <p>
+     * Supported bitmap configurations are the same as in
+     * {@link PdfiumCore#renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int)}.
+     *
+     * @return true if every job succeeded, see {@link PdfRenderJob#getStatus()} for details
+     */
+    public boolean renderPagesBitmap(PdfDocument doc, PdfRenderJob[] jobs) {
+        int[] pageIndices = new int[jobs.length];
+        long[] pagesPtr = new long[jobs.length];
+        Bitmap[] bitmaps = new Bitmap[jobs.length];
+        int[] jobParams = new int[jobs.length * PdfRenderJob.PARAM_COUNT];
+
+        // Missing pages are opened under the lock, render then only needs the page pointers
         synchronized (lock) {
-            try {
-                nativeRenderPageBitmap(doc.mNativePagesPtr.get(pageIndex), bitmap, mCurrentDpi,
-                        startX, startY, drawSizeX, drawSizeY, renderAnnot);
-            } catch (NullPointerException e) {
-                Log.e(TAG, "mContext may be null");
-                e.printStackTrace();
-            } catch (Exception e) {
-                Log.e(TAG, "Exception throw from native");
-                e.printStackTrace();
+            for (int i = 0; i < jobs.length; i++) {
+                PdfRenderJob job = jobs[i];
+                Long pagePtr = doc.mNativePagesPtr.get(job.pageIndex);
+                if (pagePtr == null) {
+                    try {
+                        pagePtr = openPage(doc, job.pageIndex);
+                    } catch (IllegalStateException e) {
+                        pagePtr = 0L;
+                    }
+                }
+                pageIndices[i] = job.pageIndex;
+                pagesPtr[i] = pagePtr;
+                bitmaps[i] = job.bitmap;
+                job.writeParams(jobParams, i * PdfRenderJob.PARAM_COUNT);
+            }
+        }
+
+        int[] status;
+        int colorMode = mColorMode;
+        mRenderCacheLock.readLock().lock();
+        try {
+            status = nativeRenderPagesBitmap(doc.mNativeDocPtr, pageIndices, pagesPtr,
+                    bitmaps, jobParams, mRenderCachePtr, doc.renderCacheKey, colorMode,
+                    mColorMatrix);
+        } finally {
+            mRenderCacheLock.readLock().unlock();
+        }
+
+        boolean allOk = true;
+        for (int i = 0; i < jobs.length; i++) {
+            jobs[i].status = status[i];
+            allOk &= status[i] == PdfRenderJob.STATUS_OK;
+        }
+        return allOk;
+    }
+
+    /**
+     * Estimate time of rendering whole page at given size, e.g. to render expensive pages ahead
+     * of time, use {@link #renderPageBitmapProgressive} or lower resolution for them.<br>
+     * Estimate is based on number and transparency of page objects and is calibrated by render
+     * times measured for this document, so it gets more accurate as pages are rendered.
+     * Pages which are not opened are parsed once to count their objects, at lower priority than
+     * other calls into the library.
+     *
+     * @return estimated time in milliseconds, -1 if page cannot be loaded
+     */
+    public float estimateRenderCost(PdfDocument doc, int pageIndex, int width, int height) {
+        return nativeEstimateRenderCost(doc.mNativeDocPtr, new int[]{pageIndex}, 0,
+                width, height)[0];
+    }
+
+    /**
+     * Estimate time of rendering whole pages at given scale, see
+     * {@link #estimateRenderCost(PdfDocument, int, int, int)}
+     *
+     * @param pixelsPerPoint render scale, e.g. dpi / 72
+     * @return estimated time in milliseconds for each page, -1 for pages which cannot be loaded
+     */
+    public float[] estimateRenderCost(PdfDocument doc, int[] pageIndices, float pixelsPerPoint) {
+        return nativeEstimateRenderCost(doc.mNativeDocPtr, pageIndices, pixelsPerPoint, 0, 0);
+    }
+
+    /**
+     * Set colors of pages rendered to {@link Surface} and {@link Bitmap}, e.g. for night
+     * reading. Colors are transformed natively right after rasterization, before the reduction to
+     * RGB_565 and before storing in the render cache, so cached pages are already in the final
+     * colors and no color filter is needed when drawing them. Highlights keep their own colors.
+     *
+     * @param mode one of {@link #COLOR_MODE_NORMAL}, {@link #COLOR_MODE_INVERT},
+     *             {@link #COLOR_MODE_INVERT_LIGHTNESS} and {@link #COLOR_MODE_SEPIA}
+     */
+    public void setColorMode(int mode) {
+        if (mode < COLOR_MODE_NORMAL || mode >= COLOR_MODE_MATRIX) {
+            throw new IllegalArgumentException("Use setColorMatrix for matrix mode");
+        }
+        mColorMode = mode;
+    }
+
+    /**
+     * Render pages through a custom color matrix, see {@link #setColorMode(int)}.
+     *
+     * @param matrix 4x5 row-major matrix as in {@link android.graphics.ColorMatrix#getArray()},
+     *               offsets in 0..255; factors are clamped to +-255 and offsets to +-65535
+     */
+    public void setColorMatrix(float[] matrix) {
+        if (matrix.length != 20) {
+            throw new IllegalArgumentException("Color matrix must have 20 elements");
+        }
+        mColorMatrix = matrix.clone();
+        mColorMode = COLOR_MODE_MATRIX;
+    }
+
+    /**
+     * Enable persistent cache of rendered bitmaps. Bitmap renders of documents with
+     * {@link PdfDocument#setRenderCacheKey(String)} set are looked up in the cache first and
+     * stored in it afterwards, compressed, on a background thread.<br>
+     * Replaces previously set cache. Rendering to {@link Surface} is not cached.
+     *
+     * @param directory directory owned by the cache, e.g. subdirectory of
+     *                  {@link Context#getCacheDir()}
+     * @param maxBytes  size limit, least recently used entries are removed above it
+     */
+    public void setRenderCache(File directory, long maxBytes) {
+        long cachePtr = nativeOpenRenderCache(directory.getAbsolutePath(), maxBytes);
+        mRenderCacheLock.writeLock().lock();
+        try {
+            if (mRenderCachePtr != 0) {
+                nativeCloseRenderCache(mRenderCachePtr);
+            }
+            mRenderCachePtr = cachePtr;
+        } finally {
+            mRenderCacheLock.writeLock().unlock();
+        }
+    }
+
+    /** Disable render cache, finishing pending writes. Cached files are kept. */
+    public void closeRenderCache() {
+        mRenderCacheLock.writeLock().lock();
+        try {
+            if (mRenderCachePtr != 0) {
+                nativeCloseRenderCache(mRenderCachePtr);
+                mRenderCachePtr = 0;
+            }
+        } finally {
+            mRenderCacheLock.writeLock().unlock();
+        }
+    }
+
+    /** Remove all entries from render cache */
+    public void clearRenderCache() {
+        mRenderCacheLock.readLock().lock();
+        try {
+            if (mRenderCachePtr != 0) {
+                nativeClearRenderCache(mRenderCachePtr);
+            }
+        } finally {
+            mRenderCacheLock.readLock().unlock();
+        }
+    }
+
+    private String getPageCacheKey(PdfDocument doc, int pageIndex) {
+        if (mRenderCachePtr == 0 || doc.renderCacheKey == null) {
+            return null;
+        }
+        return doc.renderCacheKey + "#" + pageIndex;
+    }
+
+    /**
+     * Start loading pages ahead of scrolling on a background thread.<br>
+     * Pages are loaded only in gaps between foreground renders and are handed over by
+     * {@link PdfiumCore#openPage(PdfDocument, int)}. Feed the visible range with
+     * {@link PdfiumCore#updatePrefetch(PdfDocument, int, int, float)}.
+     *
+     * @param maxPages     maximum number of pages loaded ahead of the visible range
+     * @param loadText     also load text layers of prefetched pages
+     * @param memoryBudget heap bytes prefetched pages may hold, estimated from the number of
+     *                     page objects and text characters
+     */
+    public void startPrefetch(PdfDocument doc, int maxPages, boolean loadText, long memoryBudget) {
+        synchronized (doc) {
+            if (doc.mNativePrefetcherPtr != 0) {
+                return;
+            }
+            doc.mNativePrefetcherPtr = nativeStartPrefetcher(doc.mNativeDocPtr, maxPages,
+                    loadText, memoryBudget);
+        }
+    }
+
+    /**
+     * Report current viewport to the prefetcher. Cheap, can be called on every scroll event.
+     *
+     * @param velocity scroll velocity in pages per second, positive towards higher page indices
+     */
+    public void updatePrefetch(PdfDocument doc, int firstVisiblePage, int lastVisiblePage,
+                               float velocity) {
+        synchronized (doc) {
+            if (doc.mNativePrefetcherPtr != 0) {
+                nativeUpdatePrefetcher(doc.mNativePrefetcherPtr, firstVisiblePage,
+                        lastVisiblePage, velocity);
+            }
+        }
+    }
+
+    /** Stop prefetching. Pages already prefetched stay available until document is closed. */
+    public void stopPrefetch(PdfDocument doc) {
+        synchronized (doc) {
+            if (doc.mNativePrefetcherPtr == 0) {
+                return;
+            }
+            nativeStopPrefetcher(doc.mNativePrefetcherPtr);
+            doc.mNativePrefetcherPtr = 0;
+        }
+    }
+
+    /**
+     * Start helper processes rendering pages of the document in parallel, see
+     * {@link #renderPageBitmapParallel}. Each worker is a forked copy of this process holding its
+     * own snapshot of the document, so changes made to the document afterwards (e.g.
+     * {@link #flattenDocument}) are not visible to workers until they are restarted.
+     *
+     * @param workerCount   number of processes, e.g. number of cores
+     * @param maxBitmapSize largest bitmap in bytes the workers will render into
+     * @return false if workers could not be started
+     */
+    public boolean startRenderWorkers(PdfDocument doc, int workerCount, long maxBitmapSize) {
+        doc.renderFarmLock.writeLock().lock();
+        try {
+            if (doc.mNativeRenderFarmPtr != 0) {
+                return true;
             }
+            doc.mNativeRenderFarmPtr = nativeStartRenderFarm(doc.mNativeDocPtr, workerCount,
+                    maxBitmapSize);
+            return doc.mNativeRenderFarmPtr != 0;
+        } finally {
+            doc.renderFarmLock.writeLock().unlock();
+        }
+    }
+
+    /** Stop render worker processes, waiting for renders in progress */
+    public void stopRenderWorkers(PdfDocument doc) {
+        doc.renderFarmLock.writeLock().lock();
+        try {
+            if (doc.mNativeRenderFarmPtr != 0) {
+                nativeStopRenderFarm(doc.mNativeRenderFarmPtr);
+                doc.mNativeRenderFarmPtr = 0;
+            }
+        } finally {
+            doc.renderFarmLock.writeLock().unlock();
+        }
+    }
+
+    /**
+     * Render page fragment on {@link Bitmap} in a worker process started by
+     * {@link #startRenderWorkers}, without blocking renders on other threads. Page does not have
+     * to be opened. Without workers the page is rendered in this process like
+     * {@link #renderPageBitmap(PdfDocument, Bitmap, int, int, int, int, int, boolean)}.
+     *
+     * @return false if the page could not be rendered, e.g. it crashed a worker twice
+     */
+    public boolean renderPageBitmapParallel(PdfDocument doc, Bitmap bitmap, int pageIndex,
+                                            int startX, int startY, int drawSizeX,
+                                            int drawSizeY, boolean renderAnnot) {
+        doc.renderFarmLock.readLock().lock();
+        try {
+            if (doc.mNativeRenderFarmPtr != 0) {
+                int colorMode = mColorMode;
+                return nativeRenderPageBitmapFarm(doc.mNativeRenderFarmPtr, bitmap, pageIndex,
+                        startX, startY, drawSizeX, drawSizeY, renderAnnot, colorMode,
+                        mColorMatrix);
+            }
+        } finally {
+            doc.renderFarmLock.readLock().unlock();
+        }
+        if (!doc.hasPage(pageIndex)) {
+            openPage(doc, pageIndex);
+        }
+        renderPageBitmap(doc, bitmap, pageIndex, startX, startY, drawSizeX, drawSizeY,
+                renderAnnot);
+        return true;
+    }
+
+    private Long getPagePtr(PdfDocument doc, int pageIndex) {
+        synchronized (lock) {
+            return doc.mNativePagesPtr.get(pageIndex);
         }
     }
 
+    /**
+     * Time spent in and waiting for the native lock serializing pdfium calls, summed over all
+     * documents since the previous reset. Used to check how much of rendering is serialized.
+     *
+     * @param reset start counting again after reading
+     */
+    public LockStats getLockStats(boolean reset) {
+        return new LockStats(nativeGetLockStats(reset));
+    }
+
     /** Release native resources and opened file */
     public void closeDocument(PdfDocument doc) {
+        stopPrefetch(doc);
+        stopRenderWorkers(doc);
+        stopSearch(doc);
+
         synchronized (lock) {
             for (Integer index : doc.mNativePagesPtr.keySet()) {
                 nativeClosePage(doc.mNativePagesPtr.get(index));
@@ -342,6 +1183,113 @@ public class PdfiumCore {
         }
     }
 
+    /**
+     * Write document to file, starting at current position of the descriptor.<br>
+     * Output is buffered natively, so cost is dominated by disk speed.
+     *
+     * @param flags {@link #SAVE_INCREMENTAL}, {@link #SAVE_NO_INCREMENTAL} or
+     *              {@link #SAVE_REMOVE_SECURITY}
+     */
+    public SaveResult saveDocument(PdfDocument doc, ParcelFileDescriptor fd, int flags)
+            throws IOException {
+        return saveDocument(doc, fd, flags, 0);
+    }
+
+    /**
+     * Write document to file with given PDF version, see
+     * {@link #saveDocument(PdfDocument, ParcelFileDescriptor, int)}
+     *
+     * @param fileVersion PDF version multiplied by 10, e.g. 17 for PDF 1.7; 0 keeps original
+     */
+    public SaveResult saveDocument(PdfDocument doc, ParcelFileDescriptor fd, int flags,
+                                   int fileVersion) throws IOException {
+        long[] result;
+        synchronized (lock) {
+            result = nativeSaveDocument(doc.mNativeDocPtr, getNumFd(fd), flags, fileVersion);
+        }
+        return new SaveResult(result[0], result[1]);
+    }
+
+    /**
+     * Write plain text of all pages to file, e.g. for indexing, starting at current position of
+     * the descriptor. Each page is followed by a form feed ({@code \f}). Pages are loaded and
+     * closed one at a time natively and output is buffered, so memory use does not grow with the
+     * page count and no Java strings are created. Pages need not be opened; the document must
+     * not be closed during the dump. A page which cannot be loaded is written empty, a form feed
+     * and a character count of 0, so one bad page does not end the dump.
+     *
+     * @param format  {@link #DUMP_TEXT_UTF8} or {@link #DUMP_TEXT_UTF16LE}
+     * @param boxesFd receives character boxes, may be null. For each page it holds the page
+     *                index and character count as 32-bit integers, then left, top, right and
+     *                bottom in page coordinates as 32-bit floats for each character of the
+     *                page's text in order, all little-endian. There is one box per Unicode
+     *                code point, not per UTF-16 unit: a character outside the Basic
+     *                Multilingual Plane is a surrogate pair in {@link #DUMP_TEXT_UTF16LE} text
+     *                but has a single box.
+     * @return bytes of text written
+     */
+    public long dumpText(PdfDocument doc, ParcelFileDescriptor fd, int format,
+                         ParcelFileDescriptor boxesFd) throws IOException {
+        return nativeDumpText(doc.mNativeDocPtr, getNumFd(fd), format,
+                boxesFd != null ? getNumFd(boxesFd) : -1);
+    }
+
+    /**
+     * Write documents assembled from page ranges of open documents, see {@link PdfAssembly}.
+     * Each source is parsed once, however many outputs use it.
+     *
+     * @return bytes written to each output, in order of
+     * {@link PdfAssembly#addOutput(ParcelFileDescriptor)} calls
+     * @throws IllegalArgumentException if a page range is malformed or outside its document
+     */
+    public long[] assembleDocuments(PdfAssembly assembly) throws IOException {
+        long[] sourcePtrs = new long[assembly.sources.size()];
+        for (int i = 0; i < sourcePtrs.length; i++) {
+            sourcePtrs[i] = assembly.sources.get(i).mNativeDocPtr;
+        }
+        int[] outputFds = new int[assembly.outputs.size()];
+        for (int i = 0; i < outputFds.length; i++) {
+            outputFds[i] = getNumFd(assembly.outputs.get(i));
+        }
+        int partCount = assembly.partSources.size();
+        int[] partSources = new int[partCount];
+        int[] partOutputs = new int[partCount];
+        String[] partRanges = assembly.partRanges.toArray(new String[partCount]);
+        for (int i = 0; i < partCount; i++) {
+            partSources[i] = assembly.partSources.get(i);
+            partOutputs[i] = assembly.partOutputs.get(i);
+        }
+
+        synchronized (lock) {
+            return nativeAssembleDocuments(sourcePtrs, outputFds, partSources, partRanges,
+                    partOutputs);
+        }
+    }
+
+    /**
+     * Flatten annotations and form fields of all pages into page content and write document
+     * to file. Pages are processed one at a time, so memory usage does not grow with page count.
+     * <br>
+     * Opened pages of the document are closed first. Document in memory stays flattened,
+     * partially if cancelled.
+     *
+     * @param mode     {@link #FLATTEN_DISPLAY} or {@link #FLATTEN_PRINT}
+     * @param listener progress listener, may be null
+     * @return number of pages which had something to flatten, -1 if cancelled
+     */
+    public int flattenDocument(PdfDocument doc, ParcelFileDescriptor fd, int mode,
+                               OnFlattenProgressListener listener) throws IOException {
+        stopPrefetch(doc);
+        stopSearch(doc);
+        synchronized (lock) {
+            for (Long pagePtr : doc.mNativePagesPtr.values()) {
+                nativeClosePage(pagePtr);
+            }
+            doc.mNativePagesPtr.clear();
+            return nativeFlattenDocument(doc.mNativeDocPtr, getNumFd(fd), mode, listener);
+        }
+    }
+
     /** Get metadata for given document */
     public PdfDocument.Meta getDocumentMeta(PdfDocument doc) {
         synchronized (lock) {
@@ -412,6 +1360,188 @@ public class PdfiumCore {
         }
     }
 
+    /**
+     * Get whole text of the page, e.g. for copy-all or text-to-speech.<br>
+     * Page must be opened. Line and paragraph breaks are detected from character positions in the
+     * same pass over the page's text layer, which stays loaded until the page is closed.
+     *
+     * @param withBreaks also detect line and paragraph breaks, see {@link PdfPageText}
+     * @return page text or null if page is not opened
+     */
+    public PdfPageText getPageText(PdfDocument doc, int pageIndex, boolean withBreaks) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return null;
+        }
+        return nativeGetPageText(pagePtr, withBreaks);
+    }
+
+    /**
+     * Get number of words on the page.<br>
+     * Page must be opened. The word index is built once in a pass over the page's text layer and
+     * kept until the page is closed, so this and the word lookups below are cheap afterwards.
+     *
+     * @return number of words or -1 if page is not opened
+     */
+    public int getWordCount(PdfDocument doc, int pageIndex) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return -1;
+        }
+        return nativeGetWordCount(pagePtr);
+    }
+
+    /**
+     * Get the word containing a character, e.g. to extend a selection to whole words.<br>
+     * Page must be opened.
+     *
+     * @param charIndex page character index
+     * @return word or null if page is not opened or the character is not part of a word
+     */
+    public PdfWord getWordAt(PdfDocument doc, int pageIndex, int charIndex) {
+        if (charIndex < 0) {
+            return null;
+        }
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return null;
+        }
+        return nativeGetWord(pagePtr, charIndex, 0, 0, 0);
+    }
+
+    /**
+     * Get the word at a position, e.g. for double-tap selection.<br>
+     * Page must be opened. Use {@link #mapDeviceCoordsToPage} to convert a touch point.
+     *
+     * @param pageX     x in page coordinates
+     * @param pageY     y in page coordinates
+     * @param tolerance how far from the position a character may be, in page units
+     * @return word or null if page is not opened or there is no word at the position
+     */
+    public PdfWord getWordAtPos(PdfDocument doc, int pageIndex, double pageX, double pageY,
+                                double tolerance) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return null;
+        }
+        return nativeGetWord(pagePtr, -1, pageX, pageY, tolerance);
+    }
+
+    /**
+     * Select text between two points, e.g. on every move of a selection drag.<br>
+     * Page must be opened. The result is written to {@code out}, which should be reused between
+     * calls so no objects are created per event:<br>
+     * {@code out[0]}, {@code out[1]} - selected character range [start, end), -1 if either point
+     * is not at text<br>
+     * then left, top, right, bottom of each highlight rect in page coordinates, with the rects of
+     * one line merged, as many as fit.
+     *
+     * @param tolerance how far from a point a character may be, in page units
+     * @param out       receives the range and rects, at least 2 long
+     * @return number of rects, which may be more than fit in {@code out}, or -1 if page is not
+     * opened
+     */
+    public int selectRange(PdfDocument doc, int pageIndex, double x1, double y1, double x2,
+                           double y2, double tolerance, float[] out) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return -1;
+        }
+        return nativeSelectRange(pagePtr, x1, y1, x2, y2, tolerance, out);
+    }
+
+    /**
+     * Get text of a character range, e.g. of the final selection from
+     * {@link #selectRange(PdfDocument, int, double, double, double, double, double, float[])}.<br>
+     * Page must be opened.
+     *
+     * @param start first character index
+     * @param end   index after the last character
+     * @return text or null if page is not opened
+     */
+    public String getTextRange(PdfDocument doc, int pageIndex, int start, int end) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return null;
+        }
+        return nativeGetTextRange(pagePtr, start, end);
+    }
+
+    /**
+     * Get text inside one or more areas of the page, e.g. to copy a lassoed table.<br>
+     * Page must be opened. Texts of several areas are joined by line breaks.
+     *
+     * @param rects     left, top, right, bottom of each area in page coordinates
+     * @param sortLines regroup the characters into lines ordered top to bottom and left to right,
+     *                  for pages that draw text out of reading order
+     * @return text or null if page is not opened
+     */
+    public String getTextInRects(PdfDocument doc, int pageIndex, float[] rects,
+                                 boolean sortLines) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return null;
+        }
+        return nativeGetTextInRects(pagePtr, rects, sortLines);
+    }
+
+    /**
+     * Find all occurrences of a text on the page.<br>
+     * Page must be opened. The page text is folded once per page and flags, so repeated searches,
+     * e.g. while typing, only scan the folded text. Folding covers Latin, Greek and Cyrillic, so
+     * with both flags "resume" also finds "Résumé" and "strasse" finds "Straße".
+     *
+     * @param flags combination of {@link #SEARCH_IGNORE_CASE} and {@link #SEARCH_IGNORE_DIACRITICS}
+     * @return start and end (exclusive) character index of each match, or null if page is not
+     * opened
+     */
+    public int[] searchPage(PdfDocument doc, int pageIndex, String query, int flags) {
+        Long pagePtr = getPagePtr(doc, pageIndex);
+        if (pagePtr == null) {
+            return null;
+        }
+        return nativeSearchPage(pagePtr, query, flags);
+    }
+
+    /**
+     * Search pages for a regular expression on a background thread, streaming the matches of
+     * each page with their highlight rects to the listener. Pages do not have to be opened, the
+     * search reads text in gaps between other pdfium calls, so it does not hold up rendering.
+     * A running search of the document is stopped first.<br>
+     * The page break counts as a line break, so a phrase continued on the next page is found
+     * with {@code \s} between its words, like a phrase continued on the next line.<br>
+     * Matching takes time linear in the text length for any pattern, as matches are at most 500
+     * characters long; patterns may nest groups and quantifiers 200 deep. Supported are literals,
+     * {@code .}, classes like {@code [a-z]} and {@code \d \w \s}, anchors {@code ^ $ \b},
+     * groups, alternation and greedy or lazy repetition; backreferences and lookaround are not.
+     * Compiled patterns are cached, so searching again while typing only compiles new patterns.
+     *
+     * @param flags    combination of {@link #SEARCH_IGNORE_CASE} and
+     *                 {@link #SEARCH_IGNORE_DIACRITICS}
+     * @param fromPage first page to search
+     * @param toPage   last page to search, inclusive
+     * @throws IllegalArgumentException if the pattern is invalid
+     */
+    public void startRegexSearch(PdfDocument doc, String pattern, int flags, int fromPage,
+                                 int toPage, OnSearchListener listener) {
+        synchronized (doc) {
+            stopSearch(doc);
+            doc.mNativeSearchPtr = nativeStartRegexSearch(doc.mNativeDocPtr, pattern, flags,
+                    fromPage, toPage, listener);
+        }
+    }
+
+    /** Stop the search of the document, waiting for a listener call in progress */
+    public void stopSearch(PdfDocument doc) {
+        synchronized (doc) {
+            if (doc.mNativeSearchPtr == 0) {
+                return;
+            }
+            nativeStopSearch(doc.mNativeSearchPtr);
+            doc.mNativeSearchPtr = 0;
+        }
+    }
+
     /**
      * Map page coordinates to device screen coordinates
      *
@@ -439,11 +1569,58 @@ public class PdfiumCore {
      */
     public RectF mapRectToDevice(PdfDocument doc, int pageIndex, int startX, int startY, int sizeX,
                                  int sizeY, int rotate, RectF coords) {
+        float[] points = {coords.left, coords.top, coords.right, coords.bottom};
+        if (!mapPageCoordsToDevice(doc, pageIndex, startX, startY, sizeX, sizeY, rotate,
+                points, points)) {
+            return new RectF();
+        }
+        return new RectF(points[0], points[1], points[2], points[3]);
+    }
+
+    /**
+     * Map many points from page coordinates to device coordinates in one native call.<br>
+     * Uses the same transform and whole-pixel rounding as
+     * {@link PdfiumCore#mapPageCoordsToDevice(PdfDocument, int, int, int, int, int, int, double, double)}.
+     * This method requires page to be opened.
+     *
+     * @param pageCoords   packed (x, y) pairs in page coordinates
+     * @param deviceCoords receives packed (x, y) pairs in device coordinates, may be the same
+     *                     array as {@code pageCoords}
+     * @return false if page is not opened or display area is empty
+     */
+    public boolean mapPageCoordsToDevice(PdfDocument doc, int pageIndex, int startX, int startY,
+                                         int sizeX, int sizeY, int rotate,
+                                         float[] pageCoords, float[] deviceCoords) {
+        synchronized (lock) {
+            Long pagePtr = doc.mNativePagesPtr.get(pageIndex);
+            if (pagePtr == null) {
+                return false;
+            }
+            return nativeMapPageCoordsToDevice(pagePtr, startX, startY, sizeX, sizeY, rotate,
+                    pageCoords, deviceCoords);
+        }
+    }
 
-        Point leftTop = mapPageCoordsToDevice(doc, pageIndex, startX, startY, sizeX, sizeY, rotate,
-                coords.left, coords.top);
-        Point rightBottom = mapPageCoordsToDevice(doc, pageIndex, startX, startY, sizeX, sizeY, rotate,
-                coords.right, coords.bottom);
-        return new RectF(leftTop.x, leftTop.y, rightBottom.x, rightBottom.y);
+    /**
+     * Map many points from device coordinates to page coordinates in one native call.
+     * Inverse of {@link PdfiumCore#mapPageCoordsToDevice(PdfDocument, int, int, int, int, int, int, float[], float[])},
+     * results are not rounded.
+     *
+     * @param deviceCoords packed (x, y) pairs in device coordinates
+     * @param pageCoords   receives packed (x, y) pairs in page coordinates, may be the same
+     *                     array as {@code deviceCoords}
+     * @return false if page is not opened or display area is empty
+     */
+    public boolean mapDeviceCoordsToPage(PdfDocument doc, int pageIndex, int startX, int startY,
+                                         int sizeX, int sizeY, int rotate,
+                                         float[] deviceCoords, float[] pageCoords) {
+        synchronized (lock) {
+            Long pagePtr = doc.mNativePagesPtr.get(pageIndex);
+            if (pagePtr == null) {
+                return false;
+            }
+            return nativeMapDeviceCoordsToPage(pagePtr, startX, startY, sizeX, sizeY, rotate,
+                    deviceCoords, pageCoords);
+        }
     }
 }
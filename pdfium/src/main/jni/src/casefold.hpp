@@ -0,0 +1,187 @@
+#ifndef _CASEFOLD_HPP_
+#define _CASEFOLD_HPP_
+
+// Case and diacritic folding for search. Page text is folded once into a shadow buffer that maps
+// every UTF-16 unit back to its character index, so a folded search scans as fast as a plain one.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "pagetext.hpp"
+
+namespace text {
+
+static const int FOLD_CASE = 1;
+static const int FOLD_DIACRITICS = 2;
+// A character folds into at most this many UTF-16 units, e.g. "ß" into "ss"
+static const int MAX_FOLDED_UNITS = 2;
+
+// Base letters of U+00C0..U+017F, '.' where the character has none. Digits mark ligatures:
+// 1 ae, 2 oe, 3 ij, 4 ss.
+static const char LATIN_BASE_LETTERS[] =
+        "aaaaaa1ceeeeiiiidnooooo.ouuuuy.4aaaaaa1ceeeeiiiidnooooo.ouuuuy.y"
+        "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii33jjkk.lllllll"
+        "lllnnnnnnn..oooooo22rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+static const uint32_t LATIN_BASE_FIRST = 0xC0;
+static const uint32_t LATIN_BASE_LAST = 0x17F;
+
+static const char *const LIGATURES[] = {"ae", "oe", "ij", "ss"};
+
+// Greek letters with tonos or dialytika in U+0386..U+03CE, 0 where there is nothing to strip
+static const uint16_t GREEK_BASE_LETTERS[] = {
+        0x391, 0, 0x395, 0x397, 0x399, 0, 0x39F, 0, 0x3A5, 0x3A9, 0x3B9, 0, 0, 0, 0, 0,  // 0386
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                                   // 0396
+        0, 0, 0, 0, 0x399, 0x3A5, 0x3B1, 0x3B5, 0x3B7, 0x3B9, 0x3C5, 0, 0, 0, 0, 0,       // 03A6
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                                   // 03B6
+        0, 0, 0, 0, 0x3B9, 0x3C5, 0x3BF, 0x3C5, 0x3C9                                     // 03C6
+};
+static const uint32_t GREEK_BASE_FIRST = 0x386;
+static const uint32_t GREEK_BASE_LAST = 0x3CE;
+
+// Covers ASCII, Latin-1, Latin Extended-A, modern Greek, basic Cyrillic and fullwidth Latin
+inline uint32_t toLowerCase(uint32_t c) {
+    if (c < 0x80) return c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+    if (c >= 0xC0 && c <= 0xDE && c != 0xD7) return c + 0x20;
+    if (c >= 0x100 && c <= 0x17F) {
+        if (c == 0x130) return 'i';
+        if (c == 0x178) return 0xFF;
+        // Pairs start on even code points, except in U+0139..U+0148 and U+0179..U+017E
+        bool oddPairs = (c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E);
+        if (c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17F) return c;
+        return (c & 1) == (oddPairs ? 1u : 0u) ? c + 1 : c;
+    }
+    if (c >= 0x391 && c <= 0x3AB && c != 0x3A2) return c + 0x20;
+    if (c == 0x386) return 0x3AC;
+    if (c >= 0x388 && c <= 0x38A) return c + 0x25;
+    if (c == 0x38C) return 0x3CC;
+    if (c == 0x38E || c == 0x38F) return c + 0x3F;
+    if (c == 0x3C2) return 0x3C3; // final sigma
+    if (c >= 0x410 && c <= 0x42F) return c + 0x20;
+    if (c >= 0x400 && c <= 0x40F) return c + 0x50;
+    if (c >= 0xFF21 && c <= 0xFF3A) return c + 0x20;
+    return c;
+}
+
+inline bool isCombiningMark(uint32_t c) {
+    return c >= 0x300 && c <= 0x36F;
+}
+
+// Writes the folded form of a character to out, returns the number of units (0 if dropped)
+inline int foldChar(uint32_t c, int mode, char16_t *out) {
+    if (mode & FOLD_DIACRITICS) {
+        if (isCombiningMark(c)) return 0;
+        bool upper = toLowerCase(c) != c;
+        if (c >= LATIN_BASE_FIRST && c <= LATIN_BASE_LAST) {
+            char base = LATIN_BASE_LETTERS[c - LATIN_BASE_FIRST];
+            if (base >= '1' && base <= '4') {
+                const char *ligature = LIGATURES[base - '1'];
+                bool lower = (mode & FOLD_CASE) || !upper;
+                out[0] = lower ? ligature[0] : ligature[0] - 0x20;
+                out[1] = lower ? ligature[1] : ligature[1] - 0x20;
+                return 2;
+            }
+            if (base != '.') {
+                out[0] = (mode & FOLD_CASE) || !upper ? base : base - 0x20;
+                return 1;
+            }
+        } else if (c >= GREEK_BASE_FIRST && c <= GREEK_BASE_LAST) {
+            uint16_t base = GREEK_BASE_LETTERS[c - GREEK_BASE_FIRST];
+            if (base != 0) c = base;
+        } else if (c == 0x401) {
+            c = 0x415; // Ё to Е
+        } else if (c == 0x451) {
+            c = 0x435; // ё to е
+        }
+    }
+    if (mode & FOLD_CASE) c = toLowerCase(c);
+    if (c > 0xFFFF) {
+        c -= 0x10000;
+        out[0] = (char16_t) (0xD800 | (c >> 10));
+        out[1] = (char16_t) (0xDC00 | (c & 0x3FF));
+        return 2;
+    }
+    out[0] = (char16_t) c;
+    return 1;
+}
+
+// Folds UTF-16 text such as a search query
+inline void foldText(const char16_t *text, size_t length, int mode, std::vector<char16_t> *out) {
+    char16_t folded[MAX_FOLDED_UNITS];
+    for (size_t i = 0; i < length; i++) {
+        uint32_t c = text[i];
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < length
+                && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+        }
+        int count = foldChar(c, mode, folded);
+        out->insert(out->end(), folded, folded + count);
+    }
+}
+
+// Folded shadow of a page's text with the character index of every unit
+class FoldedText {
+  public:
+    FoldedText() : foldMode(-1), charCount(0) {}
+
+    int mode() const { return foldMode; }
+
+    void build(const PageText &content, int mode) {
+        foldMode = mode;
+        charCount = content.charCount();
+        units.clear();
+        charIndex.clear();
+        units.reserve(content.text().size());
+        charIndex.reserve(content.text().size());
+        char16_t folded[MAX_FOLDED_UNITS];
+        for (int i = 0; i < charCount; i++) {
+            uint32_t c = content.codePointAt(i);
+            if (c == 0) continue;
+            int count = foldChar(c, mode, folded);
+            for (int u = 0; u < count; u++) {
+                units.push_back(folded[u]);
+                charIndex.push_back(i);
+            }
+        }
+    }
+
+    // Appends [start, end) character ranges of non-overlapping matches. The end extends over
+    // characters folded away, like combining marks, so highlights cover them.
+    void findAll(const std::vector<char16_t> &pattern, std::vector<int> *ranges) const {
+        size_t m = pattern.size();
+        size_t n = units.size();
+        if (m == 0 || m > n) return;
+
+        // Horspool with the skip table indexed by the low byte of each unit
+        size_t shift[256];
+        for (int i = 0; i < 256; i++) shift[i] = m;
+        for (size_t i = 0; i + 1 < m; i++) shift[pattern[i] & 0xFF] = m - 1 - i;
+
+        const char16_t *p = pattern.data();
+        size_t pos = 0;
+        while (pos + m <= n) {
+            char16_t last = units[pos + m - 1];
+            if (last == p[m - 1] && memcmp(&units[pos], p, (m - 1) * sizeof(char16_t)) == 0) {
+                int start = charIndex[pos];
+                int end = charIndex[pos + m - 1] + 1;
+                int next = pos + m < n ? charIndex[pos + m] : charCount;
+                if (next > end) end = next;
+                ranges->push_back(start);
+                ranges->push_back(end);
+                pos += m;
+            } else {
+                pos += shift[last & 0xFF];
+            }
+        }
+    }
+
+  private:
+    int foldMode;
+    int charCount;
+    std::vector<char16_t> units;
+    std::vector<int> charIndex;
+};
+
+} // namespace text
+
+#endif //_CASEFOLD_HPP_
@@ -0,0 +1,167 @@
+#ifndef _LZ_HPP_
+#define _LZ_HPP_
+
+// Byte-oriented LZ77 codec using the LZ4 block layout. Compression is a single greedy pass,
+// decompression is a memcpy loop, which keeps cache hits much cheaper than rendering.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace lz {
+
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_FIND_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 14;
+
+inline size_t maxCompressedSize(size_t size) {
+    return size + size / 255 + 16;
+}
+
+inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint32_t hash32(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+inline uint8_t *writeLength(uint8_t *op, const uint8_t *opEnd, size_t length) {
+    while (length >= 255) {
+        if (op >= opEnd) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= opEnd) return NULL;
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+inline uint8_t *writeSequence(uint8_t *op, const uint8_t *opEnd, const uint8_t *literals,
+                              size_t literalLength, size_t offset, size_t matchLength) {
+    if (op >= opEnd) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t) ((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15 && (op = writeLength(op, opEnd, literalLength - 15)) == NULL) {
+        return NULL;
+    }
+    if ((size_t) (opEnd - op) < literalLength) return NULL;
+    // Empty input may come with null buffers, which memcpy must not get even for 0 bytes
+    if (literalLength > 0) memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (matchLength == 0) return op; // last sequence has literals only
+
+    if (opEnd - op < 2) return NULL;
+    *op++ = (uint8_t) (offset & 0xFF);
+    *op++ = (uint8_t) (offset >> 8);
+    size_t length = matchLength - MIN_MATCH;
+    *token |= (uint8_t) (length >= 15 ? 15 : length);
+    if (length >= 15 && (op = writeLength(op, opEnd, length - 15)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+// Returns compressed size, or 0 if dst is too small
+inline size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint8_t *op = dst;
+    const uint8_t *opEnd = dst + capacity;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    if (size >= MATCH_FIND_LIMIT) {
+        const size_t matchEnd = size - LAST_LITERALS;
+        const size_t limit = size - MATCH_FIND_LIMIT;
+        while (ip <= limit) {
+            uint32_t sequence = read32(src + ip);
+            uint32_t h = hash32(sequence);
+            size_t ref = table[h];
+            table[h] = (uint32_t) ip;
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != sequence) {
+                // Step faster through incompressible data
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t matchLength = MIN_MATCH;
+            while (ip + matchLength < matchEnd && src[ref + matchLength] == src[ip + matchLength]) {
+                matchLength++;
+            }
+
+            op = writeSequence(op, opEnd, src + anchor, ip - anchor, ip - ref, matchLength);
+            if (op == NULL) return 0;
+            ip += matchLength;
+            anchor = ip;
+        }
+    }
+
+    op = writeSequence(op, opEnd, src + anchor, size - anchor, 0, 0);
+    return op != NULL ? (size_t) (op - dst) : 0;
+}
+
+inline bool readLength(const uint8_t **ip, const uint8_t *ipEnd, size_t *length) {
+    uint8_t value;
+    do {
+        if (*ip >= ipEnd) return false;
+        value = *(*ip)++;
+        *length += value;
+    } while (value == 255);
+    return true;
+}
+
+// Decompresses exactly dstSize bytes, returns false on malformed input
+inline bool decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstSize) {
+    const uint8_t *ip = src;
+    const uint8_t *ipEnd = src + size;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + dstSize;
+
+    while (ip < ipEnd) {
+        uint8_t token = *ip++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(&ip, ipEnd, &literalLength)) return false;
+        if ((size_t) (ipEnd - ip) < literalLength || (size_t) (opEnd - op) < literalLength) {
+            return false;
+        }
+        if (literalLength > 0) memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == ipEnd) break;
+
+        if (ipEnd - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst)) return false;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(&ip, ipEnd, &matchLength)) return false;
+        matchLength += MIN_MATCH;
+        if ((size_t) (opEnd - op) < matchLength) return false;
+
+        // Overlapping matches repeat the last `offset` bytes; the non-overlapping part doubles
+        // on every copy, so long runs (blank page areas) take a handful of memcpy calls
+        const uint8_t *match = op - offset;
+        while (matchLength > 0) {
+            size_t chunk = (size_t) (op - match);
+            if (chunk > matchLength) chunk = matchLength;
+            memcpy(op, match, chunk);
+            op += chunk;
+            matchLength -= chunk;
+        }
+    }
+    return op == opEnd;
+}
+
+} // namespace lz
+
+#endif //_LZ_HPP_
@@ -1,5 +1,10 @@
 #include <iostream>
 #include "util.hpp"
+#include "lz.hpp"
+#include "xxhash.hpp"
+#include "pagetext.hpp"
+#include "casefold.hpp"
+#include "regex.hpp"
 #include "fpdf_text.h"
 #include "fpdf_annot.h"
 #include <fpdfview.h>
@@ -10,6 +15,18 @@ extern "C" {
     #include <sys/stat.h>
     #include <string.h>
     #include <stdio.h>
+    #include <time.h>
+    #include <dirent.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <ctype.h>
+    #include <limits.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/ioctl.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+    #include <sys/wait.h>
 }
 
 #include <android/native_window.h>
@@ -20,79 +37,166 @@ using namespace android;
 
 #include <fpdfview.h>
 #include <fpdf_doc.h>
+#include <fpdf_edit.h>
+#include <fpdf_save.h>
+#include <fpdf_ppo.h>
+#include <fpdf_flatten.h>
 #include <fpdf_annot.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 
 class PDFLinkHandlerInterface{
 public:
     virtual ~PDFLinkHandlerInterface() = default;
-    virtual std::string ExtractText(FPDF_TEXTPAGE text_page, int start_index, int count) = 0;
-    virtual std::string UTF16ToUTF8(const unsigned short* utf16, size_t length) = 0;
+    // Views point into the page text and stay valid while the page is open
+    virtual text::U16View ExtractText(FPDF_TEXTPAGE text_page, int start_index, int count) = 0;
 };
 
+// Serves text from the page's UTF-16 buffer, which is read from pdfium once per page
 class PDFLinkHandlerImpl : public PDFLinkHandlerInterface{
 public:
-    std::string ExtractText(FPDF_TEXTPAGE text_page, int start_index, int count) {
-        // Allocate buffer for 'count' wide characters (UTF-16)
-        std::vector<unsigned short> buffer(count);
-
-        // Extract text into the buffer
-        if (FPDFText_GetText(text_page, start_index, count, buffer.data()) == 0) {
-            throw std::runtime_error("Failed to extract text from the PDF page");
-        }
-
-        // Convert the UTF-16 buffer to a UTF-8 string
-        return UTF16ToUTF8(buffer.data(), count);
-    }
-
-    std::string UTF16ToUTF8(const unsigned short* utf16, size_t length) {
-        std::string utf8;
-        utf8.reserve(length * 3); // Reserve space, maximum 3 bytes per UTF-16 character
-
-        for (size_t i = 0; i < length; ++i) {
-            unsigned short ch = utf16[i];
-            if (ch <= 0x7F) {
-                utf8.push_back(static_cast<char>(ch));
-            } else if (ch <= 0x7FF) {
-                utf8.push_back(static_cast<char>(0xC0 | (ch >> 6)));
-                utf8.push_back(static_cast<char>(0x80 | (ch & 0x3F)));
-            } else if (ch >= 0xD800 && ch <= 0xDFFF) {
-                // Handle surrogate pairs
-                if (ch >= 0xD800 && ch <= 0xDBFF && i + 1 < length) {
-                    unsigned short high = ch;
-                    unsigned short low = utf16[++i];
-                    if (low >= 0xDC00 && low <= 0xDFFF) {
-                        int codepoint = ((high - 0xD800) << 10) | (low - 0xDC00);
-                        codepoint += 0x10000;
-                        utf8.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
-                        utf8.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
-                        utf8.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
-                        utf8.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
-                    } else {
-                        throw std::runtime_error("Invalid UTF-16 surrogate pair");
-                    }
-                } else {
-                    throw std::runtime_error("Unpaired surrogate character");
-                }
-            } else {
-                utf8.push_back(static_cast<char>(0xE0 | (ch >> 12)));
-                utf8.push_back(static_cast<char>(0x80 | ((ch >> 6) & 0x3F)));
-                utf8.push_back(static_cast<char>(0x80 | (ch & 0x3F)));
-            }
+    explicit PDFLinkHandlerImpl(const text::PageText &content) : content(content) {}
+
+    text::U16View ExtractText(FPDF_TEXTPAGE text_page, int start_index, int count) {
+        return content.view(start_index, count);
+    }
+
+private:
+    const text::PageText &content;
+};
+
+static long long nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct PdfiumLockStats {
+    long long acquisitions = 0;
+    long long totalHoldNanos = 0;
+    long long maxHoldNanos = 0;
+    long long totalWaitNanos = 0;
+    long long maxWaitNanos = 0;
+};
+
+// pdfium is not thread-safe, every call into it and the native state it shares (page registries,
+// text layers, prefetched pages) is serialized here. The lock is held only around those calls,
+// so bitmap locking, pixel conversion and JNI marshalling of one request overlap pdfium work of
+// the next. Reentrant, outermost acquisition is what gets timed.
+class PdfiumLock {
+  public:
+    void lock(bool background) {
+        if (bypassed) return;
+        long long start = nowNanos();
+        if (!background) foregroundWaiters++;
+        mutex.lock();
+        if (!background) foregroundWaiters--;
+        if (depth++ > 0) return;
+
+        acquiredNanos = nowNanos();
+        holderBackground = background;
+        long long wait = acquiredNanos - start;
+        stats.acquisitions++;
+        stats.totalWaitNanos += wait;
+        if (wait > stats.maxWaitNanos) stats.maxWaitNanos = wait;
+    }
+
+    void unlock() {
+        if (bypassed) return;
+        if (--depth == 0) {
+            long long now = nowNanos();
+            long long hold = now - acquiredNanos;
+            stats.totalHoldNanos += hold;
+            if (hold > stats.maxHoldNanos) stats.maxHoldNanos = hold;
+            if (!holderBackground) lastForegroundRelease.store(now);
+        }
+        mutex.unlock();
+    }
+
+    // True while foreground work waits for the lock or finished less than idleNanos ago
+    bool foregroundActive(long long idleNanos) const {
+        return foregroundWaiters.load() > 0
+               || nowNanos() - lastForegroundRelease.load() < idleNanos;
+    }
+
+    bool hasForegroundWaiters() const { return foregroundWaiters.load() > 0; }
+
+    // Background acquisition which lets foreground calls already queued for the lock go first.
+    // Nested acquisitions cannot step aside and behave like lock(true).
+    void lockBehindForeground() {
+        while (true) {
+            lock(true);
+            if (bypassed || depth > 1 || !hasForegroundWaiters()) return;
+            unlock();
+            std::this_thread::yield();
         }
+    }
 
-        return utf8;
+    PdfiumLockStats getStats(bool reset) {
+        std::lock_guard<std::recursive_mutex> guard(mutex);
+        PdfiumLockStats result = stats;
+        if (reset) stats = PdfiumLockStats();
+        return result;
     }
+
+    // Forked render workers are single threaded and inherit the mutex in whatever state the
+    // forking thread left it, so they skip locking altogether
+    void bypass() { bypassed = true; }
+    bool isBypassed() const { return bypassed; }
+
+  private:
+    std::recursive_mutex mutex;
+    // Guarded by mutex
+    int depth = 0;
+    bool holderBackground = false;
+    long long acquiredNanos = 0;
+    PdfiumLockStats stats;
+
+    std::atomic<int> foregroundWaiters{0};
+    std::atomic<long long> lastForegroundRelease{0};
+    bool bypassed = false;
+};
+
+static PdfiumLock sPdfiumLock;
+
+class PdfiumGuard {
+  public:
+    explicit PdfiumGuard(bool background = false) { sPdfiumLock.lock(background); }
+    ~PdfiumGuard() { sPdfiumLock.unlock(); }
+
+  private:
+    PdfiumGuard(const PdfiumGuard &);
+    PdfiumGuard &operator=(const PdfiumGuard &);
 };
 
-static Mutex sLibraryLock;
+// For long background pdfium work split into steps, taken once per step
+class YieldingPdfiumGuard {
+  public:
+    YieldingPdfiumGuard() { sPdfiumLock.lockBehindForeground(); }
+    ~YieldingPdfiumGuard() { sPdfiumLock.unlock(); }
+
+  private:
+    YieldingPdfiumGuard(const YieldingPdfiumGuard &);
+    YieldingPdfiumGuard &operator=(const YieldingPdfiumGuard &);
+};
 
 static int sLibraryReferenceCount = 0;
 
 static void initLibraryIfNeed(){
-    Mutex::Autolock lock(sLibraryLock);
+    PdfiumGuard guard;
     if(sLibraryReferenceCount == 0){
         LOGD("Init FPDF library");
         FPDF_InitLibrary();
@@ -101,7 +205,7 @@ static void initLibraryIfNeed(){
 }
 
 static void destroyLibraryIfNeed(){
-    Mutex::Autolock lock(sLibraryLock);
+    PdfiumGuard guard;
     sLibraryReferenceCount--;
     if(sLibraryReferenceCount == 0){
         LOGD("Destroy FPDF library");
@@ -115,18 +219,377 @@ struct rgb {
     uint8_t blue;
 };
 
-class DocumentFile {
-    private:
-    int fileFd;
+// Text layer of an opened page. Created on first use and released together with the page.
+struct PageTextCache {
+    FPDF_TEXTPAGE textPage = NULL;
+    // Whole-page UTF-16 text, filled by getPageTextContent
+    text::PageText content;
+    bool contentLoaded = false;
+    // Word index in character order, filled by getPageWords; boxes in page coordinates
+    std::vector<text::WordSpan> words;
+    std::vector<FS_RECTF> wordBoxes;
+    bool wordsLoaded = false;
+    // Folded text of the last search mode, rebuilt when the mode changes
+    text::FoldedText folded;
+};
+
+// Keyed by page handle, so any code holding an FPDF_PAGE shares one text layer per page.
+// Guarded by the pdfium lock.
+static std::map<FPDF_PAGE, PageTextCache*> sPageTextCache;
+
+static PageTextCache *getPageText(FPDF_PAGE page) {
+    std::map<FPDF_PAGE, PageTextCache*>::iterator it = sPageTextCache.find(page);
+    if (it != sPageTextCache.end()) return it->second;
+
+    FPDF_TEXTPAGE textPage = FPDFText_LoadPage(page);
+    if (textPage == NULL) return NULL;
+    PageTextCache *cache = new PageTextCache();
+    cache->textPage = textPage;
+    sPageTextCache[page] = cache;
+    return cache;
+}
+
+static const text::PageText &getPageTextContent(PageTextCache *cache) {
+    if (!cache->contentLoaded) {
+        int count = std::max(FPDFText_CountChars(cache->textPage), 0);
+        std::vector<uint32_t> codePoints(count);
+        for (int i = 0; i < count; i++) {
+            codePoints[i] = FPDFText_GetUnicode(cache->textPage, i);
+        }
+        cache->content.assign(codePoints.data(), codePoints.size());
+        cache->contentLoaded = true;
+    }
+    return cache->content;
+}
+
+static void getPageWords(PageTextCache *cache) {
+    if (cache->wordsLoaded) return;
+    text::findWords(getPageTextContent(cache), &cache->words);
+    cache->wordBoxes.resize(cache->words.size());
+    for (size_t w = 0; w < cache->words.size(); w++) {
+        const text::WordSpan &word = cache->words[w];
+        FS_RECTF &box = cache->wordBoxes[w];
+        bool empty = true;
+        for (int i = word.start; i < word.end; i++) {
+            double left, right, bottom, top;
+            FPDFText_GetCharBox(cache->textPage, i, &left, &right, &bottom, &top);
+            if (left == right && bottom == top) continue;
+            if (empty) {
+                box.left = (float) left;
+                box.right = (float) right;
+                box.bottom = (float) bottom;
+                box.top = (float) top;
+                empty = false;
+            } else {
+                box.left = std::min(box.left, (float) left);
+                box.right = std::max(box.right, (float) right);
+                box.bottom = std::min(box.bottom, (float) bottom);
+                box.top = std::max(box.top, (float) top);
+            }
+        }
+        if (empty) box.left = box.right = box.bottom = box.top = 0;
+    }
+    cache->wordsLoaded = true;
+}
+
+static void releasePageText(FPDF_PAGE page) {
+    std::map<FPDF_PAGE, PageTextCache*>::iterator it = sPageTextCache.find(page);
+    if (it == sPageTextCache.end()) return;
+
+    FPDFText_ClosePage(it->second->textPage);
+    delete it->second;
+    sPageTextCache.erase(it);
+}
+
+struct CharBox {
+    double left;
+    double right;
+    double bottom;
+    double top;
+};
+
+// Must match PdfPageText.BREAK_PARAGRAPH, packed breaks are offset << 1 | flag
+static const int TEXT_BREAK_PARAGRAPH = 1;
+// Vertical gap between lines, in line heights, that starts a new paragraph
+static const double PARAGRAPH_GAP_LINES = 0.8;
+
+// Finds line and paragraph starts from character boxes fed in text order. A character starts a
+// new line when it overlaps the current line vertically by less than half the smaller height, and
+// a paragraph when it also leaves a gap of PARAGRAPH_GAP_LINES or moves up (next column).
+// Characters without a box, like generated spaces and line ends, are ignored.
+class TextBreakDetector {
+  public:
+    enum Break {
+        BREAK_NONE,
+        BREAK_LINE,
+        BREAK_PARAGRAPH
+    };
+
+    Break add(const CharBox &box) {
+        double height = box.top - box.bottom;
+        if (height <= 0) return BREAK_NONE;
+        if (!hasLine) {
+            startLine(box);
+            return BREAK_NONE;
+        }
+
+        double lineHeight = lineTop - lineBottom;
+        double overlap = std::min(lineTop, box.top) - std::max(lineBottom, box.bottom);
+        if (overlap > 0.5 * std::min(lineHeight, height)) {
+            lineTop = std::max(lineTop, box.top);
+            lineBottom = std::min(lineBottom, box.bottom);
+            return BREAK_NONE;
+        }
+
+        bool paragraph = box.bottom > lineTop
+                         || lineBottom - box.top > PARAGRAPH_GAP_LINES * lineHeight;
+        startLine(box);
+        return paragraph ? BREAK_PARAGRAPH : BREAK_LINE;
+    }
+
+  private:
+    bool hasLine = false;
+    double lineTop = 0;
+    double lineBottom = 0;
+
+    void startLine(const CharBox &box) {
+        hasLine = true;
+        lineTop = box.top;
+        lineBottom = box.bottom;
+    }
+};
+
+// Packed breaks of a text page in one pass over its characters. Offsets are UTF-16 indices into
+// FPDFText_GetText output, which skips characters without unicode and encodes the rest as UTF-16.
+static void collectTextBreaks(FPDF_TEXTPAGE textPage, const text::PageText &content,
+                              std::vector<jint> *breaks) {
+    TextBreakDetector detector;
+    int charCount = content.charCount();
+    for (int i = 0; i < charCount; i++) {
+        if (content.codePointAt(i) == 0) continue;
+
+        CharBox box;
+        FPDFText_GetCharBox(textPage, i, &box.left, &box.right, &box.bottom, &box.top);
+        TextBreakDetector::Break found = detector.add(box);
+        jint offset = (jint) content.offsetOf(i);
+        if (found == TextBreakDetector::BREAK_LINE) {
+            breaks->push_back(offset << 1);
+        } else if (found == TextBreakDetector::BREAK_PARAGRAPH) {
+            breaks->push_back((offset << 1) | TEXT_BREAK_PARAGRAPH);
+        }
+    }
+}
 
+// Merges highlight rects in text order, as from FPDFText_GetRect, into one rect per run of a
+// line. Neighbours are merged when they overlap vertically like characters of one line and the
+// horizontal gap between them is below the line height, so separate columns stay separate.
+static void mergeLineRects(std::vector<CharBox> *rects) {
+    size_t merged = 0;
+    for (size_t i = 0; i < rects->size(); i++) {
+        const CharBox &rect = (*rects)[i];
+        if (rect.top - rect.bottom <= 0 || rect.right - rect.left <= 0) continue;
+        if (merged > 0) {
+            CharBox &last = (*rects)[merged - 1];
+            double height = std::min(last.top - last.bottom, rect.top - rect.bottom);
+            double overlap = std::min(last.top, rect.top) - std::max(last.bottom, rect.bottom);
+            double gap = std::max(rect.left - last.right, last.left - rect.right);
+            if (overlap > 0.5 * height && gap < height) {
+                last.left = std::min(last.left, rect.left);
+                last.right = std::max(last.right, rect.right);
+                last.bottom = std::min(last.bottom, rect.bottom);
+                last.top = std::max(last.top, rect.top);
+                continue;
+            }
+        }
+        (*rects)[merged++] = rect;
+    }
+    rects->resize(merged);
+}
+
+struct PositionedChar {
+    uint32_t codePoint;
+    CharBox box;
+};
+
+static void appendUtf16(uint32_t codePoint, std::vector<jchar> *out) {
+    if (codePoint > 0xFFFF) {
+        codePoint -= 0x10000;
+        out->push_back((jchar) (0xD800 | (codePoint >> 10)));
+        out->push_back((jchar) (0xDC00 | (codePoint & 0x3FF)));
+    } else {
+        out->push_back((jchar) codePoint);
+    }
+}
+
+static bool isAbove(const PositionedChar &a, const PositionedChar &b) {
+    return a.box.top + a.box.bottom > b.box.top + b.box.bottom;
+}
+
+static bool isLeftOf(const PositionedChar &a, const PositionedChar &b) {
+    return a.box.left < b.box.left;
+}
+
+// Horizontal gap between characters, in character heights, that separates words
+static const double WORD_GAP_HEIGHTS = 0.3;
+
+// Appends characters as lines ordered top to bottom, each left to right, regardless of the
+// order the content stream drew them in. Lines are grouped like in TextBreakDetector and a space
+// is inserted at word gaps that have no space character.
+static void appendSortedLines(std::vector<PositionedChar> *chars, std::vector<jchar> *out) {
+    std::stable_sort(chars->begin(), chars->end(), isAbove);
+    size_t lineStart = 0;
+    while (lineStart < chars->size()) {
+        double lineTop = (*chars)[lineStart].box.top;
+        double lineBottom = (*chars)[lineStart].box.bottom;
+        size_t lineEnd = lineStart + 1;
+        for (; lineEnd < chars->size(); lineEnd++) {
+            const CharBox &box = (*chars)[lineEnd].box;
+            double height = std::min(lineTop - lineBottom, box.top - box.bottom);
+            double overlap = std::min(lineTop, box.top) - std::max(lineBottom, box.bottom);
+            if (overlap <= 0.5 * height) break;
+            lineTop = std::max(lineTop, box.top);
+            lineBottom = std::min(lineBottom, box.bottom);
+        }
+        std::stable_sort(chars->begin() + lineStart, chars->begin() + lineEnd, isLeftOf);
+
+        if (lineStart > 0) out->push_back('\n');
+        const PositionedChar *previous = NULL;
+        for (size_t i = lineStart; i < lineEnd; i++) {
+            const PositionedChar &current = (*chars)[i];
+            bool space = current.codePoint == ' ';
+            bool previousSpace = previous == NULL || previous->codePoint == ' ';
+            if (space && previousSpace) continue;
+            if (!space && !previousSpace) {
+                double height = std::min(previous->box.top - previous->box.bottom,
+                                         current.box.top - current.box.bottom);
+                if (current.box.left - previous->box.right > WORD_GAP_HEIGHTS * height) {
+                    out->push_back(' ');
+                }
+            }
+            appendUtf16(current.codePoint, out);
+            previous = &current;
+        }
+        lineStart = lineEnd;
+    }
+}
+
+class DocumentFile;
+
+// Owner of each page handed out by DocumentFile::loadPage, so per-page work can reach the
+// document's state without passing the document through every JNI call
+struct LoadedPage {
+    DocumentFile *doc;
+    int index;
+};
+
+static std::map<FPDF_PAGE, LoadedPage> sLoadedPages;
+
+static void closePageInternal(jlong pagePtr);
+
+struct PrefetchedPage {
+    FPDF_PAGE page;
+    size_t bytes;
+};
+
+static const double COST_BASE_UNITS = 20;
+static const double COST_TRANSPARENT_OBJECT_UNITS = 3;
+static const double COST_TRANSPARENT_PAGE_FACTOR = 1.5;
+// Per-object work independent of resolution, expressed as equivalent megapixels
+static const double COST_FIXED_MEGAPIXELS = 0.5;
+static const double COST_MIN_SAMPLE_WEIGHT = 0.125;
+
+// Predicts render time of pages from their parsed content. Complexity is counted in units of one
+// page object, transparent objects weigh more since they are composited through extra buffers.
+// Cost of a unit differs a lot between documents (fonts, image codecs, shadings), so it is
+// calibrated from render times measured on the document itself.
+class RenderCostModel {
+  public:
+    struct Complexity {
+        int objectCount;
+        int transparentObjectCount;
+        bool transparent;
+        double units;
+    };
+
+    const Complexity &getComplexity(int pageIndex, FPDF_PAGE page) {
+        std::map<int, Complexity>::iterator it = pages.find(pageIndex);
+        if (it != pages.end()) return it->second;
+
+        Complexity complexity;
+        complexity.objectCount = FPDFPage_CountObject(page);
+        complexity.transparentObjectCount = 0;
+        for (int i = 0; i < complexity.objectCount; i++) {
+            FPDF_PAGEOBJECT object = FPDFPage_GetObject(page, i);
+            if (object != NULL && FPDFPageObj_HasTransparency(object)) {
+                complexity.transparentObjectCount++;
+            }
+        }
+        complexity.transparent = FPDFPage_HasTransparency(page);
+        complexity.units = COST_BASE_UNITS + complexity.objectCount
+                           + COST_TRANSPARENT_OBJECT_UNITS * complexity.transparentObjectCount;
+        if (complexity.transparent) complexity.units *= COST_TRANSPARENT_PAGE_FACTOR;
+        return pages[pageIndex] = complexity;
+    }
+
+    const Complexity *findComplexity(int pageIndex) const {
+        std::map<int, Complexity>::const_iterator it = pages.find(pageIndex);
+        return it != pages.end() ? &it->second : NULL;
+    }
+
+    double estimateMillis(const Complexity &complexity, double megapixels) const {
+        return exp(logMillisPerUnit) * complexity.units * (COST_FIXED_MEGAPIXELS + megapixels);
+    }
+
+    void recordRender(const Complexity &complexity, double megapixels, long long nanos) {
+        if (megapixels <= 0 || nanos <= 0) return;
+        double sample = (nanos / 1e6) / (complexity.units * (COST_FIXED_MEGAPIXELS + megapixels));
+        // Running mean while samples are few, then exponential decay; averaging in log space keeps
+        // a single stalled render from skewing the estimate
+        sampleCount++;
+        double weight = std::max(1.0 / (sampleCount + 1), COST_MIN_SAMPLE_WEIGHT);
+        logMillisPerUnit += weight * (log(sample) - logMillisPerUnit);
+    }
+
+    int getSampleCount() const { return sampleCount; }
+
+  private:
+    std::map<int, Complexity> pages;
+    // Prior of 0.01 ms per unit and megapixel, a typical text page at 2 MP takes ~10 ms
+    double logMillisPerUnit = log(0.01);
+    int sampleCount = 0;
+};
+
+class DocumentFile {
     public:
+    int fileFd = -1;
     FPDF_DOCUMENT pdfDocument = NULL;
     size_t fileSize;
+    // Set when an asynchronous open is cancelled, file reads fail from then on to end parsing
+    std::atomic<bool> loadCancelled{false};
+
+    // Pages loaded ahead of time by PagePrefetcher, not yet handed to Java
+    std::map<int, PrefetchedPage> prefetchedPages;
+    size_t prefetchedBytes = 0;
+    // Pages handed to Java, they stay open until the document is closed
+    std::map<int, FPDF_PAGE> openedPages;
+
+    RenderCostModel costModel;
 
     DocumentFile() { initLibraryIfNeed(); }
     ~DocumentFile();
+
+    FPDF_PAGE loadPage(int pageIndex);
+    void releasePrefetchedPage(int pageIndex);
 };
 DocumentFile::~DocumentFile(){
+    PdfiumGuard guard;
+    for (std::map<int, FPDF_PAGE>::iterator it = openedPages.begin(); it != openedPages.end(); ++it) {
+        sLoadedPages.erase(it->second);
+    }
+    while (!prefetchedPages.empty()) {
+        releasePrefetchedPage(prefetchedPages.begin()->first);
+    }
+
     if(pdfDocument != NULL){
         FPDF_CloseDocument(pdfDocument);
     }
@@ -134,6 +597,59 @@ DocumentFile::~DocumentFile(){
     destroyLibraryIfNeed();
 }
 
+FPDF_PAGE DocumentFile::loadPage(int pageIndex){
+    PdfiumGuard guard;
+    FPDF_PAGE page;
+    std::map<int, PrefetchedPage>::iterator it = prefetchedPages.find(pageIndex);
+    if (it != prefetchedPages.end()) {
+        page = it->second.page;
+        prefetchedBytes -= it->second.bytes;
+        prefetchedPages.erase(it);
+    } else {
+        page = FPDF_LoadPage(pdfDocument, pageIndex);
+    }
+
+    if (page != NULL) {
+        openedPages[pageIndex] = page;
+        LoadedPage loaded;
+        loaded.doc = this;
+        loaded.index = pageIndex;
+        sLoadedPages[page] = loaded;
+    }
+    return page;
+}
+
+static void closePageInternal(jlong pagePtr) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PdfiumGuard guard;
+    releasePageText(page);
+
+    std::map<FPDF_PAGE, LoadedPage>::iterator it = sLoadedPages.find(page);
+    if (it != sLoadedPages.end()) {
+        std::map<int, FPDF_PAGE> &opened = it->second.doc->openedPages;
+        std::map<int, FPDF_PAGE>::iterator openedIt = opened.find(it->second.index);
+        if (openedIt != opened.end() && openedIt->second == page) opened.erase(openedIt);
+        sLoadedPages.erase(it);
+    }
+    FPDF_ClosePage(page);
+}
+
+// A page may be closed by another thread between a JNI call receiving its handle and taking the
+// pdfium lock, so work outside the Java lock checks the page under the pdfium lock first
+static bool isLivePage(FPDF_PAGE page) {
+    return sPdfiumLock.isBypassed() || sLoadedPages.count(page) > 0;
+}
+
+void DocumentFile::releasePrefetchedPage(int pageIndex){
+    PdfiumGuard guard;
+    std::map<int, PrefetchedPage>::iterator it = prefetchedPages.find(pageIndex);
+    if (it == prefetchedPages.end()) return;
+
+    closePageInternal(reinterpret_cast<jlong>(it->second.page));
+    prefetchedBytes -= it->second.bytes;
+    prefetchedPages.erase(it);
+}
+
 template <class string_type>
 inline typename string_type::value_type* WriteInto(string_type* str, size_t length_with_null) {
   str->reserve(length_with_null);
@@ -235,130 +751,1485 @@ void rgbBitmapTo565(void *source, int sourceStride, void *dest, AndroidBitmapInf
     }
 }
 
+// Affine transform between device and page space:
+// x' = a * x + c * y + e, y' = b * x + d * y + f
+struct PageTransform {
+    double a, b, c, d, e, f;
+};
 
-extern "C" { //For JNI support
+// FPDF_DeviceToPage is affine and returns exact doubles, so sampling it at three corners of the
+// display area recovers the same matrix pdfium uses (page rotation and media box origin included).
+static bool getDeviceToPageTransform(FPDF_PAGE page, int startX, int startY, int sizeX, int sizeY,
+                                     int rotate, PageTransform *m) {
+    if (page == NULL || sizeX == 0 || sizeY == 0) return false;
+
+    double x0, y0, x1, y1, x2, y2;
+    PdfiumGuard guard;
+    FPDF_DeviceToPage(page, startX, startY, sizeX, sizeY, rotate, startX, startY, &x0, &y0);
+    FPDF_DeviceToPage(page, startX, startY, sizeX, sizeY, rotate, startX + sizeX, startY, &x1, &y1);
+    FPDF_DeviceToPage(page, startX, startY, sizeX, sizeY, rotate, startX, startY + sizeY, &x2, &y2);
+
+    m->a = (x1 - x0) / sizeX;
+    m->b = (y1 - y0) / sizeX;
+    m->c = (x2 - x0) / sizeY;
+    m->d = (y2 - y0) / sizeY;
+    m->e = x0 - m->a * startX - m->c * startY;
+    m->f = y0 - m->b * startX - m->d * startY;
+    return true;
+}
 
-static int getBlock(void* param, unsigned long position, unsigned char* outBuffer,
-        unsigned long size) {
-    const int fd = reinterpret_cast<intptr_t>(param);
-    const int readCount = pread(fd, outBuffer, size, position);
-    if (readCount < 0) {
-        LOGE("Cannot read from file descriptor. Error:%d", errno);
-        return 0;
+static bool invertTransform(const PageTransform &m, PageTransform *inv) {
+    double det = m.a * m.d - m.b * m.c;
+    if (det == 0) return false;
+
+    inv->a = m.d / det;
+    inv->b = -m.b / det;
+    inv->c = -m.c / det;
+    inv->d = m.a / det;
+    inv->e = (m.c * m.f - m.d * m.e) / det;
+    inv->f = (m.b * m.e - m.a * m.f) / det;
+    return true;
+}
+
+// Maps packed (x, y) pairs. Branch-free body so the compiler can vectorize it; in and out may alias.
+static void transformPoints(const PageTransform &m, const float *in, float *out, int pointCount,
+                            bool roundToPixel) {
+    const float a = (float) m.a, b = (float) m.b, c = (float) m.c;
+    const float d = (float) m.d, e = (float) m.e, f = (float) m.f;
+    const float bias = roundToPixel ? 0.5f : 0.0f;
+
+    for (int i = 0; i < pointCount; i++) {
+        float x = in[2 * i];
+        float y = in[2 * i + 1];
+        out[2 * i] = a * x + c * y + e + bias;
+        out[2 * i + 1] = b * x + d * y + f + bias;
+    }
+    if (roundToPixel) {
+        // Same rounding as FPDF_PageToDevice, which returns whole device pixels
+        for (int i = 0; i < pointCount * 2; i++) {
+            out[i] = floorf(out[i]);
+        }
     }
-    return 1;
 }
 
-JNI_FUNC(jlong, PdfiumCore, nativeOpenDocument)(JNI_ARGS, jint fd, jstring password){
+static jboolean mapCoordsArray(JNIEnv *env, const PageTransform &m, jfloatArray src, jfloatArray dst,
+                               bool roundToPixel) {
+    jsize length = env->GetArrayLength(src);
+    if (length % 2 != 0 || env->GetArrayLength(dst) < length) {
+        jniThrowException(env, "java/lang/IllegalArgumentException",
+                               "Coordinates must be packed (x, y) pairs");
+        return JNI_FALSE;
+    }
 
-    size_t fileLength = (size_t)getFileSize(fd);
-    if(fileLength <= 0) {
-        jniThrowException(env, "java/io/IOException",
-                                    "File is empty");
-        return -1;
+    float *in = (float*) env->GetPrimitiveArrayCritical(src, NULL);
+    float *out = (float*) env->GetPrimitiveArrayCritical(dst, NULL);
+    if (in == NULL || out == NULL) {
+        if (out != NULL) env->ReleasePrimitiveArrayCritical(dst, out, JNI_ABORT);
+        if (in != NULL) env->ReleasePrimitiveArrayCritical(src, in, JNI_ABORT);
+        return JNI_FALSE;
     }
 
-    DocumentFile *docFile = new DocumentFile();
+    transformPoints(m, in, out, length / 2, roundToPixel);
 
-    FPDF_FILEACCESS loader;
-    loader.m_FileLen = fileLength;
-    loader.m_Param = reinterpret_cast<void*>(intptr_t(fd));
-    loader.m_GetBlock = &getBlock;
+    // src is released first, so if both arrays are the same object the result copy wins
+    env->ReleasePrimitiveArrayCritical(src, in, JNI_ABORT);
+    env->ReleasePrimitiveArrayCritical(dst, out, 0);
+    return JNI_TRUE;
+}
 
-    const char *cpassword = NULL;
-    if(password != NULL) {
-        cpassword = env->GetStringUTFChars(password, NULL);
+
+// Pixel buffer a page is rendered into. Format is one of ANDROID_BITMAP_FORMAT_*.
+struct RenderTarget {
+    void *pixels;
+    int format;
+    int stride;
+    int width;
+    int height;
+};
+
+static int bytesPerPixel(int format) {
+    switch (format) {
+        case ANDROID_BITMAP_FORMAT_A_8: return 1;
+        case ANDROID_BITMAP_FORMAT_RGB_565: return 2;
+        default: return 4;
     }
+}
 
-    FPDF_DOCUMENT document = FPDF_LoadCustomDocument(&loader, cpassword);
+static bool isRenderableFormat(int format) {
+    return format == ANDROID_BITMAP_FORMAT_RGBA_8888 || format == ANDROID_BITMAP_FORMAT_RGB_565
+           || format == ANDROID_BITMAP_FORMAT_A_8;
+}
 
-    if(cpassword != NULL) {
-        env->ReleaseStringUTFChars(password, cpassword);
+static uint64_t fnv1a64(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t *bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
     }
+    return hash;
+}
 
-    if (!document) {
-        delete docFile;
+// Rendered bitmaps persisted on disk in LZ-compressed files, one per render key, with a total size
+// cap evicting least recently used entries. Lookups decompress on the calling thread; stores are
+// compressed and written by a background thread, so rendering never waits for the disk.
+// Files are written under a temporary name and renamed, so readers never see partial entries.
+class RenderCache {
+public:
+    RenderCache(const std::string &directory, size_t maxBytes)
+            : directory(directory), maxBytes(maxBytes) {
+        scanDirectory();
+        writer = std::thread(&RenderCache::runWriter, this);
+    }
 
-        const long errorNum = FPDF_GetLastError();
-        if(errorNum == FPDF_ERR_PASSWORD) {
-            jniThrowException(env, "com/shockwave/pdfium/PdfPasswordException",
-                                    "Password required or incorrect password.");
-        } else {
-            char* error = getErrorDescription(errorNum);
-            jniThrowExceptionFmt(env, "java/io/IOException",
-                                    "cannot create document: %s", error);
+    // Pending writes are finished before returning
+    ~RenderCache() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        writerWakeUp.notify_all();
+        writer.join();
+    }
 
-            free(error);
+    // Fills target from the cache, returns false on miss
+    bool load(const std::string &key, const RenderTarget &target) {
+        std::string name = fileNameForKey(key);
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            std::unordered_map<std::string, Entry>::iterator it = entries.find(name);
+            if (it == entries.end()) return false;
+            lru.splice(lru.begin(), lru, it->second.lruPosition);
         }
 
-        return -1;
+        std::string path = directory + "/" + name;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            forget(name);
+            return false;
+        }
+        bool loaded = readEntry(fd, key, target);
+        if (loaded) {
+            // Persist recency for the next process, entries are ordered by mtime on startup
+            futimens(fd, NULL);
+        }
+        close(fd);
+
+        if (!loaded) {
+            LOGE("Dropping unreadable render cache entry %s", name.c_str());
+            forget(name);
+            unlink(path.c_str());
+        }
+        return loaded;
     }
 
-    docFile->pdfDocument = document;
+    // Copies the pixels and queues them for writing
+    void store(const std::string &key, const RenderTarget &target) {
+        size_t rowBytes = (size_t) target.width * bytesPerPixel(target.format);
+        size_t size = rowBytes * target.height;
+        std::string name = fileNameForKey(key);
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (entries.count(name) || queuedBytes + size > MAX_QUEUED_BYTES) return;
+            queuedBytes += size;
+        }
 
-    return reinterpret_cast<jlong>(docFile);
-}
+        PendingWrite *write = new PendingWrite();
+        write->key = key;
+        write->name = name;
+        write->format = target.format;
+        write->width = target.width;
+        write->height = target.height;
+        write->pixels.resize(size);
+        for (int y = 0; y < target.height; y++) {
+            memcpy(&write->pixels[y * rowBytes], (char*) target.pixels + y * target.stride, rowBytes);
+        }
 
-JNI_FUNC(jlong, PdfiumCore, nativeOpenMemDocument)(JNI_ARGS, jbyteArray data, jstring password){
-    DocumentFile *docFile = new DocumentFile();
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            queue.push_back(write);
+        }
+        writerWakeUp.notify_one();
+    }
 
-    const char *cpassword = NULL;
-    if(password != NULL) {
-        cpassword = env->GetStringUTFChars(password, NULL);
+    void clear() {
+        std::lock_guard<std::mutex> guard(mutex);
+        // Queued writes are dropped; the one being written sees the new generation and
+        // removes its file again
+        for (PendingWrite *pending : queue) {
+            queuedBytes -= pending->pixels.size();
+            delete pending;
+        }
+        queue.clear();
+        generation++;
+        for (const std::string &name : lru) {
+            unlink((directory + "/" + name).c_str());
+        }
+        lru.clear();
+        entries.clear();
+        totalBytes = 0;
     }
 
-    jbyte *cData = env->GetByteArrayElements(data, NULL);
-    int size = (int) env->GetArrayLength(data);
-    jbyte *cDataCopy = new jbyte[size];
-    memcpy(cDataCopy, cData, size);
-    FPDF_DOCUMENT document = FPDF_LoadMemDocument( reinterpret_cast<const void*>(cDataCopy),
-                                                          size, cpassword);
-    env->ReleaseByteArrayElements(data, cData, JNI_ABORT);
+private:
+    static const uint32_t FILE_MAGIC = 0x43524450; // "PDRC"
+    static const uint32_t FILE_VERSION = 1;
+    static const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t format;
+        uint32_t width;
+        uint32_t height;
+        uint32_t keyLength;
+        uint64_t rawSize;
+        uint64_t compressedSize;
+        uint64_t checksum;
+    };
+
+    struct Entry {
+        std::list<std::string>::iterator lruPosition;
+        size_t size;
+    };
+
+    struct PendingWrite {
+        std::string key;
+        std::string name;
+        int format;
+        int width;
+        int height;
+        std::vector<uint8_t> pixels;
+    };
+
+    const std::string directory;
+    const size_t maxBytes;
+    std::thread writer;
+
+    // Guarded by mutex
+    std::mutex mutex;
+    std::condition_variable writerWakeUp;
+    std::list<std::string> lru; // most recently used first
+    std::unordered_map<std::string, Entry> entries;
+    size_t totalBytes = 0;
+    std::deque<PendingWrite*> queue;
+    size_t queuedBytes = 0;
+    // Incremented by clear, so a write started before it is not indexed
+    int generation = 0;
+    bool stopping = false;
+
+    static std::string fileNameForKey(const std::string &key) {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.rc",
+                 (unsigned long long) fnv1a64(key.data(), key.size()));
+        return name;
+    }
 
-    if(cpassword != NULL) {
-        env->ReleaseStringUTFChars(password, cpassword);
+    static bool readFully(int fd, void *buffer, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t count = pread(fd, buffer, size, offset);
+            if (count <= 0) return false;
+            buffer = (char*) buffer + count;
+            size -= count;
+            offset += count;
+        }
+        return true;
     }
 
-    if (!document) {
-        delete docFile;
+    static bool writeFully(int fd, const void *buffer, size_t size) {
+        while (size > 0) {
+            ssize_t count = write(fd, buffer, size);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) return false;
+            buffer = (const char*) buffer + count;
+            size -= count;
+        }
+        return true;
+    }
 
-        const long errorNum = FPDF_GetLastError();
-        if(errorNum == FPDF_ERR_PASSWORD) {
-            jniThrowException(env, "com/shockwave/pdfium/PdfPasswordException",
-                                    "Password required or incorrect password.");
-        } else {
-            char* error = getErrorDescription(errorNum);
-            jniThrowExceptionFmt(env, "java/io/IOException",
-                                    "cannot create document: %s", error);
+    bool readEntry(int fd, const std::string &key, const RenderTarget &target) {
+        FileHeader header;
+        size_t rowBytes = (size_t) target.width * bytesPerPixel(target.format);
+        struct stat info;
+        if (!readFully(fd, &header, sizeof(header), 0) || fstat(fd, &info) != 0
+                || header.magic != FILE_MAGIC || header.version != FILE_VERSION
+                || header.format != (uint32_t) target.format
+                || header.width != (uint32_t) target.width
+                || header.height != (uint32_t) target.height
+                || header.rawSize != rowBytes * target.height
+                || header.keyLength != key.size()) {
+            return false;
+        }
+        // Checked before sizing buffers by it, a corrupt size must not allocate or overflow
+        if (header.compressedSize > lz::maxCompressedSize(header.rawSize)
+                || (uint64_t) info.st_size
+                   != sizeof(header) + header.keyLength + header.compressedSize) {
+            return false;
+        }
 
-            free(error);
+        std::vector<uint8_t> payload(header.keyLength + header.compressedSize);
+        if (!readFully(fd, payload.data(), payload.size(), sizeof(header))
+                || memcmp(payload.data(), key.data(), key.size()) != 0) {
+            return false;
         }
+        const uint8_t *compressed = payload.data() + header.keyLength;
+        if (fnv1a64(compressed, header.compressedSize) != header.checksum) return false;
 
-        return -1;
+        if ((size_t) target.stride == rowBytes) {
+            return lz::decompress(compressed, header.compressedSize, (uint8_t*) target.pixels,
+                                  header.rawSize);
+        }
+        std::vector<uint8_t> pixels(header.rawSize);
+        if (!lz::decompress(compressed, header.compressedSize, pixels.data(), pixels.size())) {
+            return false;
+        }
+        for (int y = 0; y < target.height; y++) {
+            memcpy((char*) target.pixels + y * target.stride, &pixels[y * rowBytes], rowBytes);
+        }
+        return true;
     }
 
-    docFile->pdfDocument = document;
+    void writeEntry(PendingWrite *pending, int writeGeneration) {
+        std::vector<uint8_t> compressed(lz::maxCompressedSize(pending->pixels.size()));
+        size_t compressedSize = lz::compress(pending->pixels.data(), pending->pixels.size(),
+                                             compressed.data(), compressed.size());
+        if (compressedSize == 0) return;
+
+        FileHeader header;
+        header.magic = FILE_MAGIC;
+        header.version = FILE_VERSION;
+        header.format = pending->format;
+        header.width = pending->width;
+        header.height = pending->height;
+        header.keyLength = pending->key.size();
+        header.rawSize = pending->pixels.size();
+        header.compressedSize = compressedSize;
+        header.checksum = fnv1a64(compressed.data(), compressedSize);
+
+        std::string path = directory + "/" + pending->name;
+        std::string tmpPath = path + ".tmp";
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            LOGE("Cannot create render cache entry: %s", strerror(errno));
+            return;
+        }
+        bool written = writeFully(fd, &header, sizeof(header))
+                       && writeFully(fd, pending->key.data(), pending->key.size())
+                       && writeFully(fd, compressed.data(), compressedSize);
+        close(fd);
+        if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            LOGE("Cannot write render cache entry: %s", strerror(errno));
+            unlink(tmpPath.c_str());
+            return;
+        }
 
-    return reinterpret_cast<jlong>(docFile);
-}
+        std::lock_guard<std::mutex> guard(mutex);
+        if (generation != writeGeneration) {
+            unlink(path.c_str());
+            return;
+        }
+        insertLocked(pending->name, sizeof(header) + pending->key.size() + compressedSize);
+        evictLocked();
+    }
 
-JNI_FUNC(jint, PdfiumCore, nativeGetPageCount)(JNI_ARGS, jlong documentPtr){
-    DocumentFile *doc = reinterpret_cast<DocumentFile*>(documentPtr);
-    return (jint)FPDF_GetPageCount(doc->pdfDocument);
-}
+    void runWriter() {
+        std::unique_lock<std::mutex> guard(mutex);
+        while (true) {
+            if (queue.empty()) {
+                if (stopping) break;
+                writerWakeUp.wait(guard);
+                continue;
+            }
+            PendingWrite *pending = queue.front();
+            queue.pop_front();
+            int writeGeneration = generation;
 
-JNI_FUNC(void, PdfiumCore, nativeCloseDocument)(JNI_ARGS, jlong documentPtr){
-    DocumentFile *doc = reinterpret_cast<DocumentFile*>(documentPtr);
-    delete doc;
-}
+            guard.unlock();
+            writeEntry(pending, writeGeneration);
+            guard.lock();
 
-static jlong loadPageInternal(JNIEnv *env, DocumentFile *doc, int pageIndex){
-    try{
-        if(doc == NULL) throw "Get page document null";
+            queuedBytes -= pending->pixels.size();
+            delete pending;
+        }
+    }
 
-        FPDF_DOCUMENT pdfDoc = doc->pdfDocument;
-        if(pdfDoc != NULL){
-            FPDF_PAGE page = FPDF_LoadPage(pdfDoc, pageIndex);
+    void insertLocked(const std::string &name, size_t size) {
+        std::unordered_map<std::string, Entry>::iterator it = entries.find(name);
+        if (it != entries.end()) {
+            totalBytes -= it->second.size;
+            lru.erase(it->second.lruPosition);
+            entries.erase(it);
+        }
+        lru.push_front(name);
+        Entry entry;
+        entry.lruPosition = lru.begin();
+        entry.size = size;
+        entries[name] = entry;
+        totalBytes += size;
+    }
+
+    void evictLocked() {
+        while (totalBytes > maxBytes && !lru.empty()) {
+            std::string name = lru.back();
+            unlink((directory + "/" + name).c_str());
+            totalBytes -= entries[name].size;
+            entries.erase(name);
+            lru.pop_back();
+        }
+    }
+
+    void forget(const std::string &name) {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::unordered_map<std::string, Entry>::iterator it = entries.find(name);
+        if (it == entries.end()) return;
+        totalBytes -= it->second.size;
+        lru.erase(it->second.lruPosition);
+        entries.erase(it);
+    }
+
+    void scanDirectory() {
+        mkdir(directory.c_str(), 0700);
+        DIR *dir = opendir(directory.c_str());
+        if (dir == NULL) {
+            LOGE("Cannot open render cache directory: %s", strerror(errno));
+            return;
+        }
+
+        std::vector<std::pair<time_t, std::pair<std::string, size_t> > > found;
+        struct dirent *item;
+        while ((item = readdir(dir)) != NULL) {
+            std::string name = item->d_name;
+            std::string path = directory + "/" + name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+                unlink(path.c_str()); // interrupted write
+                continue;
+            }
+            struct stat info;
+            if (name.size() < 3 || name.compare(name.size() - 3, 3, ".rc") != 0
+                    || stat(path.c_str(), &info) != 0) {
+                continue;
+            }
+            found.push_back(std::make_pair(info.st_mtime, std::make_pair(name, (size_t) info.st_size)));
+        }
+        closedir(dir);
+
+        // Oldest first, so the most recently used entry ends up at the front
+        std::sort(found.begin(), found.end());
+        std::lock_guard<std::mutex> guard(mutex);
+        for (size_t i = 0; i < found.size(); i++) {
+            insertLocked(found[i].second.first, found[i].second.second);
+        }
+        evictLocked();
+    }
+};
+
+// Heap held by a loaded page, estimated from what it parsed rather than measured: renders on
+// other threads allocate and free outside the pdfium lock, so heap deltas are unreliable
+static const size_t PREFETCH_PAGE_BYTES = 16 * 1024;
+static const size_t PREFETCH_OBJECT_BYTES = 1024;
+static const size_t PREFETCH_CHAR_BYTES = 256;
+
+// Loads pages (and optionally their text layers) ahead of the scroll direction on a background
+// thread. Loaded pages wait in DocumentFile::prefetchedPages until Java opens them.
+// pdfium work takes the pdfium lock as background work, foreground callers always go first.
+class PagePrefetcher {
+public:
+    PagePrefetcher(DocumentFile *doc, int pageCount, int maxPages, bool loadText,
+                   size_t memoryBudget)
+            : doc(doc), pageCount(pageCount), maxPages(maxPages),
+              loadText(loadText), memoryBudget(memoryBudget) {
+        worker = std::thread(&PagePrefetcher::run, this);
+    }
+
+    // Joins the worker, must not be called while holding the pdfium lock
+    ~PagePrefetcher() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        worker.join();
+    }
+
+    // velocity is in pages per second, positive when scrolling towards higher page indices
+    void update(int firstVisible, int lastVisible, float velocity) {
+        std::lock_guard<std::mutex> guard(mutex);
+        first = firstVisible;
+        last = lastVisible;
+        pending.clear();
+
+        int lookahead;
+        if (std::fabs(velocity) < 0.01f) {
+            // Standing still, warm up direct neighbours on both sides
+            lookahead = std::min(2, maxPages);
+            for (int k = 1; k <= lookahead; k++) {
+                if (lastVisible + k < pageCount) pending.push_back(lastVisible + k);
+                if (firstVisible - k >= 0) pending.push_back(firstVisible - k);
+            }
+            windowStart = firstVisible - lookahead;
+            windowEnd = lastVisible + lookahead;
+        } else {
+            // Roughly one second of scrolling ahead
+            lookahead = std::max(1, std::min(maxPages, (int) std::ceil(std::fabs(velocity))));
+            int direction = velocity > 0 ? 1 : -1;
+            int from = direction > 0 ? lastVisible : firstVisible;
+            for (int k = 1; k <= lookahead; k++) {
+                int index = from + direction * k;
+                if (index >= 0 && index < pageCount) pending.push_back(index);
+            }
+            windowStart = direction > 0 ? firstVisible : firstVisible - lookahead;
+            windowEnd = direction > 0 ? lastVisible + lookahead : lastVisible;
+        }
+        wakeUp.notify_all();
+    }
+
+private:
+    static const long long IDLE_NANOS = 30 * 1000000LL;
+    static const int POLL_MILLIS = 8;
+
+    DocumentFile *doc;
+    const int pageCount;
+    const int maxPages;
+    const bool loadText;
+    const size_t memoryBudget;
+    std::thread worker;
+
+    // Guarded by mutex
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::vector<int> pending;
+    int first = 0, last = -1;
+    int windowStart = 0, windowEnd = -1;
+
+    static bool foregroundIdle() {
+        return !sPdfiumLock.foregroundActive(IDLE_NANOS);
+    }
+
+    // Waits for work and an idle gap, returns false when stopping
+    bool nextPage(int *pageIndex, int *keepFrom, int *keepTo) {
+        std::unique_lock<std::mutex> guard(mutex);
+        while (!stopping) {
+            if (pending.empty()) {
+                wakeUp.wait(guard);
+            } else if (!foregroundIdle()) {
+                wakeUp.wait_for(guard, std::chrono::milliseconds(POLL_MILLIS));
+            } else {
+                *pageIndex = pending.front();
+                pending.erase(pending.begin());
+                *keepFrom = windowStart;
+                *keepTo = windowEnd;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void requeue(int pageIndex) {
+        std::lock_guard<std::mutex> guard(mutex);
+        pending.insert(pending.begin(), pageIndex);
+    }
+
+    void run() {
+        int pageIndex, keepFrom, keepTo;
+        while (nextPage(&pageIndex, &keepFrom, &keepTo)) {
+            PdfiumGuard guard(true);
+            if (sPdfiumLock.hasForegroundWaiters()) {
+                // Foreground call arrived while we were waiting for the lock, let it go first
+                requeue(pageIndex);
+                continue;
+            }
+            prefetchLocked(pageIndex, keepFrom, keepTo);
+        }
+    }
+
+    void prefetchLocked(int pageIndex, int keepFrom, int keepTo) {
+        // Drop pages the reader scrolled away from before spending more memory
+        std::vector<int> stale;
+        for (std::map<int, PrefetchedPage>::iterator it = doc->prefetchedPages.begin();
+             it != doc->prefetchedPages.end(); ++it) {
+            if (it->first < keepFrom || it->first > keepTo) stale.push_back(it->first);
+        }
+        for (int index : stale) doc->releasePrefetchedPage(index);
+
+        if (doc->prefetchedPages.count(pageIndex) || doc->openedPages.count(pageIndex)) return;
+        if (doc->prefetchedBytes >= memoryBudget) return;
+
+        FPDF_PAGE page = FPDF_LoadPage(doc->pdfDocument, pageIndex);
+        if (page == NULL) return;
+        // Complexity is cached for render cost estimates too
+        size_t bytes = PREFETCH_PAGE_BYTES + PREFETCH_OBJECT_BYTES
+                       * doc->costModel.getComplexity(pageIndex, page).objectCount;
+        if (loadText) {
+            PageTextCache *cache = getPageText(page);
+            if (cache != NULL) {
+                bytes += PREFETCH_CHAR_BYTES * std::max(FPDFText_CountChars(cache->textPage), 0);
+            }
+        }
+
+        PrefetchedPage entry;
+        entry.page = page;
+        entry.bytes = bytes;
+        doc->prefetchedPages[pageIndex] = entry;
+        doc->prefetchedBytes += entry.bytes;
+    }
+};
+
+static const size_t FINGERPRINT_HEAD_BYTES = 4096;
+static const size_t FINGERPRINT_TAIL_BYTES = 64 * 1024;
+static const size_t FINGERPRINT_XREF_BYTES = 64 * 1024;
+static const size_t FINGERPRINT_SAMPLE_BYTES = 4096;
+static const int FINGERPRINT_SAMPLE_COUNT = 32;
+static const size_t FINGERPRINT_READ_BYTES = 1024 * 1024;
+
+// Hashes file range [offset, offset + length), returns false on read error
+static bool hashFileRange(int fd, off_t offset, size_t length, std::vector<uint8_t> &buffer,
+                          xxh::Hash64 &hash) {
+    while (length > 0) {
+        size_t chunk = std::min(length, buffer.size());
+        ssize_t readCount = pread(fd, buffer.data(), chunk, offset);
+        if (readCount < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (readCount == 0) return true; // file shrank meanwhile, size is hashed anyway
+        hash.update(buffer.data(), (size_t) readCount);
+        offset += readCount;
+        length -= (size_t) readCount;
+    }
+    return true;
+}
+
+// Offset from the last "startxref" keyword in the trailer, or -1
+static long long findStartXref(const uint8_t *tail, size_t size) {
+    static const char KEYWORD[] = "startxref";
+    const size_t keywordLength = sizeof(KEYWORD) - 1;
+    for (size_t i = size >= keywordLength ? size - keywordLength + 1 : 0; i-- > 0;) {
+        if (memcmp(tail + i, KEYWORD, keywordLength) != 0) continue;
+        size_t p = i + keywordLength;
+        while (p < size && isspace(tail[p])) p++;
+        long long offset = 0;
+        size_t digits = 0;
+        while (p < size && isdigit(tail[p]) && digits < 18) {
+            offset = offset * 10 + (tail[p++] - '0');
+            digits++;
+        }
+        return digits > 0 ? offset : -1;
+    }
+    return -1;
+}
+
+// Sampled fingerprint covers file size, header, trailer, xref section and evenly spread blocks,
+// so edits appending an incremental update or rewriting the file are always detected, while
+// reading at most a few hundred kilobytes. Full fingerprint hashes every byte.
+static bool computeFingerprint(int fd, bool full, uint64_t *fingerprint) {
+    struct stat fileState;
+    if (fstat(fd, &fileState) < 0) return false;
+    const off_t fileSize = fileState.st_size;
+
+    xxh::Hash64 hash;
+    hash.update((uint64_t) fileSize);
+    hash.update((uint64_t) (full ? 1 : 0));
+
+    if (full) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<uint8_t> buffer(FINGERPRINT_READ_BYTES);
+        if (!hashFileRange(fd, 0, (size_t) fileSize, buffer, hash)) return false;
+        *fingerprint = hash.digest();
+        return true;
+    }
+
+    std::vector<uint8_t> buffer(std::max(FINGERPRINT_TAIL_BYTES, FINGERPRINT_XREF_BYTES));
+    if (!hashFileRange(fd, 0, std::min((size_t) fileSize, FINGERPRINT_HEAD_BYTES), buffer, hash)) {
+        return false;
+    }
+
+    size_t tailSize = std::min((size_t) fileSize, FINGERPRINT_TAIL_BYTES);
+    off_t tailOffset = fileSize - tailSize;
+    ssize_t readCount;
+    do {
+        readCount = pread(fd, buffer.data(), tailSize, tailOffset);
+    } while (readCount < 0 && errno == EINTR);
+    if (readCount < 0) return false;
+    tailSize = (size_t) readCount;
+    hash.update(buffer.data(), tailSize);
+
+    // Cross-reference section usually lies outside the trailer block in large files
+    long long xrefOffset = findStartXref(buffer.data(), tailSize);
+    if (xrefOffset >= 0 && xrefOffset < tailOffset) {
+        size_t xrefSize = std::min((size_t) (fileSize - xrefOffset), FINGERPRINT_XREF_BYTES);
+        if (!hashFileRange(fd, (off_t) xrefOffset, xrefSize, buffer, hash)) return false;
+    }
+
+    if (fileSize > (off_t) (FINGERPRINT_SAMPLE_BYTES * FINGERPRINT_SAMPLE_COUNT)) {
+        const off_t stride = fileSize / (FINGERPRINT_SAMPLE_COUNT + 1);
+        for (int i = 1; i <= FINGERPRINT_SAMPLE_COUNT; i++) {
+            if (!hashFileRange(fd, stride * i, FINGERPRINT_SAMPLE_BYTES, buffer, hash)) {
+                return false;
+            }
+        }
+    }
+
+    *fingerprint = hash.digest();
+    return true;
+}
+
+// FPDF_FILEWRITE appending to a file descriptor. pdfium emits a document as thousands of small
+// blocks (often single tokens), so they are collected into large writes.
+class FdWriter : public FPDF_FILEWRITE {
+public:
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    explicit FdWriter(int fd) : fd(fd) {
+        version = 1;
+        WriteBlock = &FdWriter::writeBlock;
+        buffer.reserve(BUFFER_SIZE);
+    }
+
+    // Writes buffered data, returns false on error
+    bool flush() {
+        if (error != 0) return false;
+        if (!writeFully(buffer.data(), buffer.size())) return false;
+        buffer.clear();
+        return true;
+    }
+
+    bool write(const void *data, size_t size) {
+        if (error != 0) return false;
+        if (buffer.size() + size > BUFFER_SIZE) {
+            if (!flush()) return false;
+            if (size >= BUFFER_SIZE) return writeFully(data, size);
+        }
+        const uint8_t *bytes = static_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        return true;
+    }
+
+    // Bytes accepted so far, including the buffered ones
+    long long getBytesWritten() const { return bytesWritten + buffer.size(); }
+
+    // errno of the failed write, 0 if none failed
+    int getError() const { return error; }
+
+private:
+    const int fd;
+    std::vector<uint8_t> buffer;
+    long long bytesWritten = 0;
+    int error = 0;
+
+    static int writeBlock(FPDF_FILEWRITE *pThis, const void *data, unsigned long size) {
+        return static_cast<FdWriter*>(pThis)->write(data, size) ? 1 : 0;
+    }
+
+    bool writeFully(const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(fd, bytes, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                error = errno;
+                return false;
+            }
+            bytes += written;
+            size -= (size_t) written;
+            bytesWritten += written;
+        }
+        return true;
+    }
+};
+
+struct PageRange {
+    int first; // 1-based, inclusive
+    int last;
+};
+
+static bool parsePageNumber(const char **p, int *number) {
+    if (!isdigit((unsigned char) **p)) return false;
+    int value = 0;
+    while (isdigit((unsigned char) **p)) {
+        int digit = *(*p)++ - '0';
+        // Checked before multiplying, long is 32 bits on some ABIs
+        if (value > (INT_MAX - digit) / 10) return false;
+        value = value * 10 + digit;
+    }
+    *number = value;
+    return true;
+}
+
+// Parses 1-based page ranges such as "1-10,45,60-"; a range without start begins at the first
+// page, one without end runs to the last page. Returns false for malformed specs and pages
+// outside the document.
+static bool parsePageRanges(const char *spec, int pageCount, std::vector<PageRange> *ranges) {
+    ranges->clear();
+    const char *p = spec;
+    while (true) {
+        while (isspace((unsigned char) *p)) p++;
+        PageRange range;
+        if (*p == '-') {
+            range.first = 1;
+        } else if (!parsePageNumber(&p, &range.first)) {
+            return false;
+        }
+        while (isspace((unsigned char) *p)) p++;
+        if (*p == '-') {
+            p++;
+            while (isspace((unsigned char) *p)) p++;
+            if (*p == ',' || *p == '\0') {
+                range.last = pageCount;
+            } else if (!parsePageNumber(&p, &range.last)) {
+                return false;
+            }
+        } else {
+            range.last = range.first;
+        }
+        if (range.first < 1 || range.first > range.last || range.last > pageCount) return false;
+        ranges->push_back(range);
+
+        while (isspace((unsigned char) *p)) p++;
+        if (*p == '\0') return true;
+        if (*p++ != ',') return false;
+    }
+}
+
+// Canonical form accepted by FPDF_ImportPages, e.g. "1-10,45,60-120"
+static std::string formatPageRanges(const std::vector<PageRange> &ranges) {
+    std::string result;
+    char part[32];
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (ranges[i].first == ranges[i].last) {
+            snprintf(part, sizeof(part), "%s%d", i > 0 ? "," : "", ranges[i].first);
+        } else {
+            snprintf(part, sizeof(part), "%s%d-%d", i > 0 ? "," : "", ranges[i].first,
+                     ranges[i].last);
+        }
+        result += part;
+    }
+    return result;
+}
+
+// Compiled patterns keyed by fold mode and pattern, most recently used first. Searches hold
+// their own reference, so entries can be dropped while a search runs.
+static const size_t REGEX_CACHE_SIZE = 16;
+static std::mutex sRegexCacheLock;
+static std::list<std::pair<std::u16string, std::shared_ptr<const re::Regex> > > sRegexCache;
+
+static std::shared_ptr<const re::Regex> getRegex(const std::u16string &pattern, int foldMode,
+                                                 std::string *error) {
+    std::u16string key(1, (char16_t) foldMode);
+    key += pattern;
+    std::lock_guard<std::mutex> guard(sRegexCacheLock);
+    for (std::list<std::pair<std::u16string, std::shared_ptr<const re::Regex> > >::iterator it =
+            sRegexCache.begin(); it != sRegexCache.end(); ++it) {
+        if (it->first == key) {
+            sRegexCache.splice(sRegexCache.begin(), sRegexCache, it);
+            return it->second;
+        }
+    }
+
+    std::shared_ptr<re::Regex> regex(new re::Regex());
+    if (!regex->compile(pattern.data(), pattern.size(), foldMode, error)) {
+        return std::shared_ptr<const re::Regex>();
+    }
+    sRegexCache.push_front(std::make_pair(key, std::shared_ptr<const re::Regex>(regex)));
+    if (sRegexCache.size() > REGEX_CACHE_SIZE) sRegexCache.pop_back();
+    return regex;
+}
+
+// End of a page kept as regex input, matched again in front of the next page
+struct SearchTail {
+    std::vector<uint32_t> input;
+    std::vector<int> charIndex;
+    // Input in front of the tail, only seen by ^ and \b so a tail cut mid-word or mid-line
+    // does not look like the start of one
+    size_t contextLength = 0;
+};
+
+// Matches of a page searched together with the tail of the previous page
+struct JoinedMatches {
+    // Page character ranges within the page, as start, end pairs
+    std::vector<int> ranges;
+    // Match from spanningStart on the previous page to spanningEnd (exclusive) on this page,
+    // -1 if there is none; it covers this page from spanningFirst on
+    int spanningStart = -1;
+    int spanningFirst = -1;
+    int spanningEnd = -1;
+};
+
+// Matches regex over the tail, a line break for the page break, then the code points of the
+// page. Matches ending in the tail were reported with the previous page and are dropped. Fills
+// nextTail with the page from tailFirst on, after the last match, so no match is reported twice.
+static void matchJoinedPage(const re::Regex &regex, const std::atomic<bool> &stopping,
+                            const SearchTail &tail, const uint32_t *codePoints, int charCount,
+                            int tailFirst, JoinedMatches *result, SearchTail *nextTail) {
+    text::PageText content;
+    content.assign(codePoints, charCount);
+    std::vector<uint32_t> input(tail.input);
+    std::vector<int> charIndex(tail.charIndex);
+    size_t tailEnd = input.size();
+    if (tailEnd > tail.contextLength) {
+        input.push_back('\n');
+        charIndex.push_back(-1);
+    }
+    size_t bodyStart = input.size();
+    re::buildInput(content, regex.getFoldMode(), &input, &charIndex);
+
+    result->ranges.clear();
+    result->spanningStart = -1;
+    result->spanningFirst = -1;
+    result->spanningEnd = -1;
+    int lastEnd = 0;
+    re::Matcher matcher(regex, input.data(), input.size(), tail.contextLength);
+    size_t start, end;
+    while (!stopping.load() && matcher.next(&start, &end)) {
+        // Empty, or ends in the tail and was reported with the previous page
+        if (end <= start || end <= bodyStart) continue;
+        int last = charIndex[end - 1] + 1;
+        // Extend over characters folded away, like combining marks
+        if (end < charIndex.size() && charIndex[end] > last) last = charIndex[end];
+        lastEnd = last;
+        if (start < tailEnd) {
+            result->spanningStart = charIndex[start];
+            result->spanningFirst = charIndex[bodyStart];
+            result->spanningEnd = last;
+        } else {
+            result->ranges.push_back(charIndex[std::max(start, bodyStart)]);
+            result->ranges.push_back(last);
+        }
+    }
+
+    int tailStart = std::max(tailFirst, lastEnd);
+    nextTail->input.clear();
+    nextTail->charIndex.clear();
+    nextTail->contextLength = 0;
+    for (size_t i = bodyStart; i < input.size(); i++) {
+        if (charIndex[i] < tailStart) continue;
+        if (nextTail->input.empty() && i > bodyStart) {
+            nextTail->input.push_back(input[i - 1]);
+            nextTail->charIndex.push_back(charIndex[i - 1]);
+            nextTail->contextLength = 1;
+        }
+        nextTail->input.push_back(input[i]);
+        nextTail->charIndex.push_back(charIndex[i]);
+    }
+}
+
+// Searches pages of a document for a regular expression on its own thread. Page text is read
+// under the pdfium lock as background work in gaps between foreground calls, matching runs
+// without the lock. Matches of each page go to PdfiumCore#onSearchMatches with their highlight
+// rects, then PdfiumCore#onSearchFinished is called once.
+//
+// The last characters of each page are matched again in front of the next page, joined by a
+// line break like lines within a page, so a phrase continuing on the next page is found. Such a
+// match goes to PdfiumCore#onSearchSpanningMatch with rects on both pages; the boxes of the
+// tail are kept from the first page so neither page is read again.
+class RegexSearch {
+public:
+    RegexSearch(JavaVM *vm, jobject core, jobject listener, jmethodID matchesCallback,
+                jmethodID spanningCallback, jmethodID finishedCallback, DocumentFile *doc,
+                const std::shared_ptr<const re::Regex> &regex, int fromPage, int toPage)
+            : vm(vm), core(core), listener(listener), matchesCallback(matchesCallback),
+              spanningCallback(spanningCallback), finishedCallback(finishedCallback), doc(doc),
+              regex(regex), fromPage(fromPage), toPage(toPage) {
+        worker = std::thread(&RegexSearch::run, this);
+    }
+
+    // Stops and deletes the search, joining the worker. Called from a listener on the worker
+    // itself, the worker deletes the search when it returns instead.
+    void stop(JNIEnv *env) {
+        stopping = true;
+        if (std::this_thread::get_id() == worker.get_id()) {
+            deleteOnExit = true;
+            return;
+        }
+        worker.join();
+        release(env);
+        delete this;
+    }
+
+private:
+    static const long long IDLE_NANOS = 30 * 1000000LL;
+    static const int POLL_MILLIS = 8;
+    // Characters at the end of a page a match continuing on the next page may start in
+    static const int TAIL_CHARS = 256;
+
+    // End of the previous page, matched in front of the next one
+    struct PageTail {
+        SearchTail text;
+        // Boxes of the characters from firstBox to the end of the page
+        int firstBox = 0;
+        std::vector<CharBox> boxes;
+    };
+
+    JavaVM *vm;
+    jobject core;
+    jobject listener;
+    jmethodID matchesCallback;
+    jmethodID spanningCallback;
+    jmethodID finishedCallback;
+    DocumentFile *doc;
+    const std::shared_ptr<const re::Regex> regex;
+    const int fromPage;
+    const int toPage;
+    std::thread worker;
+    std::atomic<bool> stopping{false};
+    // Only touched on the worker
+    bool deleteOnExit = false;
+
+    void release(JNIEnv *env) {
+        env->DeleteGlobalRef(core);
+        env->DeleteGlobalRef(listener);
+    }
+
+    // Waits for a gap in foreground pdfium work, returns false when stopping
+    bool waitForIdle() {
+        while (!stopping.load()) {
+            if (!sPdfiumLock.foregroundActive(IDLE_NANOS)) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MILLIS));
+        }
+        return false;
+    }
+
+    // Under the pdfium lock: text page from the shared cache when Java has the page open,
+    // otherwise loaded into the private handles, which the caller closes
+    FPDF_TEXTPAGE getTextPage(int pageIndex, FPDF_PAGE *page, FPDF_TEXTPAGE *textPage) {
+        std::map<int, FPDF_PAGE>::iterator it = doc->openedPages.find(pageIndex);
+        if (it != doc->openedPages.end()) {
+            PageTextCache *cache = getPageText(it->second);
+            if (cache != NULL) return cache->textPage;
+        }
+        if (*textPage == NULL) {
+            if (*page == NULL) *page = FPDF_LoadPage(doc->pdfDocument, pageIndex);
+            if (*page != NULL) *textPage = FPDFText_LoadPage(*page);
+        }
+        return *textPage;
+    }
+
+    static void appendRects(const std::vector<CharBox> &boxes, std::vector<jfloat> *rects) {
+        for (size_t i = 0; i < boxes.size(); i++) {
+            rects->push_back(boxes[i].left);
+            rects->push_back(boxes[i].top);
+            rects->push_back(boxes[i].right);
+            rects->push_back(boxes[i].bottom);
+        }
+    }
+
+    void checkException(JNIEnv *env) {
+        if (env->ExceptionCheck()) {
+            LOGE("Search listener threw an exception");
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+        }
+    }
+
+    void deliver(JNIEnv *env, int pageIndex, const std::vector<jint> &matches,
+                 const std::vector<jfloat> &rects) {
+        jintArray jmatches = env->NewIntArray(matches.size());
+        jfloatArray jrects = env->NewFloatArray(rects.size());
+        if (jmatches != NULL && jrects != NULL) {
+            env->SetIntArrayRegion(jmatches, 0, matches.size(), matches.data());
+            env->SetFloatArrayRegion(jrects, 0, rects.size(), rects.data());
+            env->CallVoidMethod(core, matchesCallback, listener, pageIndex, jmatches, jrects);
+        }
+        checkException(env);
+        env->DeleteLocalRef(jmatches);
+        env->DeleteLocalRef(jrects);
+    }
+
+    // Match from start on pageIndex to end (exclusive) on the following page
+    void deliverSpanning(JNIEnv *env, int pageIndex, int start, int end,
+                         const std::vector<jfloat> &rects, const std::vector<jfloat> &nextRects) {
+        jfloatArray jrects = env->NewFloatArray(rects.size());
+        jfloatArray jnextRects = env->NewFloatArray(nextRects.size());
+        if (jrects != NULL && jnextRects != NULL) {
+            env->SetFloatArrayRegion(jrects, 0, rects.size(), rects.data());
+            env->SetFloatArrayRegion(jnextRects, 0, nextRects.size(), nextRects.data());
+            env->CallVoidMethod(core, spanningCallback, listener, pageIndex, start, end, jrects,
+                                jnextRects);
+        }
+        checkException(env);
+        env->DeleteLocalRef(jrects);
+        env->DeleteLocalRef(jnextRects);
+    }
+
+    void run() {
+        JNIEnv *env;
+        if (vm->AttachCurrentThread(&env, NULL) != JNI_OK) {
+            LOGE("Search cannot attach to VM");
+            return;
+        }
+
+        std::vector<uint32_t> codePoints;
+        JoinedMatches joined;
+        std::vector<CharBox> pageRects;
+        std::vector<jint> matches;
+        std::vector<jfloat> rects;
+        PageTail tail;
+        PageTail nextTail;
+        std::vector<jfloat> spanningRects;
+        std::vector<jfloat> spanningNextRects;
+
+        for (int pageIndex = fromPage; pageIndex <= toPage && waitForIdle(); pageIndex++) {
+            FPDF_PAGE page = NULL;
+            FPDF_TEXTPAGE textPage = NULL;
+            int charCount = 0;
+            codePoints.clear();
+            {
+                PdfiumGuard guard(true);
+                FPDF_TEXTPAGE source = getTextPage(pageIndex, &page, &textPage);
+                charCount = source != NULL ? FPDFText_CountChars(source) : 0;
+                for (int i = 0; i < charCount; i++) {
+                    codePoints.push_back(FPDFText_GetUnicode(source, i));
+                }
+                nextTail.firstBox = std::max(charCount - TAIL_CHARS, 0);
+                nextTail.boxes.resize(charCount - nextTail.firstBox);
+                for (size_t i = 0; i < nextTail.boxes.size(); i++) {
+                    CharBox &box = nextTail.boxes[i];
+                    FPDFText_GetCharBox(source, nextTail.firstBox + i, &box.left, &box.right,
+                                        &box.bottom, &box.top);
+                }
+            }
+
+            matchJoinedPage(*regex, stopping, tail.text, codePoints.data(), charCount,
+                            nextTail.firstBox, &joined, &nextTail.text);
+            const std::vector<int> &ranges = joined.ranges;
+            int spanningStart = joined.spanningStart;
+            int spanningEnd = joined.spanningEnd;
+
+            spanningRects.clear();
+            if (spanningStart >= 0) {
+                pageRects.assign(tail.boxes.begin() + (spanningStart - tail.firstBox),
+                                 tail.boxes.end());
+                mergeLineRects(&pageRects);
+                appendRects(pageRects, &spanningRects);
+            }
+            std::swap(tail, nextTail);
+
+            matches.clear();
+            rects.clear();
+            spanningNextRects.clear();
+            if (!ranges.empty() || spanningStart >= 0 || page != NULL) {
+                PdfiumGuard guard(true);
+                FPDF_TEXTPAGE source = ranges.empty() && spanningStart < 0 ? NULL
+                        : getTextPage(pageIndex, &page, &textPage);
+                if (source != NULL && spanningStart >= 0) {
+                    int first = joined.spanningFirst;
+                    int count = FPDFText_CountRects(source, first, spanningEnd - first);
+                    pageRects.resize(std::max(count, 0));
+                    for (size_t i = 0; i < pageRects.size(); i++) {
+                        CharBox &rect = pageRects[i];
+                        FPDFText_GetRect(source, i, &rect.left, &rect.top, &rect.right,
+                                         &rect.bottom);
+                    }
+                    mergeLineRects(&pageRects);
+                    appendRects(pageRects, &spanningNextRects);
+                }
+                for (size_t r = 0; source != NULL && r < ranges.size(); r += 2) {
+                    int count = FPDFText_CountRects(source, ranges[r], ranges[r + 1] - ranges[r]);
+                    pageRects.resize(std::max(count, 0));
+                    for (size_t i = 0; i < pageRects.size(); i++) {
+                        CharBox &rect = pageRects[i];
+                        FPDFText_GetRect(source, i, &rect.left, &rect.top, &rect.right,
+                                         &rect.bottom);
+                    }
+                    mergeLineRects(&pageRects);
+                    appendRects(pageRects, &rects);
+                    matches.push_back(ranges[r]);
+                    matches.push_back(ranges[r + 1]);
+                    matches.push_back(rects.size() / 4);
+                }
+                if (textPage != NULL) FPDFText_ClosePage(textPage);
+                if (page != NULL) FPDF_ClosePage(page);
+            }
+
+            if (stopping.load()) break;
+            if (spanningStart >= 0) {
+                deliverSpanning(env, pageIndex - 1, spanningStart, spanningEnd, spanningRects,
+                                spanningNextRects);
+            }
+            if (!matches.empty()) deliver(env, pageIndex, matches, rects);
+        }
+
+        env->CallVoidMethod(core, finishedCallback, listener, (jboolean) stopping.load());
+        checkException(env);
+        bool deleteSelf = deleteOnExit;
+        if (deleteSelf) release(env);
+        vm->DetachCurrentThread();
+        if (deleteSelf) {
+            worker.detach();
+            delete this;
+        }
+    }
+};
+
+// Must match PdfiumCore.OPEN_CANCELLED, other failures report FPDF_ERR_*
+static const int OPEN_CANCELLED = -1;
+// Cross-reference data read ahead of parsing; larger tables are left to on-demand reads
+static const size_t OPEN_WARM_XREF_BYTES = 32 * 1024 * 1024;
+
+// Opens a document on its own thread. pdfium reads header, trailer and cross-reference data in
+// many small blocks while parsing, so those regions are read into the page cache first, without
+// the pdfium lock. The lock is held only for FPDF_LoadCustomDocument itself, as pdfium is not
+// thread-safe. Result goes to PdfiumCore#onDocumentOpenResult on the worker thread, after which
+// the object deletes itself.
+class AsyncDocumentOpen {
+public:
+    AsyncDocumentOpen(JavaVM *vm, jobject core, jmethodID callback, jobject task, int fd,
+                      const char *password)
+            : vm(vm), core(core), callback(callback), task(task),
+              hasPassword(password != NULL), password(password != NULL ? password : "") {
+        docFile = new DocumentFile();
+        docFile->fileFd = fd;
+    }
+
+    void start() {
+        std::thread(&AsyncDocumentOpen::run, this).detach();
+    }
+
+    // Only valid until the result is delivered, PdfOpenTask guards that
+    void cancel() {
+        cancelled = true;
+        docFile->loadCancelled = true;
+    }
+
+private:
+    JavaVM *vm;
+    jobject core;
+    jmethodID callback;
+    jobject task;
+    const bool hasPassword;
+    const std::string password;
+    DocumentFile *docFile;
+    std::atomic<bool> cancelled{false};
+
+    static int getBlock(void *param, unsigned long position, unsigned char *outBuffer,
+                        unsigned long size) {
+        DocumentFile *doc = static_cast<DocumentFile*>(param);
+        if (doc->loadCancelled.load()) return 0;
+        if (pread(doc->fileFd, outBuffer, size, position) < 0) {
+            LOGE("Cannot read from file descriptor. Error:%d", errno);
+            return 0;
+        }
+        return 1;
+    }
+
+    // Returns false if cancelled
+    bool warmRange(off_t offset, size_t length, std::vector<uint8_t> &buffer) {
+        while (length > 0) {
+            if (cancelled.load()) return false;
+            ssize_t readCount = pread(docFile->fileFd, buffer.data(),
+                                      std::min(length, buffer.size()), offset);
+            if (readCount <= 0) return true; // parsing reports real errors
+            offset += readCount;
+            length -= (size_t) readCount;
+        }
+        return !cancelled.load();
+    }
+
+    bool warmUp(size_t fileLength) {
+        std::vector<uint8_t> buffer(FINGERPRINT_READ_BYTES);
+        if (!warmRange(0, std::min(fileLength, FINGERPRINT_HEAD_BYTES), buffer)) return false;
+
+        size_t tailSize = std::min(fileLength, FINGERPRINT_TAIL_BYTES);
+        off_t tailOffset = fileLength - tailSize;
+        ssize_t readCount = pread(docFile->fileFd, buffer.data(), tailSize, tailOffset);
+        if (readCount <= 0) return !cancelled.load();
+
+        long long xrefOffset = findStartXref(buffer.data(), (size_t) readCount);
+        if (xrefOffset >= 0 && xrefOffset < tailOffset) {
+            size_t xrefSize = std::min((size_t) (tailOffset - xrefOffset), OPEN_WARM_XREF_BYTES);
+            posix_fadvise(docFile->fileFd, xrefOffset, xrefSize, POSIX_FADV_WILLNEED);
+            if (!warmRange((off_t) xrefOffset, xrefSize, buffer)) return false;
+        }
+        return !cancelled.load();
+    }
+
+    void run() {
+        JNIEnv *env;
+        if (vm->AttachCurrentThread(&env, NULL) != JNI_OK) {
+            LOGE("Document open cannot attach to VM");
+            return;
+        }
+
+        jlong result = 0;
+        int error = OPEN_CANCELLED;
+        std::string message;
+
+        size_t fileLength = (size_t) getFileSize(docFile->fileFd);
+        if (fileLength <= 0) {
+            error = FPDF_ERR_FILE;
+            message = "File is empty";
+        } else if (warmUp(fileLength)) {
+            FPDF_FILEACCESS loader;
+            loader.m_FileLen = fileLength;
+            loader.m_Param = docFile;
+            loader.m_GetBlock = &AsyncDocumentOpen::getBlock;
+
+            PdfiumGuard guard;
+            FPDF_DOCUMENT document = cancelled.load() ? NULL
+                    : FPDF_LoadCustomDocument(&loader, hasPassword ? password.c_str() : NULL);
+            if (document != NULL && !cancelled.load()) {
+                docFile->pdfDocument = document;
+                docFile->fileSize = fileLength;
+                result = reinterpret_cast<jlong>(docFile);
+                docFile = NULL;
+                error = FPDF_ERR_SUCCESS;
+            } else if (document != NULL) {
+                FPDF_CloseDocument(document);
+            } else if (!cancelled.load()) {
+                error = (int) FPDF_GetLastError();
+                char *description = getErrorDescription(error);
+                message = description;
+                free(description);
+            }
+            if (docFile != NULL) {
+                delete docFile;
+                docFile = NULL;
+            }
+        }
+        if (docFile != NULL) {
+            // Cancelled or failed before parsing, nothing pdfium-owned to release
+            delete docFile;
+        }
+
+        jstring jmessage = message.empty() ? NULL : env->NewStringUTF(message.c_str());
+        env->CallVoidMethod(core, callback, task, result, error, jmessage);
+        if (env->ExceptionCheck()) {
+            LOGE("Document open callback threw an exception");
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+        }
+
+        env->DeleteGlobalRef(core);
+        env->DeleteGlobalRef(task);
+        // Detach first, vm is a member
+        vm->DetachCurrentThread();
+        delete this;
+    }
+};
+
+extern "C" { //For JNI support
+
+static int getBlock(void* param, unsigned long position, unsigned char* outBuffer,
+        unsigned long size) {
+    const int fd = reinterpret_cast<intptr_t>(param);
+    const int readCount = pread(fd, outBuffer, size, position);
+    if (readCount < 0) {
+        LOGE("Cannot read from file descriptor. Error:%d", errno);
+        return 0;
+    }
+    return 1;
+}
+
+JNI_FUNC(jlong, PdfiumCore, nativeOpenDocument)(JNI_ARGS, jint fd, jstring password){
+
+    size_t fileLength = (size_t)getFileSize(fd);
+    if(fileLength <= 0) {
+        jniThrowException(env, "java/io/IOException",
+                                    "File is empty");
+        return -1;
+    }
+
+    DocumentFile *docFile = new DocumentFile();
+
+    FPDF_FILEACCESS loader;
+    loader.m_FileLen = fileLength;
+    loader.m_Param = reinterpret_cast<void*>(intptr_t(fd));
+    loader.m_GetBlock = &getBlock;
+
+    const char *cpassword = NULL;
+    if(password != NULL) {
+        cpassword = env->GetStringUTFChars(password, NULL);
+    }
+
+    PdfiumGuard guard;
+    FPDF_DOCUMENT document = FPDF_LoadCustomDocument(&loader, cpassword);
+
+    if(cpassword != NULL) {
+        env->ReleaseStringUTFChars(password, cpassword);
+    }
+
+    if (!document) {
+        delete docFile;
+
+        const long errorNum = FPDF_GetLastError();
+        if(errorNum == FPDF_ERR_PASSWORD) {
+            jniThrowException(env, "com/shockwave/pdfium/PdfPasswordException",
+                                    "Password required or incorrect password.");
+        } else {
+            char* error = getErrorDescription(errorNum);
+            jniThrowExceptionFmt(env, "java/io/IOException",
+                                    "cannot create document: %s", error);
+
+            free(error);
+        }
+
+        return -1;
+    }
+
+    docFile->pdfDocument = document;
+
+    return reinterpret_cast<jlong>(docFile);
+}
+
+JNI_FUNC(jlong, PdfiumCore, nativeOpenMemDocument)(JNI_ARGS, jbyteArray data, jstring password){
+    DocumentFile *docFile = new DocumentFile();
+
+    const char *cpassword = NULL;
+    if(password != NULL) {
+        cpassword = env->GetStringUTFChars(password, NULL);
+    }
+
+    jbyte *cData = env->GetByteArrayElements(data, NULL);
+    int size = (int) env->GetArrayLength(data);
+    jbyte *cDataCopy = new jbyte[size];
+    memcpy(cDataCopy, cData, size);
+    PdfiumGuard guard;
+    FPDF_DOCUMENT document = FPDF_LoadMemDocument( reinterpret_cast<const void*>(cDataCopy),
+                                                          size, cpassword);
+    env->ReleaseByteArrayElements(data, cData, JNI_ABORT);
+
+    if(cpassword != NULL) {
+        env->ReleaseStringUTFChars(password, cpassword);
+    }
+
+    if (!document) {
+        delete docFile;
+
+        const long errorNum = FPDF_GetLastError();
+        if(errorNum == FPDF_ERR_PASSWORD) {
+            jniThrowException(env, "com/shockwave/pdfium/PdfPasswordException",
+                                    "Password required or incorrect password.");
+        } else {
+            char* error = getErrorDescription(errorNum);
+            jniThrowExceptionFmt(env, "java/io/IOException",
+                                    "cannot create document: %s", error);
+
+            free(error);
+        }
+
+        return -1;
+    }
+
+    docFile->pdfDocument = document;
+
+    return reinterpret_cast<jlong>(docFile);
+}
+
+JNI_FUNC(jint, PdfiumCore, nativeGetPageCount)(JNI_ARGS, jlong documentPtr){
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(documentPtr);
+    PdfiumGuard guard;
+    return (jint)FPDF_GetPageCount(doc->pdfDocument);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeCloseDocument)(JNI_ARGS, jlong documentPtr){
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(documentPtr);
+    delete doc;
+}
+
+static jlong loadPageInternal(JNIEnv *env, DocumentFile *doc, int pageIndex){
+    try{
+        if(doc == NULL) throw "Get page document null";
+
+        FPDF_DOCUMENT pdfDoc = doc->pdfDocument;
+        if(pdfDoc != NULL){
+            FPDF_PAGE page = doc->loadPage(pageIndex);
             if (page == NULL) {
                 throw "Loaded page is null";
             }
@@ -367,137 +2238,748 @@ static jlong loadPageInternal(JNIEnv *env, DocumentFile *doc, int pageIndex){
             throw "Get page pdf document null";
         }
 
-    }catch(const char *msg){
-        LOGE("%s", msg);
+    }catch(const char *msg){
+        LOGE("%s", msg);
+
+        jniThrowException(env, "java/lang/IllegalStateException",
+                                "cannot load page");
+
+        return -1;
+    }
+}
+
+JNI_FUNC(jlong, PdfiumCore, nativeLoadPage)(JNI_ARGS, jlong docPtr, jint pageIndex){
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    return loadPageInternal(env, doc, (int)pageIndex);
+}
+JNI_FUNC(jlongArray, PdfiumCore, nativeLoadPages)(JNI_ARGS, jlong docPtr, jint fromIndex, jint toIndex){
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+
+    if(toIndex < fromIndex) return NULL;
+    jlong pages[ toIndex - fromIndex + 1 ];
+
+    int i;
+    for(i = 0; i <= (toIndex - fromIndex); i++){
+        pages[i] = loadPageInternal(env, doc, (int)(i + fromIndex));
+    }
+
+    jlongArray javaPages = env -> NewLongArray( (jsize)(toIndex - fromIndex + 1) );
+    env -> SetLongArrayRegion(javaPages, 0, (jsize)(toIndex - fromIndex + 1), (const jlong*)pages);
+
+    return javaPages;
+}
+
+JNI_FUNC(void, PdfiumCore, nativeClosePage)(JNI_ARGS, jlong pagePtr){ closePageInternal(pagePtr); }
+JNI_FUNC(void, PdfiumCore, nativeClosePages)(JNI_ARGS, jlongArray pagesPtr){
+    int length = (int)(env -> GetArrayLength(pagesPtr));
+    jlong *pages = env -> GetLongArrayElements(pagesPtr, NULL);
+
+    int i;
+    for(i = 0; i < length; i++){ closePageInternal(pages[i]); }
+}
+
+JNI_FUNC(jint, PdfiumCore, nativeGetPageWidthPixel)(JNI_ARGS, jlong pagePtr, jint dpi){
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PdfiumGuard guard;
+    return (jint)(FPDF_GetPageWidth(page) * dpi / 72);
+}
+JNI_FUNC(jint, PdfiumCore, nativeGetPageHeightPixel)(JNI_ARGS, jlong pagePtr, jint dpi){
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PdfiumGuard guard;
+    return (jint)(FPDF_GetPageHeight(page) * dpi / 72);
+}
+
+JNI_FUNC(jint, PdfiumCore, nativeGetPageWidthPoint)(JNI_ARGS, jlong pagePtr){
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PdfiumGuard guard;
+    return (jint)FPDF_GetPageWidth(page);
+}
+JNI_FUNC(jint, PdfiumCore, nativeGetPageHeightPoint)(JNI_ARGS, jlong pagePtr){
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PdfiumGuard guard;
+    return (jint)FPDF_GetPageHeight(page);
+}
+JNI_FUNC(jobject, PdfiumCore, nativeGetPageSizeByIndex)(JNI_ARGS, jlong docPtr, jint pageIndex, jint dpi){
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    if(doc == NULL) {
+        LOGE("Document is null");
+
+        jniThrowException(env, "java/lang/IllegalStateException",
+                               "Document is null");
+        return NULL;
+    }
+
+    double width, height;
+    int result;
+    {
+        PdfiumGuard guard;
+        result = FPDF_GetPageSizeByIndex(doc->pdfDocument, pageIndex, &width, &height);
+    }
+
+    if (result == 0) {
+        width = 0;
+        height = 0;
+    }
+
+    jint widthInt = (jint) (width * dpi / 72);
+    jint heightInt = (jint) (height * dpi / 72);
+
+    jclass clazz = env->FindClass("com/shockwave/pdfium/util/Size");
+    jmethodID constructorID = env->GetMethodID(clazz, "<init>", "(II)V");
+    return env->NewObject(clazz, constructorID, widthInt, heightInt);
+}
+
+// Must match PdfiumCore.QUALITY_*
+enum RenderQuality {
+    RENDER_QUALITY_FAILED = -1,
+    RENDER_QUALITY_DRAFT = 0,
+    RENDER_QUALITY_FULL = 1
+};
+
+// Draft renders a quarter of the pixels without anti-aliasing, then upscales
+static const int DRAFT_SCALE = 2;
+static const int DRAFT_FLAGS = FPDF_RENDER_NO_SMOOTHTEXT | FPDF_RENDER_NO_SMOOTHIMAGE
+                               | FPDF_RENDER_NO_SMOOTHPATH | FPDF_RENDER_LIMITEDIMAGECACHE;
+
+// Highlight composited over a rendered page, rect in page coordinates, color ARGB
+struct Highlight {
+    float left;
+    float top;
+    float right;
+    float bottom;
+    uint32_t color;
+};
+
+// Must match PdfiumCore.COLOR_MODE_*
+enum ColorMode {
+    COLOR_MODE_NORMAL = 0,
+    COLOR_MODE_INVERT = 1,
+    // Inverts lightness keeping hue and saturation, so colored text and images stay recognizable
+    COLOR_MODE_INVERT_LIGHTNESS = 2,
+    COLOR_MODE_SEPIA = 3,
+    COLOR_MODE_MATRIX = 4
+};
+
+// Color transform applied to rendered pixels. The matrix is 4x5 like android.graphics.ColorMatrix,
+// rows give R, G, B, A from R, G, B, A and an offset in 0..255, and is only read in matrix mode.
+struct ColorTransform {
+    int mode = COLOR_MODE_NORMAL;
+    float matrix[20];
+};
+
+struct RenderOptions {
+    int flags = FPDF_REVERSE_BYTE_ORDER;
+    int quality = RENDER_QUALITY_FULL;
+    // Render into a scratch buffer and copy the finished page, so a bitmap on screen never shows
+    // a half-drawn page
+    bool offscreen = false;
+    RenderCache *cache = NULL;
+    // Identifies document and page for the render cache, empty to bypass the cache
+    std::string cacheKey;
+    // Blended into the page after rendering, so cached tiles include them
+    std::vector<Highlight> highlights;
+    // Applied right after rasterization, before highlights, so cached tiles are in final colors
+    ColorTransform colors;
+};
+
+static std::string getRenderCacheKey(const RenderOptions &options, const RenderTarget &target,
+                                     int startX, int startY, int drawSizeHor, int drawSizeVer) {
+    char params[128];
+    snprintf(params, sizeof(params), "|%d,%d,%d,%d|%dx%d|%d|%x", startX, startY,
+             drawSizeHor, drawSizeVer, target.width, target.height, target.format, options.flags);
+    std::string key = options.cacheKey + params;
+    if (!options.highlights.empty()) {
+        snprintf(params, sizeof(params), "|h%016llx", (unsigned long long) fnv1a64(
+                options.highlights.data(), options.highlights.size() * sizeof(Highlight)));
+        key += params;
+    }
+    if (options.colors.mode != COLOR_MODE_NORMAL) {
+        unsigned long long matrixHash = options.colors.mode == COLOR_MODE_MATRIX
+                ? fnv1a64(options.colors.matrix, sizeof(options.colors.matrix)) : 0;
+        snprintf(params, sizeof(params), "|c%d:%016llx", options.colors.mode, matrixHash);
+        key += params;
+    }
+    return key;
+}
+
+// Renders rows [top, top + rows) of the target into a pdfium-compatible buffer, including the gray
+// background around the page and the white page area. The only place rendering takes the pdfium
+// lock, pixel conversion before and after runs unlocked. Returns false if the page was closed.
+static bool renderPageRows(FPDF_PAGE page, void *buffer, int format, int stride,
+                           int canvasHorSize, int canvasVerSize, int top, int rows,
+                           int startX, int startY, int drawSizeHor, int drawSizeVer, int flags) {
+    PdfiumGuard guard;
+    if (!isLivePage(page)) {
+        LOGE("Page closed before rendering");
+        return false;
+    }
+
+    FPDF_BITMAP pdfBitmap = FPDFBitmap_CreateEx( canvasHorSize, rows,
+                                                 format, buffer, stride);
+
+    /*LOGD("Start X: %d", startX);
+    LOGD("Start Y: %d", startY);
+    LOGD("Canvas Hor: %d", canvasHorSize);
+    LOGD("Canvas Ver: %d", canvasVerSize);
+    LOGD("Draw Hor: %d", drawSizeHor);
+    LOGD("Draw Ver: %d", drawSizeVer);*/
+
+    if(drawSizeHor < canvasHorSize || drawSizeVer < canvasVerSize){
+        FPDFBitmap_FillRect( pdfBitmap, 0, 0, canvasHorSize, rows,
+                             0x848484FF); //Gray
+    }
+
+    int baseHorSize = (canvasHorSize < drawSizeHor)? canvasHorSize : drawSizeHor;
+    int baseVerSize = (canvasVerSize < drawSizeVer)? canvasVerSize : drawSizeVer;
+    int baseX = (startX < 0)? 0 : startX;
+    int baseY = (startY < 0)? 0 : startY;
+
+    FPDFBitmap_FillRect( pdfBitmap, baseX, baseY - top, baseHorSize, baseVerSize,
+                         0xFFFFFFFF); //White
+
+    FPDF_RenderPageBitmap( pdfBitmap, page,
+                           startX, startY - top,
+                           drawSizeHor, drawSizeVer,
+                           0, flags );
+
+    FPDFBitmap_Destroy(pdfBitmap);
+    return true;
+}
+
+// Scratch buffer limit of the 8-bit path; pages taller than that are rendered in strips
+static const size_t GRAY_SCRATCH_BYTES = 4 * 1024 * 1024;
+static const int GRAY_MIN_STRIP_ROWS = 64;
+
+// BT.601 luma with weights summing to 256; written as a plain loop the compiler vectorizes
+static void reduceToLuma(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+                         int width, int rows, bool rgbaOrder) {
+    const int redOffset = rgbaOrder ? 0 : 2;
+    const int blueOffset = rgbaOrder ? 2 : 0;
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *in = src + y * srcStride;
+        uint8_t *out = dst + y * dstStride;
+        for (int x = 0; x < width; x++) {
+            const uint8_t *pixel = in + x * 4;
+            out[x] = (uint8_t) ((77 * pixel[redOffset] + 150 * pixel[1]
+                                 + 29 * pixel[blueOffset]) >> 8);
+        }
+    }
+}
+
+static const float SEPIA_MATRIX[20] = {
+        0.393f, 0.769f, 0.189f, 0, 0,
+        0.349f, 0.686f, 0.168f, 0, 0,
+        0.272f, 0.534f, 0.131f, 0, 0,
+        0, 0, 0, 1, 0
+};
+
+static const float INVERT_MATRIX[20] = {
+        -1, 0, 0, 0, 255,
+        0, -1, 0, 0, 255,
+        0, 0, -1, 0, 255,
+        0, 0, 0, 1, 0
+};
+
+static inline int clampByte(int value) {
+    return std::min(std::max(value, 0), 255);
+}
+
+// Matrix m in 8.8 fixed point over pixels of 3 bytes (alpha reads as opaque) or 4. Called with
+// a constant pixel size, so once inlined the loop is plain and the compiler vectorizes it.
+static inline void applyColorMatrix(uint8_t *pixels, int count, int bpp, int redOffset,
+                                    const int *m) {
+    const int blueOffset = 2 - redOffset;
+    for (int x = 0; x < count; x++) {
+        uint8_t *pixel = pixels + x * bpp;
+        const int r = pixel[redOffset], g = pixel[1], b = pixel[blueOffset];
+        const int a = bpp == 4 ? pixel[3] : 255;
+        pixel[redOffset] = (uint8_t) clampByte((m[0] * r + m[1] * g + m[2] * b + m[3] * a
+                                                + m[4]) >> 8);
+        pixel[1] = (uint8_t) clampByte((m[5] * r + m[6] * g + m[7] * b + m[8] * a + m[9]) >> 8);
+        pixel[blueOffset] = (uint8_t) clampByte((m[10] * r + m[11] * g + m[12] * b + m[13] * a
+                                                 + m[14]) >> 8);
+        if (bpp == 4) {
+            pixel[3] = (uint8_t) clampByte((m[15] * r + m[16] * g + m[17] * b + m[18] * a
+                                            + m[19]) >> 8);
+        }
+    }
+}
+
+// HSL lightness becomes 255 - lightness by shifting all channels by the same amount, which keeps
+// hue and saturation: black and white swap, pure colors stay
+static inline void invertLightness(uint8_t *pixels, int count, int bpp) {
+    for (int x = 0; x < count; x++) {
+        uint8_t *pixel = pixels + x * bpp;
+        const int r = pixel[0], g = pixel[1], b = pixel[2];
+        const int shift = 255 - std::max(r, std::max(g, b)) - std::min(r, std::min(g, b));
+        pixel[0] = (uint8_t) (r + shift);
+        pixel[1] = (uint8_t) (g + shift);
+        pixel[2] = (uint8_t) (b + shift);
+    }
+}
+
+// Applies the transform in place to rows of 3 or 4 byte pixels
+static void applyColorTransform(const ColorTransform &colors, uint8_t *pixels, int stride,
+                                int width, int rows, int bpp, bool rgbaOrder) {
+    if (colors.mode == COLOR_MODE_NORMAL) return;
+
+    const int redOffset = rgbaOrder ? 0 : 2;
+    const float *matrix = colors.mode == COLOR_MODE_INVERT ? INVERT_MATRIX
+                          : colors.mode == COLOR_MODE_SEPIA ? SEPIA_MATRIX : colors.matrix;
+    int m[20];
+    for (int i = 0; i < 20; i++) m[i] = (int) lroundf(matrix[i] * 256);
+    for (int y = 0; y < rows; y++) {
+        uint8_t *row = pixels + (size_t) y * stride;
+        if (colors.mode == COLOR_MODE_INVERT_LIGHTNESS) {
+            if (bpp == 4) invertLightness(row, width, 4); else invertLightness(row, width, 3);
+        } else if (bpp == 4) {
+            applyColorMatrix(row, width, 4, redOffset, m);
+        } else {
+            applyColorMatrix(row, width, 3, redOffset, m);
+        }
+    }
+}
+
+static bool renderPageGray(FPDF_PAGE page, const RenderTarget &target,
+                           int startX, int startY, int drawSizeHor, int drawSizeVer, int flags,
+                           const ColorTransform &colors) {
+    const int rowBytes = target.width * 4;
+    int stripRows = (int) std::max((size_t) GRAY_MIN_STRIP_ROWS, GRAY_SCRATCH_BYTES / rowBytes);
+    stripRows = std::min(stripRows, target.height);
+
+    uint8_t *scratch = (uint8_t*) malloc((size_t) stripRows * rowBytes);
+    if (scratch == NULL) {
+        LOGE("Cannot allocate grayscale render buffer");
+        return false;
+    }
+
+    // Gray color mode makes pdfium convert images and paths itself, the reduction only drops
+    // the three redundant channels
+    flags |= FPDF_GRAYSCALE;
+    bool rendered = true;
+    for (int top = 0; top < target.height; top += stripRows) {
+        int rows = std::min(stripRows, target.height - top);
+        rendered = renderPageRows(page, scratch, FPDFBitmap_BGRA, rowBytes, target.width,
+                                  target.height, top, rows, startX, startY, drawSizeHor,
+                                  drawSizeVer, flags);
+        if (!rendered) break;
+        applyColorTransform(colors, scratch, rowBytes, target.width, rows, 4,
+                            (flags & FPDF_REVERSE_BYTE_ORDER) != 0);
+        reduceToLuma(scratch, rowBytes, (uint8_t*) target.pixels + top * target.stride,
+                     target.stride, target.width, rows, (flags & FPDF_REVERSE_BYTE_ORDER) != 0);
+    }
+    free(scratch);
+    return rendered;
+}
 
-        jniThrowException(env, "java/lang/IllegalStateException",
-                                "cannot load page");
+static bool renderPageDirect(FPDF_PAGE page, const RenderTarget &target,
+                             int startX, int startY, int drawSizeHor, int drawSizeVer, int flags,
+                             const ColorTransform &colors) {
+    int canvasHorSize = target.width;
+    int canvasVerSize = target.height;
+    const bool rgbaOrder = (flags & FPDF_REVERSE_BYTE_ORDER) != 0;
+
+    if (target.format == ANDROID_BITMAP_FORMAT_A_8) {
+        return renderPageGray(page, target, startX, startY, drawSizeHor, drawSizeVer, flags,
+                              colors);
+    } else if (target.format == ANDROID_BITMAP_FORMAT_RGB_565) {
+        void *tmp = malloc(canvasVerSize * canvasHorSize * sizeof(rgb));
+        if (tmp == NULL) {
+            LOGE("Cannot allocate RGB565 conversion buffer");
+            return false;
+        }
+        int sourceStride = canvasHorSize * sizeof(rgb);
+        if (!renderPageRows(page, tmp, FPDFBitmap_BGR, sourceStride, canvasHorSize, canvasVerSize,
+                            0, canvasVerSize, startX, startY, drawSizeHor, drawSizeVer, flags)) {
+            free(tmp);
+            return false;
+        }
+        // Before the reduction to 16 bits, so transformed colors keep full precision
+        applyColorTransform(colors, (uint8_t*) tmp, sourceStride, canvasHorSize, canvasVerSize,
+                            3, rgbaOrder);
+
+        AndroidBitmapInfo info;
+        info.width = canvasHorSize;
+        info.height = canvasVerSize;
+        info.stride = target.stride;
+        rgbBitmapTo565(tmp, sourceStride, target.pixels, &info);
+        free(tmp);
+    } else {
+        if (!renderPageRows(page, target.pixels, FPDFBitmap_BGRA, target.stride,
+                            canvasHorSize, canvasVerSize, 0, canvasVerSize,
+                            startX, startY, drawSizeHor, drawSizeVer, flags)) {
+            return false;
+        }
+        applyColorTransform(colors, (uint8_t*) target.pixels, target.stride, canvasHorSize,
+                            canvasVerSize, 4, rgbaOrder);
+    }
+    return true;
+}
 
-        return -1;
+// Pixel size is a constant in each branch so the copies compile to single loads and stores
+static void upscaleRow(const uint8_t *in, uint8_t *out, int width, int scale, int bpp) {
+    switch (bpp) {
+        case 1:
+            for (int x = 0; x < width; x++) out[x] = in[x / scale];
+            break;
+        case 2:
+            for (int x = 0; x < width; x++) memcpy(out + x * 2, in + (x / scale) * 2, 2);
+            break;
+        default:
+            for (int x = 0; x < width; x++) memcpy(out + x * 4, in + (x / scale) * 4, 4);
+            break;
     }
 }
 
-static void closePageInternal(jlong pagePtr) { FPDF_ClosePage(reinterpret_cast<FPDF_PAGE>(pagePtr)); }
+// Nearest-neighbour upscale of src into dst, src pixel covering scale x scale dst pixels
+static void upscaleNearest(const RenderTarget &src, const RenderTarget &dst, int scale) {
+    const int bpp = bytesPerPixel(dst.format);
+    const int rowBytes = dst.width * bpp;
+    for (int y = 0; y < dst.height; y++) {
+        uint8_t *out = (uint8_t*) dst.pixels + y * dst.stride;
+        if (y % scale != 0) {
+            memcpy(out, out - dst.stride, rowBytes);
+            continue;
+        }
+        const uint8_t *in = (const uint8_t*) src.pixels + (y / scale) * src.stride;
+        upscaleRow(in, out, dst.width, scale, bpp);
+    }
+}
 
-JNI_FUNC(jlong, PdfiumCore, nativeLoadPage)(JNI_ARGS, jlong docPtr, jint pageIndex){
-    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
-    return loadPageInternal(env, doc, (int)pageIndex);
+static int floorDiv(int value, int divisor) {
+    return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
 }
-JNI_FUNC(jlongArray, PdfiumCore, nativeLoadPages)(JNI_ARGS, jlong docPtr, jint fromIndex, jint toIndex){
-    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
 
-    if(toIndex < fromIndex) return NULL;
-    jlong pages[ toIndex - fromIndex + 1 ];
+static bool renderPageDraft(FPDF_PAGE page, const RenderTarget &target,
+                            int startX, int startY, int drawSizeHor, int drawSizeVer, int flags,
+                            const ColorTransform &colors) {
+    RenderTarget small;
+    small.format = target.format;
+    small.width = (target.width + DRAFT_SCALE - 1) / DRAFT_SCALE;
+    small.height = (target.height + DRAFT_SCALE - 1) / DRAFT_SCALE;
+    small.stride = small.width * bytesPerPixel(small.format);
+    small.pixels = malloc((size_t) small.stride * small.height);
+    if (small.pixels == NULL) {
+        LOGE("Cannot allocate draft render buffer");
+        return false;
+    }
 
-    int i;
-    for(i = 0; i <= (toIndex - fromIndex); i++){
-        pages[i] = loadPageInternal(env, doc, (int)(i + fromIndex));
+    bool rendered = renderPageDirect(page, small,
+                                     floorDiv(startX, DRAFT_SCALE), floorDiv(startY, DRAFT_SCALE),
+                                     (drawSizeHor + DRAFT_SCALE - 1) / DRAFT_SCALE,
+                                     (drawSizeVer + DRAFT_SCALE - 1) / DRAFT_SCALE,
+                                     flags | DRAFT_FLAGS, colors);
+    if (rendered) {
+        upscaleNearest(small, target, DRAFT_SCALE);
     }
+    free(small.pixels);
+    return rendered;
+}
 
-    jlongArray javaPages = env -> NewLongArray( (jsize)(toIndex - fromIndex + 1) );
-    env -> SetLongArrayRegion(javaPages, 0, (jsize)(toIndex - fromIndex + 1), (const jlong*)pages);
+static bool renderPageOffscreen(FPDF_PAGE page, const RenderTarget &target,
+                                int startX, int startY, int drawSizeHor, int drawSizeVer,
+                                int flags, const ColorTransform &colors) {
+    const int rowBytes = target.width * bytesPerPixel(target.format);
+    RenderTarget scratch = target;
+    scratch.stride = rowBytes;
+    scratch.pixels = malloc((size_t) rowBytes * target.height);
+    if (scratch.pixels == NULL) {
+        LOGE("Cannot allocate offscreen render buffer");
+        return false;
+    }
 
-    return javaPages;
+    bool rendered = renderPageDirect(page, scratch, startX, startY, drawSizeHor, drawSizeVer,
+                                     flags, colors);
+    if (rendered) {
+        for (int y = 0; y < target.height; y++) {
+            memcpy((uint8_t*) target.pixels + y * target.stride,
+                   (uint8_t*) scratch.pixels + y * rowBytes, rowBytes);
+        }
+    }
+    free(scratch.pixels);
+    return rendered;
 }
 
-JNI_FUNC(void, PdfiumCore, nativeClosePage)(JNI_ARGS, jlong pagePtr){ closePageInternal(pagePtr); }
-JNI_FUNC(void, PdfiumCore, nativeClosePages)(JNI_ARGS, jlongArray pagesPtr){
-    int length = (int)(env -> GetArrayLength(pagesPtr));
-    jlong *pages = env -> GetLongArrayElements(pagesPtr, NULL);
+// Rounded x / 255, exact for x up to 255 * 255
+static inline uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
 
-    int i;
-    for(i = 0; i < length; i++){ closePageInternal(pages[i]); }
+// Blends over count pixels of 1 or 4 bytes, each byte as byte * weight + add. Weights repeat
+// with the pixel, so the loop has no branches and the compiler vectorizes it.
+static void blendBytes(uint8_t *pixels, int count, int bpp, const uint16_t *weight,
+                       const uint16_t *add) {
+    const int mask = bpp - 1;
+    for (int i = 0; i < count * bpp; i++) {
+        pixels[i] = (uint8_t) div255(pixels[i] * weight[i & mask] + add[i & mask]);
+    }
 }
 
-JNI_FUNC(jint, PdfiumCore, nativeGetPageWidthPixel)(JNI_ARGS, jlong pagePtr, jint dpi){
-    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
-    return (jint)(FPDF_GetPageWidth(page) * dpi / 72);
+static void blend565(uint16_t *pixels, int count, uint32_t color, uint32_t alpha) {
+    const uint32_t inverse = 255 - alpha;
+    const uint32_t red = ((color >> 19) & 0x1F) * alpha;
+    const uint32_t green = ((color >> 10) & 0x3F) * alpha;
+    const uint32_t blue = ((color >> 3) & 0x1F) * alpha;
+    for (int i = 0; i < count; i++) {
+        uint32_t pixel = pixels[i];
+        pixels[i] = (uint16_t) ((div255((pixel >> 11) * inverse + red) << 11)
+                                | (div255(((pixel >> 5) & 0x3F) * inverse + green) << 5)
+                                | div255((pixel & 0x1F) * inverse + blue));
+    }
 }
-JNI_FUNC(jint, PdfiumCore, nativeGetPageHeightPixel)(JNI_ARGS, jlong pagePtr, jint dpi){
-    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
-    return (jint)(FPDF_GetPageHeight(page) * dpi / 72);
+
+// First pixel whose centre is at or after coordinate, within [0, limit]. Clamped in float, the
+// cast is undefined for NaN and values out of int range.
+static int getPixelEdge(float coordinate, int limit) {
+    return (int) ceilf(fminf(fmaxf(coordinate - 0.5f, 0.0f), (float) limit));
 }
 
-JNI_FUNC(jint, PdfiumCore, nativeGetPageWidthPoint)(JNI_ARGS, jlong pagePtr){
-    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
-    return (jint)FPDF_GetPageWidth(page);
+// Blends highlights into the rendered target. Rects are mapped with the same transform the page
+// was rendered with; pixels are covered when their centre is inside the mapped rect. Returns
+// false if the page was closed after rendering.
+static bool blendHighlights(FPDF_PAGE page, const RenderTarget &target, int startX, int startY,
+                            int drawSizeHor, int drawSizeVer, bool rgbaOrder,
+                            const std::vector<Highlight> &highlights) {
+    if (highlights.empty()) return true;
+    PageTransform deviceToPage, pageToDevice;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) {
+            LOGE("Page closed before blending highlights");
+            return false;
+        }
+        if (!getDeviceToPageTransform(page, startX, startY, drawSizeHor, drawSizeVer, 0,
+                                      &deviceToPage)
+                || !invertTransform(deviceToPage, &pageToDevice)) {
+            return true;
+        }
+    }
+
+    const int bpp = bytesPerPixel(target.format);
+    for (size_t h = 0; h < highlights.size(); h++) {
+        const Highlight &highlight = highlights[h];
+        const uint32_t alpha = highlight.color >> 24;
+        if (alpha == 0) continue;
+
+        float corners[8] = {highlight.left, highlight.top, highlight.right, highlight.top,
+                            highlight.left, highlight.bottom, highlight.right, highlight.bottom};
+        transformPoints(pageToDevice, corners, corners, 4, false);
+        float minX = corners[0], maxX = corners[0], minY = corners[1], maxY = corners[1];
+        for (int i = 2; i < 8; i += 2) {
+            minX = std::min(minX, corners[i]);
+            maxX = std::max(maxX, corners[i]);
+            minY = std::min(minY, corners[i + 1]);
+            maxY = std::max(maxY, corners[i + 1]);
+        }
+        int left = getPixelEdge(minX, target.width);
+        int right = getPixelEdge(maxX, target.width);
+        int top = getPixelEdge(minY, target.height);
+        int bottom = getPixelEdge(maxY, target.height);
+        if (left >= right || top >= bottom) continue;
+
+        const uint32_t red = (highlight.color >> 16) & 0xFF;
+        const uint32_t green = (highlight.color >> 8) & 0xFF;
+        const uint32_t blue = highlight.color & 0xFF;
+        uint16_t weight[4], add[4];
+        for (int i = 0; i < 4; i++) weight[i] = (uint16_t) (255 - alpha);
+        if (target.format == ANDROID_BITMAP_FORMAT_A_8) {
+            add[0] = (uint16_t) (((77 * red + 150 * green + 29 * blue) >> 8) * alpha);
+        } else {
+            add[rgbaOrder ? 0 : 2] = (uint16_t) (red * alpha);
+            add[1] = (uint16_t) (green * alpha);
+            add[rgbaOrder ? 2 : 0] = (uint16_t) (blue * alpha);
+            add[3] = (uint16_t) (255 * alpha);
+        }
+
+        for (int y = top; y < bottom; y++) {
+            uint8_t *row = (uint8_t*) target.pixels + (size_t) y * target.stride + left * bpp;
+            if (target.format == ANDROID_BITMAP_FORMAT_RGB_565) {
+                blend565((uint16_t*) row, right - left, highlight.color, alpha);
+            } else {
+                blendBytes(row, right - left, bpp, weight, add);
+            }
+        }
+    }
+    return true;
 }
-JNI_FUNC(jint, PdfiumCore, nativeGetPageHeightPoint)(JNI_ARGS, jlong pagePtr){
-    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
-    return (jint)FPDF_GetPageHeight(page);
+
+// Area of the page inside the target, which is what pdfium rasterizes
+static double getVisibleMegapixels(const RenderTarget &target, int startX, int startY,
+                                   int drawSizeHor, int drawSizeVer) {
+    long long width = std::min(startX + drawSizeHor, target.width) - std::max(startX, 0);
+    long long height = std::min(startY + drawSizeVer, target.height) - std::max(startY, 0);
+    return width > 0 && height > 0 ? width * height / 1e6 : 0;
 }
-JNI_FUNC(jobject, PdfiumCore, nativeGetPageSizeByIndex)(JNI_ARGS, jlong docPtr, jint pageIndex, jint dpi){
-    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
-    if(doc == NULL) {
-        LOGE("Document is null");
 
-        jniThrowException(env, "java/lang/IllegalStateException",
-                               "Document is null");
-        return NULL;
+static void recordRenderTime(FPDF_PAGE page, double megapixels, long long nanos) {
+    PdfiumGuard guard;
+    std::map<FPDF_PAGE, LoadedPage>::iterator it = sLoadedPages.find(page);
+    if (it == sLoadedPages.end()) return;
+
+    RenderCostModel &model = it->second.doc->costModel;
+    model.recordRender(model.getComplexity(it->second.index, page), megapixels, nanos);
+}
+
+// Render steps fail when a buffer cannot be allocated or when the page was closed meanwhile. A
+// closed page stays closed, so checking it after the failure tells the two apart.
+static int getRenderFailure(FPDF_PAGE page, bool *pageClosed) {
+    if (pageClosed != NULL) {
+        PdfiumGuard guard;
+        *pageClosed = !isLivePage(page);
     }
+    return RENDER_QUALITY_FAILED;
+}
 
-    double width, height;
-    int result = FPDF_GetPageSizeByIndex(doc->pdfDocument, pageIndex, &width, &height);
+// Returns quality of the rendered result, which is full for draft requests served from the cache.
+// On failure *pageClosed, if given, tells whether the page was closed or memory ran out.
+static int renderPageToTarget(FPDF_PAGE page, const RenderTarget &target,
+                              int startX, int startY,
+                              int drawSizeHor, int drawSizeVer,
+                              const RenderOptions &options, bool *pageClosed = NULL){
+    std::string cacheKey;
+    if (options.cache != NULL && !options.cacheKey.empty()) {
+        cacheKey = getRenderCacheKey(options, target, startX, startY, drawSizeHor, drawSizeVer);
+        if (options.cache->load(cacheKey, target)) {
+            return RENDER_QUALITY_FULL;
+        }
+    }
 
-    if (result == 0) {
-        width = 0;
-        height = 0;
+    const bool rgbaOrder = (options.flags & FPDF_REVERSE_BYTE_ORDER) != 0;
+    if (options.quality == RENDER_QUALITY_DRAFT) {
+        if (!renderPageDraft(page, target, startX, startY, drawSizeHor, drawSizeVer,
+                             options.flags, options.colors)) {
+            return getRenderFailure(page, pageClosed);
+        }
+        if (!blendHighlights(page, target, startX, startY, drawSizeHor, drawSizeVer, rgbaOrder,
+                             options.highlights)) {
+            return getRenderFailure(page, pageClosed);
+        }
+        return RENDER_QUALITY_DRAFT;
     }
 
-    jint widthInt = (jint) (width * dpi / 72);
-    jint heightInt = (jint) (height * dpi / 72);
+    long long renderStart = nowNanos();
+    bool rendered = options.offscreen
+            ? renderPageOffscreen(page, target, startX, startY, drawSizeHor, drawSizeVer,
+                                  options.flags, options.colors)
+            : renderPageDirect(page, target, startX, startY, drawSizeHor, drawSizeVer,
+                               options.flags, options.colors);
+    if (!rendered) {
+        return getRenderFailure(page, pageClosed);
+    }
+    recordRenderTime(page, getVisibleMegapixels(target, startX, startY, drawSizeHor, drawSizeVer),
+                     nowNanos() - renderStart);
+    if (!blendHighlights(page, target, startX, startY, drawSizeHor, drawSizeVer, rgbaOrder,
+                         options.highlights)) {
+        return getRenderFailure(page, pageClosed);
+    }
 
-    jclass clazz = env->FindClass("com/shockwave/pdfium/util/Size");
-    jmethodID constructorID = env->GetMethodID(clazz, "<init>", "(II)V");
-    return env->NewObject(clazz, constructorID, widthInt, heightInt);
+    if (!cacheKey.empty()) {
+        options.cache->store(cacheKey, target);
+    }
+    return RENDER_QUALITY_FULL;
 }
 
-static void renderPageInternal( FPDF_PAGE page,
-                                ANativeWindow_Buffer *windowBuffer,
-                                int startX, int startY,
-                                int canvasHorSize, int canvasVerSize,
-                                int drawSizeHor, int drawSizeVer,
-                                bool renderAnnot){
+static RenderOptions getRenderOptions(bool renderAnnot){
+    RenderOptions options;
 
-    FPDF_BITMAP pdfBitmap = FPDFBitmap_CreateEx( canvasHorSize, canvasVerSize,
-                                                 FPDFBitmap_BGRA,
-                                                 windowBuffer->bits, (int)(windowBuffer->stride) * 4);
+    if(renderAnnot) {
+    	options.flags |= FPDF_ANNOT;
+    }
+    return options;
+}
 
-    /*LOGD("Start X: %d", startX);
-    LOGD("Start Y: %d", startY);
-    LOGD("Canvas Hor: %d", canvasHorSize);
-    LOGD("Canvas Ver: %d", canvasVerSize);
-    LOGD("Draw Hor: %d", drawSizeHor);
-    LOGD("Draw Ver: %d", drawSizeVer);*/
+static void setRenderCache(JNIEnv *env, RenderOptions *options, jlong cachePtr, jstring cacheKey) {
+    if (cachePtr == 0 || cacheKey == NULL) return;
 
-    if(drawSizeHor < canvasHorSize || drawSizeVer < canvasVerSize){
-        FPDFBitmap_FillRect( pdfBitmap, 0, 0, canvasHorSize, canvasVerSize,
-                             0x848484FF); //Gray
+    const char *key = env->GetStringUTFChars(cacheKey, NULL);
+    if (key == NULL) return;
+    options->cache = reinterpret_cast<RenderCache*>(cachePtr);
+    options->cacheKey = key;
+    env->ReleaseStringUTFChars(cacheKey, key);
+}
+
+// Throws IllegalArgumentException unless there is one color per packed rect
+static bool setHighlights(JNIEnv *env, RenderOptions *options, jfloatArray rects,
+                          jintArray colors) {
+    if (rects == NULL || colors == NULL) return true;
+
+    jsize count = env->GetArrayLength(colors);
+    if (env->GetArrayLength(rects) != count * 4) {
+        jniThrowException(env, "java/lang/IllegalArgumentException",
+                          "Highlights need one color per rect");
+        return false;
+    }
+    std::vector<jfloat> bounds(count * 4);
+    std::vector<jint> argb(count);
+    env->GetFloatArrayRegion(rects, 0, count * 4, bounds.data());
+    env->GetIntArrayRegion(colors, 0, count, argb.data());
+    options->highlights.resize(count);
+    for (jsize i = 0; i < count; i++) {
+        Highlight &highlight = options->highlights[i];
+        highlight.left = bounds[i * 4];
+        highlight.top = bounds[i * 4 + 1];
+        highlight.right = bounds[i * 4 + 2];
+        highlight.bottom = bounds[i * 4 + 3];
+        highlight.color = (uint32_t) argb[i];
     }
+    return true;
+}
 
-    int baseHorSize = (canvasHorSize < drawSizeHor)? canvasHorSize : drawSizeHor;
-    int baseVerSize = (canvasVerSize < drawSizeVer)? canvasVerSize : drawSizeVer;
-    int baseX = (startX < 0)? 0 : startX;
-    int baseY = (startY < 0)? 0 : startY;
-    int flags = FPDF_REVERSE_BYTE_ORDER;
+// Bounds of matrix factors and offsets, so the 8.8 fixed point sums of applyColorMatrix fit in
+// an int: 4 * 255 * 255 * 256 + 65535 * 256 < 2^31
+static const float MAX_COLOR_FACTOR = 255;
+static const float MAX_COLOR_OFFSET = 65535;
+
+// Throws IllegalArgumentException for an unknown mode or a matrix mode without 4x5 matrix
+static bool setColorTransform(JNIEnv *env, RenderOptions *options, jint colorMode,
+                              jfloatArray colorMatrix) {
+    if (colorMode < COLOR_MODE_NORMAL || colorMode > COLOR_MODE_MATRIX) {
+        jniThrowException(env, "java/lang/IllegalArgumentException", "Unknown color mode");
+        return false;
+    }
+    options->colors.mode = colorMode;
+    if (colorMode != COLOR_MODE_MATRIX) return true;
 
-    if(renderAnnot) {
-    	flags |= FPDF_ANNOT;
+    if (colorMatrix == NULL || env->GetArrayLength(colorMatrix) != 20) {
+        jniThrowException(env, "java/lang/IllegalArgumentException",
+                          "Color matrix must have 20 elements");
+        return false;
     }
+    float *matrix = options->colors.matrix;
+    env->GetFloatArrayRegion(colorMatrix, 0, 20, matrix);
+    for (int i = 0; i < 20; i++) {
+        float limit = i % 5 == 4 ? MAX_COLOR_OFFSET : MAX_COLOR_FACTOR;
+        matrix[i] = fminf(fmaxf(matrix[i], -limit), limit);
+    }
+    return true;
+}
 
-    FPDFBitmap_FillRect( pdfBitmap, baseX, baseY, baseHorSize, baseVerSize,
-                         0xFFFFFFFF); //White
+static void renderPageInternal( FPDF_PAGE page,
+                                ANativeWindow_Buffer *windowBuffer,
+                                int startX, int startY,
+                                int canvasHorSize, int canvasVerSize,
+                                int drawSizeHor, int drawSizeVer,
+                                const RenderOptions &options){
 
-    FPDF_RenderPageBitmap( pdfBitmap, page,
-                           startX, startY,
-                           drawSizeHor, drawSizeVer,
-                           0, flags );
+    RenderTarget target;
+    target.pixels = windowBuffer->bits;
+    target.format = ANDROID_BITMAP_FORMAT_RGBA_8888;
+    target.stride = (int)(windowBuffer->stride) * 4;
+    target.width = canvasHorSize;
+    target.height = canvasVerSize;
+
+    renderPageToTarget(page, target, startX, startY, drawSizeHor, drawSizeVer, options);
 }
 
 JNI_FUNC(void, PdfiumCore, nativeRenderPage)(JNI_ARGS, jlong pagePtr, jobject objSurface,
                                              jint dpi, jint startX, jint startY,
                                              jint drawSizeHor, jint drawSizeVer,
-                                             jboolean renderAnnot){
+                                             jboolean renderAnnot, jint colorMode,
+                                             jfloatArray colorMatrix){
+    RenderOptions options = getRenderOptions(renderAnnot);
+    if (!setColorTransform(env, &options, colorMode, colorMatrix)) return;
+
     ANativeWindow *nativeWindow = ANativeWindow_fromSurface(env, objSurface);
     if(nativeWindow == NULL){
         LOGE("native window pointer null");
@@ -529,97 +3011,590 @@ JNI_FUNC(void, PdfiumCore, nativeRenderPage)(JNI_ARGS, jlong pagePtr, jobject ob
                        (int)startX, (int)startY,
                        buffer.width, buffer.height,
                        (int)drawSizeHor, (int)drawSizeVer,
-                       (bool)renderAnnot);
+                       options);
 
     ANativeWindow_unlockAndPost(nativeWindow);
     ANativeWindow_release(nativeWindow);
 }
 
-JNI_FUNC(void, PdfiumCore, nativeRenderPageBitmap)(JNI_ARGS, jlong pagePtr, jobject bitmap,
+JNI_FUNC(jint, PdfiumCore, nativeRenderPageBitmap)(JNI_ARGS, jlong pagePtr, jobject bitmap,
                                              jint dpi, jint startX, jint startY,
                                              jint drawSizeHor, jint drawSizeVer,
-                                             jboolean renderAnnot){
+                                             jboolean renderAnnot, jint quality,
+                                             jboolean offscreen, jlong cachePtr,
+                                             jstring cacheKey, jfloatArray highlightRects,
+                                             jintArray highlightColors, jint colorMode,
+                                             jfloatArray colorMatrix){
 
     FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
 
     if(page == NULL || bitmap == NULL){
         LOGE("Render page pointers invalid");
-        return;
+        return RENDER_QUALITY_FAILED;
+    }
+
+    RenderOptions options = getRenderOptions(renderAnnot);
+    if (!setHighlights(env, &options, highlightRects, highlightColors)
+            || !setColorTransform(env, &options, colorMode, colorMatrix)) {
+        return RENDER_QUALITY_FAILED;
+    }
+
+    AndroidBitmapInfo info;
+    int ret;
+    if((ret = AndroidBitmap_getInfo(env, bitmap, &info)) < 0) {
+        LOGE("Fetching bitmap info failed: %s", strerror(ret * -1));
+        return RENDER_QUALITY_FAILED;
+    }
+
+    if(!isRenderableFormat(info.format)){
+        LOGE("Bitmap format must be RGBA_8888, RGB_565 or ALPHA_8");
+        return RENDER_QUALITY_FAILED;
+    }
+
+    void *addr;
+    if( (ret = AndroidBitmap_lockPixels(env, bitmap, &addr)) != 0 ){
+        LOGE("Locking bitmap failed: %s", strerror(ret * -1));
+        return RENDER_QUALITY_FAILED;
+    }
+
+    RenderTarget target;
+    target.pixels = addr;
+    target.format = info.format;
+    target.stride = info.stride;
+    target.width = info.width;
+    target.height = info.height;
+
+    options.quality = quality;
+    options.offscreen = offscreen;
+    setRenderCache(env, &options, cachePtr, cacheKey);
+
+    int rendered = renderPageToTarget(page, target, (int)startX, (int)startY,
+                                      (int)drawSizeHor, (int)drawSizeVer, options);
+
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return rendered;
+}
+
+JNI_FUNC(jboolean, PdfiumCore, nativeRenderPageGray)(JNI_ARGS, jlong pagePtr, jobject buffer,
+                                                     jint width, jint height, jint stride,
+                                                     jint startX, jint startY,
+                                                     jint drawSizeHor, jint drawSizeVer,
+                                                     jboolean renderAnnot, jlong cachePtr,
+                                                     jstring cacheKey){
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    void *addr = env->GetDirectBufferAddress(buffer);
+    if(page == NULL || addr == NULL){
+        LOGE("Render page pointers invalid");
+        return JNI_FALSE;
+    }
+    if(width <= 0 || height <= 0 || stride < width
+            || (jlong) stride * (height - 1) + width > env->GetDirectBufferCapacity(buffer)){
+        LOGE("Grayscale buffer too small");
+        return JNI_FALSE;
+    }
+
+    RenderTarget target;
+    target.pixels = addr;
+    target.format = ANDROID_BITMAP_FORMAT_A_8;
+    target.stride = stride;
+    target.width = width;
+    target.height = height;
+
+    RenderOptions options = getRenderOptions(renderAnnot);
+    setRenderCache(env, &options, cachePtr, cacheKey);
+
+    return (jboolean) (renderPageToTarget(page, target, (int)startX, (int)startY,
+                                          (int)drawSizeHor, (int)drawSizeVer, options)
+                       != RENDER_QUALITY_FAILED);
+}
+
+#ifndef ASHMEM_SET_NAME
+#define ASHMEM_SET_NAME _IOW(0x77, 1, char[256])
+#define ASHMEM_SET_SIZE _IOW(0x77, 3, size_t)
+#endif
+
+// Shared memory usable across fork: memfd where the kernel has it, ashmem on older devices
+static int createSharedMemory(const char *name, size_t size) {
+#ifdef __NR_memfd_create
+    int fd = (int) syscall(__NR_memfd_create, name, 0);
+    if (fd >= 0) {
+        if (ftruncate(fd, size) == 0) return fd;
+        close(fd);
+    }
+#endif
+    int ashmemFd = open("/dev/ashmem", O_RDWR);
+    if (ashmemFd < 0) return -1;
+    ioctl(ashmemFd, ASHMEM_SET_NAME, name);
+    if (ioctl(ashmemFd, ASHMEM_SET_SIZE, size) < 0) {
+        close(ashmemFd);
+        return -1;
+    }
+    return ashmemFd;
+}
+
+static bool readFully(int fd, void *data, size_t size) {
+    uint8_t *bytes = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t count = read(fd, bytes, size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+static bool sendFully(int socket, const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t count = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+// Renders pages of one document in forked helper processes, so renders run in parallel although
+// pdfium is not thread-safe. Workers are forked while pdfium is idle (under the pdfium lock) and
+// each gets a private copy-on-write snapshot of the library state with the document already
+// parsed. Pixels come back through a shared memory slot per worker, mapped before forking.
+// A worker that crashes or hangs is killed and forked again.
+class RenderFarm {
+public:
+    RenderFarm(DocumentFile *doc, int workerCount, size_t slotBytes)
+            : doc(doc), slotBytes(slotBytes), workers(workerCount) {}
+
+    // Forks all workers. Returns false as soon as one cannot start; the destructor stops the
+    // workers already started.
+    bool start() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker &worker = workers[i];
+            worker.memoryFd = createSharedMemory("pdfium-render", slotBytes);
+            if (worker.memoryFd < 0) return false;
+            void *memory = mmap(NULL, slotBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                worker.memoryFd, 0);
+            if (memory == MAP_FAILED) return false;
+            worker.memory = static_cast<uint8_t*>(memory);
+        }
+        PdfiumGuard guard;
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (!spawn(&workers[i])) return false;
+            idle.push_back(&workers[i]);
+        }
+        return true;
+    }
+
+    ~RenderFarm() {
+        // No renders are in flight, PdfiumCore excludes them while stopping
+        for (Worker &worker : workers) {
+            kill(&worker);
+            if (worker.memory != NULL) munmap(worker.memory, slotBytes);
+            if (worker.memoryFd >= 0) close(worker.memoryFd);
+        }
+    }
+
+    // Renders without the pdfium lock; it is taken only to fork a replacement worker
+    bool render(int pageIndex, const RenderTarget &target, int startX, int startY,
+                int drawSizeHor, int drawSizeVer, int flags, const ColorTransform &colors) {
+        const int rowBytes = target.width * bytesPerPixel(target.format);
+        if ((size_t) rowBytes * target.height > slotBytes) {
+            LOGE("Bitmap exceeds render worker buffer");
+            return false;
+        }
+
+        Command command;
+        command.pageIndex = pageIndex;
+        command.format = target.format;
+        command.width = target.width;
+        command.height = target.height;
+        command.startX = startX;
+        command.startY = startY;
+        command.drawSizeHor = drawSizeHor;
+        command.drawSizeVer = drawSizeVer;
+        command.flags = flags;
+        command.colors = colors;
+
+        Worker *worker = acquire();
+        bool rendered = false;
+        // A crashed worker is replaced and the page retried once; a page crashing twice fails
+        for (int attempt = 0; attempt < 2 && !rendered; attempt++) {
+            if (worker->pid <= 0) {
+                PdfiumGuard guard;
+                if (!spawn(worker)) break;
+            }
+
+            int status = WORKER_FAILED;
+            if (!sendFully(worker->socket, &command, sizeof(command))
+                    || !waitReply(worker->socket) || !readFully(worker->socket, &status,
+                                                                sizeof(status))) {
+                LOGE("Render worker %d lost, restarting", worker->pid);
+                kill(worker);
+                continue;
+            }
+            if (status != WORKER_OK) break;
+
+            for (int y = 0; y < target.height; y++) {
+                memcpy((uint8_t*) target.pixels + y * target.stride,
+                       worker->memory + y * rowBytes, rowBytes);
+            }
+            rendered = true;
+        }
+        release(worker);
+        return rendered;
+    }
+
+private:
+    static const int WORKER_OK = 0;
+    static const int WORKER_FAILED = 1;
+    static const int REPLY_TIMEOUT_MILLIS = 30 * 1000;
+    static const size_t WORKER_PAGE_CACHE = 4;
+
+    struct Command {
+        int pageIndex;
+        int format;
+        int width;
+        int height;
+        int startX;
+        int startY;
+        int drawSizeHor;
+        int drawSizeVer;
+        int flags;
+        ColorTransform colors;
+    };
+
+    struct Worker {
+        pid_t pid = -1;
+        int socket = -1;
+        int memoryFd = -1;
+        uint8_t *memory = NULL;
+    };
+
+    DocumentFile *doc;
+    const size_t slotBytes;
+    std::vector<Worker> workers;
+
+    std::mutex mutex;
+    std::condition_variable workerIdle;
+    std::vector<Worker*> idle;
+
+    Worker *acquire() {
+        std::unique_lock<std::mutex> guard(mutex);
+        while (idle.empty()) workerIdle.wait(guard);
+        Worker *worker = idle.back();
+        idle.pop_back();
+        return worker;
+    }
+
+    void release(Worker *worker) {
+        std::lock_guard<std::mutex> guard(mutex);
+        idle.push_back(worker);
+        workerIdle.notify_one();
+    }
+
+    static bool waitReply(int socket) {
+        struct pollfd pfd;
+        pfd.fd = socket;
+        pfd.events = POLLIN;
+        int ready;
+        do {
+            ready = poll(&pfd, 1, REPLY_TIMEOUT_MILLIS);
+        } while (ready < 0 && errno == EINTR);
+        return ready > 0;
+    }
+
+    void kill(Worker *worker) {
+        if (worker->socket >= 0) {
+            close(worker->socket);
+            worker->socket = -1;
+        }
+        if (worker->pid > 0) {
+            ::kill(worker->pid, SIGKILL);
+            waitpid(worker->pid, NULL, 0);
+            worker->pid = -1;
+        }
+    }
+
+    // Caller holds the pdfium lock, so the forked snapshot of pdfium is consistent
+    bool spawn(Worker *worker) {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) return false;
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(sockets[0]);
+            close(sockets[1]);
+            return false;
+        }
+        if (pid == 0) {
+            close(sockets[0]);
+            runWorker(sockets[1], worker->memory);
+        }
+
+        close(sockets[1]);
+        worker->pid = pid;
+        worker->socket = sockets[0];
+        return true;
+    }
+
+    // Worker process main loop, never returns
+    void runWorker(int socket, uint8_t *memory) {
+        // The worker exits on EOF of its socket, which the kernel closes when the app process
+        // dies. PR_SET_PDEATHSIG would not do: it fires when the forking thread exits, and
+        // replacements are forked on whichever render thread found a worker crashed.
+        sPdfiumLock.bypass();
+        // Crash quietly instead of going through the runtime's fault handlers
+        signal(SIGSEGV, SIG_DFL);
+        signal(SIGBUS, SIG_DFL);
+        signal(SIGFPE, SIG_DFL);
+        signal(SIGILL, SIG_DFL);
+        signal(SIGABRT, SIG_DFL);
+        // Parent ends of all sockets are inherited; keeping them would hide other workers' exits
+        for (Worker &other : workers) {
+            if (other.socket >= 0) close(other.socket);
+        }
+
+        std::deque<std::pair<int, FPDF_PAGE>> pages;
+        Command command;
+        while (readFully(socket, &command, sizeof(command))) {
+            FPDF_PAGE page = NULL;
+            for (std::pair<int, FPDF_PAGE> &entry : pages) {
+                if (entry.first == command.pageIndex) page = entry.second;
+            }
+            if (page == NULL) {
+                page = FPDF_LoadPage(doc->pdfDocument, command.pageIndex);
+                if (page != NULL) {
+                    if (pages.size() >= WORKER_PAGE_CACHE) {
+                        FPDF_ClosePage(pages.front().second);
+                        pages.pop_front();
+                    }
+                    pages.push_back(std::make_pair(command.pageIndex, page));
+                }
+            }
+
+            RenderTarget target;
+            target.pixels = memory;
+            target.format = command.format;
+            target.width = command.width;
+            target.height = command.height;
+            target.stride = command.width * bytesPerPixel(command.format);
+
+            int status = page != NULL
+                         && renderPageDirect(page, target, command.startX, command.startY,
+                                             command.drawSizeHor, command.drawSizeVer,
+                                             command.flags, command.colors)
+                         ? WORKER_OK : WORKER_FAILED;
+            if (!sendFully(socket, &status, sizeof(status))) break;
+        }
+        _exit(0);
+    }
+};
+
+JNI_FUNC(jlong, PdfiumCore, nativeStartRenderFarm)(JNI_ARGS, jlong docPtr, jint workerCount,
+                                                   jlong slotBytes) {
+    RenderFarm *farm = new RenderFarm(reinterpret_cast<DocumentFile*>(docPtr), workerCount,
+                                      (size_t) slotBytes);
+    if (!farm->start()) {
+        LOGE("Cannot start render workers: %s", strerror(errno));
+        delete farm;
+        return 0;
+    }
+    return reinterpret_cast<jlong>(farm);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeStopRenderFarm)(JNI_ARGS, jlong farmPtr) {
+    delete reinterpret_cast<RenderFarm*>(farmPtr);
+}
+
+JNI_FUNC(jboolean, PdfiumCore, nativeRenderPageBitmapFarm)(JNI_ARGS, jlong farmPtr, jobject bitmap,
+                                                           jint pageIndex, jint startX, jint startY,
+                                                           jint drawSizeHor, jint drawSizeVer,
+                                                           jboolean renderAnnot, jint colorMode,
+                                                           jfloatArray colorMatrix) {
+    RenderOptions options = getRenderOptions(renderAnnot);
+    if (!setColorTransform(env, &options, colorMode, colorMatrix)) return JNI_FALSE;
+
+    AndroidBitmapInfo info;
+    int ret;
+    if ((ret = AndroidBitmap_getInfo(env, bitmap, &info)) < 0) {
+        LOGE("Fetching bitmap info failed: %s", strerror(ret * -1));
+        return JNI_FALSE;
+    }
+    if (!isRenderableFormat(info.format)) {
+        LOGE("Bitmap format must be RGBA_8888, RGB_565 or ALPHA_8");
+        return JNI_FALSE;
     }
+    void *addr;
+    if ((ret = AndroidBitmap_lockPixels(env, bitmap, &addr)) != 0) {
+        LOGE("Locking bitmap failed: %s", strerror(ret * -1));
+        return JNI_FALSE;
+    }
+
+    RenderTarget target;
+    target.pixels = addr;
+    target.format = info.format;
+    target.stride = info.stride;
+    target.width = info.width;
+    target.height = info.height;
+
+    bool rendered = reinterpret_cast<RenderFarm*>(farmPtr)->render(
+            pageIndex, target, startX, startY, drawSizeHor, drawSizeVer, options.flags,
+            options.colors);
+
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return (jboolean) rendered;
+}
+
+// Must match PdfRenderJob.STATUS_*
+enum RenderJobStatus {
+    RENDER_JOB_OK = 0,
+    RENDER_JOB_PAGE_ERROR = 1,
+    RENDER_JOB_BITMAP_ERROR = 2,
+    RENDER_JOB_INVALID_PARAMS = 3,
+    RENDER_JOB_OUT_OF_MEMORY = 4
+};
+
+// Layout of one job in the packed int[] passed from PdfiumCore#renderPagesBitmap
+enum RenderJobParam {
+    JOB_DEST_X = 0,
+    JOB_DEST_Y,
+    JOB_DEST_WIDTH,
+    JOB_DEST_HEIGHT,
+    JOB_START_X,
+    JOB_START_Y,
+    JOB_DRAW_SIZE_HOR,
+    JOB_DRAW_SIZE_VER,
+    JOB_FLAGS,
+    JOB_PARAM_COUNT
+};
 
-    AndroidBitmapInfo info;
-    int ret;
-    if((ret = AndroidBitmap_getInfo(env, bitmap, &info)) < 0) {
-        LOGE("Fetching bitmap info failed: %s", strerror(ret * -1));
-        return;
-    }
+#define RENDER_JOB_FLAG_ANNOT 0x1
 
-    int canvasHorSize = info.width;
-    int canvasVerSize = info.height;
+struct LockedBitmap {
+    jobject bitmap;
+    AndroidBitmapInfo info;
+    void *addr;
+};
 
-    if(info.format != ANDROID_BITMAP_FORMAT_RGBA_8888 && info.format != ANDROID_BITMAP_FORMAT_RGB_565){
-        LOGE("Bitmap format must be RGBA_8888 or RGB_565");
-        return;
+// Locks each distinct bitmap once, so several jobs may draw into regions of the same frame.
+static LockedBitmap *lockJobBitmap(JNIEnv *env, std::vector<LockedBitmap> &locked, jobject bitmap) {
+    for (LockedBitmap &entry : locked) {
+        if (env->IsSameObject(entry.bitmap, bitmap)) {
+            return entry.addr != NULL ? &entry : NULL;
+        }
     }
 
-    void *addr;
-    if( (ret = AndroidBitmap_lockPixels(env, bitmap, &addr)) != 0 ){
+    LockedBitmap entry;
+    entry.bitmap = bitmap;
+    entry.addr = NULL;
+    int ret;
+    if ((ret = AndroidBitmap_getInfo(env, bitmap, &entry.info)) < 0) {
+        LOGE("Fetching bitmap info failed: %s", strerror(ret * -1));
+    } else if (!isRenderableFormat(entry.info.format)) {
+        LOGE("Bitmap format must be RGBA_8888, RGB_565 or ALPHA_8");
+    } else if ((ret = AndroidBitmap_lockPixels(env, bitmap, &entry.addr)) != 0) {
         LOGE("Locking bitmap failed: %s", strerror(ret * -1));
-        return;
+        entry.addr = NULL;
     }
+    locked.push_back(entry);
+    return entry.addr != NULL ? &locked.back() : NULL;
+}
 
-    void *tmp;
-    int format;
-    int sourceStride;
-    if (info.format == ANDROID_BITMAP_FORMAT_RGB_565) {
-        tmp = malloc(canvasVerSize * canvasHorSize * sizeof(rgb));
-        sourceStride = canvasHorSize * sizeof(rgb);
-        format = FPDFBitmap_BGR;
-    } else {
-        tmp = addr;
-        sourceStride = info.stride;
-        format = FPDFBitmap_BGRA;
+JNI_FUNC(jintArray, PdfiumCore, nativeRenderPagesBitmap)(JNI_ARGS, jlong docPtr, jintArray pageIndices,
+                                                         jlongArray pagePtrs, jobjectArray bitmaps,
+                                                         jintArray jobParams, jlong cachePtr,
+                                                         jstring docCacheKey, jint colorMode,
+                                                         jfloatArray colorMatrix){
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    int jobCount = (int) env->GetArrayLength(pageIndices);
+    if (doc == NULL || env->GetArrayLength(pagePtrs) != jobCount
+            || env->GetArrayLength(bitmaps) != jobCount
+            || env->GetArrayLength(jobParams) != jobCount * JOB_PARAM_COUNT) {
+        jniThrowException(env, "java/lang/IllegalArgumentException", "Invalid render jobs");
+        return NULL;
     }
 
-    FPDF_BITMAP pdfBitmap = FPDFBitmap_CreateEx( canvasHorSize, canvasVerSize,
-                                                     format, tmp, sourceStride);
+    std::vector<jint> indices(jobCount);
+    std::vector<jlong> pages(jobCount);
+    std::vector<jint> params(jobCount * JOB_PARAM_COUNT);
+    std::vector<jint> status(jobCount, RENDER_JOB_OK);
+    env->GetIntArrayRegion(pageIndices, 0, jobCount, indices.data());
+    env->GetLongArrayRegion(pagePtrs, 0, jobCount, pages.data());
+    env->GetIntArrayRegion(jobParams, 0, jobCount * JOB_PARAM_COUNT, params.data());
+
+    std::vector<LockedBitmap> locked;
+    locked.reserve(jobCount);
+
+    // Cache and colors shared by all jobs
+    RenderOptions sharedOptions;
+    if (!setColorTransform(env, &sharedOptions, colorMode, colorMatrix)) return NULL;
+    setRenderCache(env, &sharedOptions, cachePtr, docCacheKey);
+
+    for (int i = 0; i < jobCount; i++) {
+        const jint *job = &params[i * JOB_PARAM_COUNT];
+
+        // Java opens missing pages before the call, so they are tracked and closed with the
+        // document; 0 means the page could not be opened
+        if (pages[i] == 0) {
+            status[i] = RENDER_JOB_PAGE_ERROR;
+            continue;
+        }
 
-    /*LOGD("Start X: %d", startX);
-    LOGD("Start Y: %d", startY);
-    LOGD("Canvas Hor: %d", canvasHorSize);
-    LOGD("Canvas Ver: %d", canvasVerSize);
-    LOGD("Draw Hor: %d", drawSizeHor);
-    LOGD("Draw Ver: %d", drawSizeVer);*/
+        jobject bitmap = env->GetObjectArrayElement(bitmaps, i);
+        LockedBitmap *target = bitmap != NULL ? lockJobBitmap(env, locked, bitmap) : NULL;
+        if (target == NULL) {
+            status[i] = RENDER_JOB_BITMAP_ERROR;
+            continue;
+        }
 
-    if(drawSizeHor < canvasHorSize || drawSizeVer < canvasVerSize){
-        FPDFBitmap_FillRect( pdfBitmap, 0, 0, canvasHorSize, canvasVerSize,
-                             0x848484FF); //Gray
-    }
+        int bitmapWidth = (int) target->info.width;
+        int bitmapHeight = (int) target->info.height;
+        int destX = job[JOB_DEST_X];
+        int destY = job[JOB_DEST_Y];
+        int destWidth = job[JOB_DEST_WIDTH] > 0 ? job[JOB_DEST_WIDTH] : bitmapWidth;
+        int destHeight = job[JOB_DEST_HEIGHT] > 0 ? job[JOB_DEST_HEIGHT] : bitmapHeight;
+        if (destX < 0 || destY < 0 || destX + destWidth > bitmapWidth
+                || destY + destHeight > bitmapHeight) {
+            status[i] = RENDER_JOB_INVALID_PARAMS;
+            continue;
+        }
 
-    int baseHorSize = (canvasHorSize < drawSizeHor)? canvasHorSize : (int)drawSizeHor;
-    int baseVerSize = (canvasVerSize < drawSizeVer)? canvasVerSize : (int)drawSizeVer;
-    int baseX = (startX < 0)? 0 : (int)startX;
-    int baseY = (startY < 0)? 0 : (int)startY;
-    int flags = FPDF_REVERSE_BYTE_ORDER;
+        RenderTarget region;
+        region.pixels = (char*) target->addr + destY * target->info.stride
+                        + destX * bytesPerPixel(target->info.format);
+        region.format = target->info.format;
+        region.stride = target->info.stride;
+        region.width = destWidth;
+        region.height = destHeight;
+
+        RenderOptions options = getRenderOptions(job[JOB_FLAGS] & RENDER_JOB_FLAG_ANNOT);
+        options.colors = sharedOptions.colors;
+        if (sharedOptions.cache != NULL) {
+            options.cache = sharedOptions.cache;
+            options.cacheKey = sharedOptions.cacheKey + "#" + std::to_string(indices[i]);
+        }
 
-    if(renderAnnot) {
-    	flags |= FPDF_ANNOT;
+        // Page placement is given in bitmap coordinates, the region starts at (destX, destY)
+        bool pageClosed = false;
+        if (renderPageToTarget(reinterpret_cast<FPDF_PAGE>(pages[i]), region,
+                               job[JOB_START_X] - destX, job[JOB_START_Y] - destY,
+                               job[JOB_DRAW_SIZE_HOR], job[JOB_DRAW_SIZE_VER], options,
+                               &pageClosed)
+                == RENDER_QUALITY_FAILED) {
+            status[i] = pageClosed ? RENDER_JOB_PAGE_ERROR : RENDER_JOB_OUT_OF_MEMORY;
+        }
     }
 
-    FPDFBitmap_FillRect( pdfBitmap, baseX, baseY, baseHorSize, baseVerSize,
-                         0xFFFFFFFF); //White
-
-    FPDF_RenderPageBitmap( pdfBitmap, page,
-                           startX, startY,
-                           (int)drawSizeHor, (int)drawSizeVer,
-                           0, flags );
-
-    if (info.format == ANDROID_BITMAP_FORMAT_RGB_565) {
-        rgbBitmapTo565(tmp, sourceStride, addr, &info);
-        free(tmp);
+    for (LockedBitmap &entry : locked) {
+        if (entry.addr != NULL) {
+            AndroidBitmap_unlockPixels(env, entry.bitmap);
+        }
     }
 
-    AndroidBitmap_unlockPixels(env, bitmap);
+    jintArray result = env->NewIntArray(jobCount);
+    env->SetIntArrayRegion(result, 0, jobCount, status.data());
+    return result;
 }
 
 JNI_FUNC(jstring, PdfiumCore, nativeGetDocumentMetaText)(JNI_ARGS, jlong docPtr, jstring tag) {
@@ -629,13 +3604,19 @@ JNI_FUNC(jstring, PdfiumCore, nativeGetDocumentMetaText)(JNI_ARGS, jlong docPtr,
     }
     DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
 
-    size_t bufferLen = FPDF_GetMetaText(doc->pdfDocument, ctag, NULL, 0);
+    std::wstring text;
+    size_t bufferLen;
+    {
+        PdfiumGuard guard;
+        bufferLen = FPDF_GetMetaText(doc->pdfDocument, ctag, NULL, 0);
+        if (bufferLen > 2) {
+            FPDF_GetMetaText(doc->pdfDocument, ctag, WriteInto(&text, bufferLen + 1), bufferLen);
+        }
+    }
+    env->ReleaseStringUTFChars(tag, ctag);
     if (bufferLen <= 2) {
         return env->NewStringUTF("");
     }
-    std::wstring text;
-    FPDF_GetMetaText(doc->pdfDocument, ctag, WriteInto(&text, bufferLen + 1), bufferLen);
-    env->ReleaseStringUTFChars(tag, ctag);
     return env->NewString((jchar*) text.c_str(), bufferLen / 2 - 1);
 }
 
@@ -651,7 +3632,11 @@ JNI_FUNC(jobject, PdfiumCore, nativeGetFirstChildBookmark)(JNI_ARGS, jlong docPt
         jlong ptr = env->CallLongMethod(bookmarkPtr, longValueMethod);
         parent = reinterpret_cast<FPDF_BOOKMARK>(ptr);
     }
-    FPDF_BOOKMARK bookmark = FPDFBookmark_GetFirstChild(doc->pdfDocument, parent);
+    FPDF_BOOKMARK bookmark;
+    {
+        PdfiumGuard guard;
+        bookmark = FPDFBookmark_GetFirstChild(doc->pdfDocument, parent);
+    }
     if (bookmark == NULL) {
         return NULL;
     }
@@ -661,7 +3646,11 @@ JNI_FUNC(jobject, PdfiumCore, nativeGetFirstChildBookmark)(JNI_ARGS, jlong docPt
 JNI_FUNC(jobject, PdfiumCore, nativeGetSiblingBookmark)(JNI_ARGS, jlong docPtr, jlong bookmarkPtr) {
     DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
     FPDF_BOOKMARK parent = reinterpret_cast<FPDF_BOOKMARK>(bookmarkPtr);
-    FPDF_BOOKMARK bookmark = FPDFBookmark_GetNextSibling(doc->pdfDocument, parent);
+    FPDF_BOOKMARK bookmark;
+    {
+        PdfiumGuard guard;
+        bookmark = FPDFBookmark_GetNextSibling(doc->pdfDocument, parent);
+    }
     if (bookmark == NULL) {
         return NULL;
     }
@@ -670,12 +3659,18 @@ JNI_FUNC(jobject, PdfiumCore, nativeGetSiblingBookmark)(JNI_ARGS, jlong docPtr,
 
 JNI_FUNC(jstring, PdfiumCore, nativeGetBookmarkTitle)(JNI_ARGS, jlong bookmarkPtr) {
     FPDF_BOOKMARK bookmark = reinterpret_cast<FPDF_BOOKMARK>(bookmarkPtr);
-    size_t bufferLen = FPDFBookmark_GetTitle(bookmark, NULL, 0);
+    std::wstring title;
+    size_t bufferLen;
+    {
+        PdfiumGuard guard;
+        bufferLen = FPDFBookmark_GetTitle(bookmark, NULL, 0);
+        if (bufferLen > 2) {
+            FPDFBookmark_GetTitle(bookmark, WriteInto(&title, bufferLen + 1), bufferLen);
+        }
+    }
     if (bufferLen <= 2) {
         return env->NewStringUTF("");
     }
-    std::wstring title;
-    FPDFBookmark_GetTitle(bookmark, WriteInto(&title, bufferLen + 1), bufferLen);
     return env->NewString((jchar*) title.c_str(), bufferLen / 2 - 1);
 }
 
@@ -683,6 +3678,7 @@ JNI_FUNC(jlong, PdfiumCore, nativeGetBookmarkDestIndex)(JNI_ARGS, jlong docPtr,
     DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
     FPDF_BOOKMARK bookmark = reinterpret_cast<FPDF_BOOKMARK>(bookmarkPtr);
 
+    PdfiumGuard guard;
     FPDF_DEST dest = FPDFBookmark_GetDest(doc->pdfDocument, bookmark);
     if (dest == NULL) {
         return -1;
@@ -741,10 +3737,10 @@ bool IsCharacterUnderlined(FPDF_PAGE page, int char_index) {
 
 bool IsCharacterSpace(FPDF_TEXTPAGE text_page, int char_index, PDFLinkHandlerInterface *pdfLinkHandler) {
     // Extract the character at the given index
-    std::string character = (*pdfLinkHandler).ExtractText(text_page, char_index, 1);
+    text::U16View character = (*pdfLinkHandler).ExtractText(text_page, char_index, 1);
 
     // Check if the extracted character is a space
-    return character == " ";
+    return character == text::U16View(u" ");
 }
 
 // Jump is between i and i+1
@@ -767,23 +3763,20 @@ bool IsBoundingBoxSignificantlyDifferent(FPDF_TEXTPAGE text_page, int i, double
     return (diff_left > threshold) || (diff_right > threshold) || (diff_bottom > threshold) || (diff_top > threshold);
 }
 
-void GetRectangleForLinkText(FPDF_PAGE page, const std::string& search_string,  FS_RECTF &rect,
+void GetRectangleForLinkText(FPDF_TEXTPAGE text_page, PDFLinkHandlerInterface *pdfLinkHandler,
+                             const std::string& search_string,  FS_RECTF &rect,
                              int &start_character_index, int &end_character_index,
                              int &new_start_character_index, int &new_end_character_index) {
-    PDFLinkHandlerImpl pdfLinkHandler;
-    FPDF_TEXTPAGE text_page = FPDFText_LoadPage(page);
     int text_length = FPDFText_CountChars(text_page);
     int search_length = search_string.length();
     LOGD("Text length %d", text_length);
     LOGD("Search string %s", search_string.c_str());
-    std::string current_text;
     int i = 0;
-    for (end_character_index + i; (end_character_index + i) <= (text_length - search_string.length()); ++i) {
-         current_text = pdfLinkHandler.ExtractText(text_page, end_character_index + i, search_string.length());
-//        std::string current_text = search_string;
-//        LOGD("Extracted text %s", current_text.c_str());
-//        LOGD("Index for extracted text %d", i);
-        if (current_text == search_string) {
+    for (; (end_character_index + i) <= (text_length - search_length); ++i) {
+        text::U16View current_text = (*pdfLinkHandler).ExtractText(text_page,
+                                                                   end_character_index + i,
+                                                                   search_length);
+        if (current_text.equalsAscii(search_string)) {
             LOGD("Plain text link found");
 
             double left_start;
@@ -811,7 +3804,7 @@ void GetRectangleForLinkText(FPDF_PAGE page, const std::string& search_string,
                     for (int k = end_character_index + i; k < end_character_index + i + j; k++){
                         // If jumping character found, we check for the previous characters for space.
                         // If space found, that will be the link ending character.
-                        if(IsCharacterSpace(text_page, k, &pdfLinkHandler)){
+                        if(IsCharacterSpace(text_page, k, pdfLinkHandler)){
                             LOGD("Space character found at %d. Updating end character index.", k);
                             new_end_character_index = k ;
                             break_outer_cycle = true;
@@ -857,20 +3850,21 @@ void GetRectangleForLinkText(FPDF_PAGE page, const std::string& search_string,
 
             return ;
         }
-        current_text = "";
     }
     LOGD("No more plain text links found");
     new_end_character_index = text_length;
     new_start_character_index = text_length;
 
-    FPDFText_ClosePage(text_page);
     return ; // Return an empty rectangle if the text is not found
 }
 
 JNI_FUNC(jlongArray, PdfiumCore, nativeGetPageLinks)(JNI_ARGS, jlong pagePtr) {
-    PDFLinkHandlerImpl pdfLinkHandler;
     FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
-    FPDF_TEXTPAGE text_page = FPDFText_LoadPage(page);
+    PdfiumGuard guard;
+    PageTextCache *cache = getPageText(page);
+    if (cache == NULL) return env->NewLongArray(0);
+    FPDF_TEXTPAGE text_page = cache->textPage;
+    PDFLinkHandlerImpl pdfLinkHandler(getPageTextContent(cache));
 
     int pos = 0;
     std::vector<jlong> links;
@@ -892,12 +3886,12 @@ JNI_FUNC(jlongArray, PdfiumCore, nativeGetPageLinks)(JNI_ARGS, jlong pagePtr) {
         FS_RECTF rect;
         link_end_character_index = i;
         link_start_character_index = i;
-        GetRectangleForLinkText(page, search_string, rect,
+        GetRectangleForLinkText(text_page, &pdfLinkHandler, search_string, rect,
                                 link_start_character_index, link_end_character_index,
                                 new_link_start_character_index, new_link_end_character_index);
         if(new_link_end_character_index > new_link_start_character_index) {
-            uri = pdfLinkHandler.ExtractText(text_page, new_link_start_character_index,
-                              new_link_end_character_index - new_link_start_character_index + 1);
+            uri = text::toUtf8(pdfLinkHandler.ExtractText(text_page, new_link_start_character_index,
+                              new_link_end_character_index - new_link_start_character_index + 1));
             LOGD("URI %s", uri.c_str());
             FPDF_ANNOTATION annot = FPDFPage_CreateAnnot(page, FPDF_ANNOT_LINK);
             FPDFAnnot_SetRect(annot, &rect);
@@ -927,7 +3921,11 @@ JNI_FUNC(jlongArray, PdfiumCore, nativeGetPageLinks)(JNI_ARGS, jlong pagePtr) {
 JNI_FUNC(jobject, PdfiumCore, nativeGetDestPageIndex)(JNI_ARGS, jlong docPtr, jlong linkPtr) {
     DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
     FPDF_LINK link = reinterpret_cast<FPDF_LINK>(linkPtr);
-    FPDF_DEST dest = FPDFLink_GetDest(doc->pdfDocument, link);
+    FPDF_DEST dest;
+    {
+        PdfiumGuard guard;
+        dest = FPDFLink_GetDest(doc->pdfDocument, link);
+    }
     if (dest == NULL) {
         return NULL;
     }
@@ -938,23 +3936,29 @@ JNI_FUNC(jobject, PdfiumCore, nativeGetDestPageIndex)(JNI_ARGS, jlong docPtr, jl
 JNI_FUNC(jstring, PdfiumCore, nativeGetLinkURI)(JNI_ARGS, jlong docPtr, jlong linkPtr){
     DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
     FPDF_LINK link = reinterpret_cast<FPDF_LINK>(linkPtr);
-    FPDF_ACTION action = FPDFLink_GetAction(link);
-    if (action == NULL) {
-        return NULL;
-    }
-    size_t bufferLen = FPDFAction_GetURIPath(doc->pdfDocument, action, NULL, 0);
-    if (bufferLen <= 0) {
-        return env->NewStringUTF("");
-    }
     std::string uri;
-    FPDFAction_GetURIPath(doc->pdfDocument, action, WriteInto(&uri, bufferLen), bufferLen);
+    {
+        PdfiumGuard guard;
+        FPDF_ACTION action = FPDFLink_GetAction(link);
+        if (action == NULL) {
+            return NULL;
+        }
+        size_t bufferLen = FPDFAction_GetURIPath(doc->pdfDocument, action, NULL, 0);
+        if (bufferLen > 0) {
+            FPDFAction_GetURIPath(doc->pdfDocument, action, WriteInto(&uri, bufferLen), bufferLen);
+        }
+    }
     return env->NewStringUTF(uri.c_str());
 }
 
 JNI_FUNC(jobject, PdfiumCore, nativeGetLinkRect)(JNI_ARGS, jlong linkPtr) {
     FPDF_LINK link = reinterpret_cast<FPDF_LINK>(linkPtr);
     FS_RECTF fsRectF;
-    FPDF_BOOL result = FPDFLink_GetAnnotRect(link, &fsRectF);
+    FPDF_BOOL result;
+    {
+        PdfiumGuard guard;
+        result = FPDFLink_GetAnnotRect(link, &fsRectF);
+    }
 
     if (!result) {
         return NULL;
@@ -965,16 +3969,777 @@ JNI_FUNC(jobject, PdfiumCore, nativeGetLinkRect)(JNI_ARGS, jlong linkPtr) {
     return env->NewObject(clazz, constructorID, fsRectF.left, fsRectF.top, fsRectF.right, fsRectF.bottom);
 }
 
+// Text of the page straight from pdfium's UTF-16 buffer, without a UTF-8 round trip, plus
+// packed line and paragraph breaks if requested. Returns null if the page was closed.
+JNI_FUNC(jobject, PdfiumCore, nativeGetPageText)(JNI_ARGS, jlong pagePtr, jboolean withBreaks) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    std::vector<jchar> text;
+    std::vector<jint> breaks;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) return NULL;
+        PageTextCache *cache = getPageText(page);
+        if (cache == NULL) {
+            LOGE("Cannot load page text");
+            return NULL;
+        }
+        // Copied out, the cached text goes away if the page is closed after the guard
+        const text::PageText &content = getPageTextContent(cache);
+        text.assign(content.text().begin(), content.text().end());
+        if (withBreaks) collectTextBreaks(cache->textPage, content, &breaks);
+    }
+
+    jstring jtext = env->NewString(text.data(), text.size());
+    if (jtext == NULL) return NULL;
+    jintArray jbreaks = NULL;
+    if (withBreaks) {
+        jbreaks = env->NewIntArray(breaks.size());
+        if (jbreaks == NULL) return NULL;
+        env->SetIntArrayRegion(jbreaks, 0, breaks.size(), breaks.data());
+    }
+
+    jclass clazz = env->FindClass("com/shockwave/pdfium/PdfPageText");
+    jmethodID constructorID = env->GetMethodID(clazz, "<init>", "(Ljava/lang/String;[I)V");
+    return env->NewObject(clazz, constructorID, jtext, jbreaks);
+}
+
+// Word count of the page, or -1 if the page was closed
+JNI_FUNC(jint, PdfiumCore, nativeGetWordCount)(JNI_ARGS, jlong pagePtr) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PdfiumGuard guard;
+    if (!isLivePage(page)) return -1;
+    PageTextCache *cache = getPageText(page);
+    if (cache == NULL) return -1;
+    getPageWords(cache);
+    return cache->words.size();
+}
+
+// Word containing the character, or at the position in page coordinates if charIndex is
+// negative. Returns null if there is no word there.
+JNI_FUNC(jobject, PdfiumCore, nativeGetWord)(JNI_ARGS, jlong pagePtr, jint charIndex,
+                                             jdouble pageX, jdouble pageY, jdouble tolerance) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    text::WordSpan word;
+    FS_RECTF box;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) return NULL;
+        PageTextCache *cache = getPageText(page);
+        if (cache == NULL) return NULL;
+        getPageWords(cache);
+        if (charIndex < 0) {
+            charIndex = FPDFText_GetCharIndexAtPos(cache->textPage, pageX, pageY, tolerance,
+                                                   tolerance);
+        }
+        int index = text::findWord(cache->words, charIndex);
+        if (index < 0) return NULL;
+        word = cache->words[index];
+        box = cache->wordBoxes[index];
+    }
+
+    jclass clazz = env->FindClass("com/shockwave/pdfium/PdfWord");
+    jmethodID constructorID = env->GetMethodID(clazz, "<init>", "(IIFFFFZ)V");
+    return env->NewObject(clazz, constructorID, word.start, word.end, box.left, box.top,
+                          box.right, box.bottom, (jboolean) word.joinsNext);
+}
+
+// Selection between two points in page coordinates. out receives the character range
+// [start, end) and then left, top, right, bottom of each merged line rect as far as it fits.
+// Returns the number of rects, or -1 if the page was closed. Nothing is allocated in Java, so
+// this can run on every drag event.
+JNI_FUNC(jint, PdfiumCore, nativeSelectRange)(JNI_ARGS, jlong pagePtr, jdouble x1, jdouble y1,
+                                              jdouble x2, jdouble y2, jdouble tolerance,
+                                              jfloatArray out) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    int start = -1;
+    int end = -1;
+    std::vector<CharBox> rects;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) return -1;
+        PageTextCache *cache = getPageText(page);
+        if (cache == NULL) return -1;
+        int first = FPDFText_GetCharIndexAtPos(cache->textPage, x1, y1, tolerance, tolerance);
+        int last = FPDFText_GetCharIndexAtPos(cache->textPage, x2, y2, tolerance, tolerance);
+        if (first >= 0 && last >= 0) {
+            start = std::min(first, last);
+            end = std::max(first, last) + 1;
+            int count = FPDFText_CountRects(cache->textPage, start, end - start);
+            rects.resize(std::max(count, 0));
+            for (size_t i = 0; i < rects.size(); i++) {
+                CharBox &rect = rects[i];
+                FPDFText_GetRect(cache->textPage, i, &rect.left, &rect.top, &rect.right,
+                                 &rect.bottom);
+            }
+        }
+    }
+    mergeLineRects(&rects);
+
+    jsize capacity = env->GetArrayLength(out);
+    if (capacity < 2) return rects.size();
+    size_t fit = std::min(rects.size(), (size_t) (capacity - 2) / 4);
+    std::vector<jfloat> packed(2 + fit * 4);
+    packed[0] = start;
+    packed[1] = end;
+    for (size_t i = 0; i < fit; i++) {
+        packed[2 + i * 4] = rects[i].left;
+        packed[3 + i * 4] = rects[i].top;
+        packed[4 + i * 4] = rects[i].right;
+        packed[5 + i * 4] = rects[i].bottom;
+    }
+    env->SetFloatArrayRegion(out, 0, packed.size(), packed.data());
+    return rects.size();
+}
+
+// Text of characters [start, end), or null if the page was closed
+JNI_FUNC(jstring, PdfiumCore, nativeGetTextRange)(JNI_ARGS, jlong pagePtr, jint start, jint end) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    std::vector<jchar> text;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) return NULL;
+        PageTextCache *cache = getPageText(page);
+        if (cache == NULL) return NULL;
+        text::U16View range = getPageTextContent(cache).view(start, end - start);
+        text.assign(range.begin(), range.end());
+    }
+    return env->NewString(text.data(), text.size());
+}
+
+// Text inside rects given as left, top, right, bottom in page coordinates, e.g. a lassoed table.
+// Texts of several rects are joined by line breaks. With sortLines the characters inside the
+// rects are regrouped into lines in reading order instead, for content streams that draw cells
+// out of order. Returns null if the page was closed.
+JNI_FUNC(jstring, PdfiumCore, nativeGetTextInRects)(JNI_ARGS, jlong pagePtr, jfloatArray rects,
+                                                    jboolean sortLines) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    std::vector<jfloat> bounds(env->GetArrayLength(rects) / 4 * 4);
+    env->GetFloatArrayRegion(rects, 0, bounds.size(), bounds.data());
+    for (size_t r = 0; r < bounds.size(); r += 4) {
+        if (bounds[r] > bounds[r + 2]) std::swap(bounds[r], bounds[r + 2]);
+        if (bounds[r + 3] > bounds[r + 1]) std::swap(bounds[r + 1], bounds[r + 3]);
+    }
+
+    std::vector<jchar> text;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) return NULL;
+        PageTextCache *cache = getPageText(page);
+        if (cache == NULL) return NULL;
+
+        if (!sortLines) {
+            for (size_t r = 0; r < bounds.size(); r += 4) {
+                int length = FPDFText_GetBoundedText(cache->textPage, bounds[r], bounds[r + 1],
+                                                     bounds[r + 2], bounds[r + 3], NULL, 0);
+                if (length <= 0) continue;
+                if (!text.empty()) text.push_back('\n');
+                size_t offset = text.size();
+                text.resize(offset + length + 1);
+                int written = FPDFText_GetBoundedText(cache->textPage, bounds[r], bounds[r + 1],
+                                                      bounds[r + 2], bounds[r + 3],
+                                                      (unsigned short*) &text[offset], length);
+                text.resize(offset + std::max(std::min(written, length), 0));
+            }
+        } else {
+            const text::PageText &content = getPageTextContent(cache);
+            std::vector<PositionedChar> chars;
+            for (int i = 0; i < content.charCount(); i++) {
+                PositionedChar c;
+                c.codePoint = content.codePointAt(i);
+                if (c.codePoint == 0 || content.classAt(i) == text::CHAR_LINE_BREAK) continue;
+                FPDFText_GetCharBox(cache->textPage, i, &c.box.left, &c.box.right,
+                                    &c.box.bottom, &c.box.top);
+                if (c.box.top - c.box.bottom <= 0) continue;
+                double x = (c.box.left + c.box.right) / 2;
+                double y = (c.box.bottom + c.box.top) / 2;
+                for (size_t r = 0; r < bounds.size(); r += 4) {
+                    if (x >= bounds[r] && x <= bounds[r + 2]
+                            && y <= bounds[r + 1] && y >= bounds[r + 3]) {
+                        chars.push_back(c);
+                        break;
+                    }
+                }
+            }
+            appendSortedLines(&chars, &text);
+        }
+    }
+    return env->NewString(text.data(), text.size());
+}
+
+// Matches of the query in the page text as [start, end) character ranges, folding case and
+// diacritics of both as requested by foldMode. Returns null if the page was closed.
+JNI_FUNC(jintArray, PdfiumCore, nativeSearchPage)(JNI_ARGS, jlong pagePtr, jstring query,
+                                                  jint foldMode) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    std::vector<char16_t> pattern;
+    const jchar *chars = env->GetStringChars(query, NULL);
+    if (chars == NULL) return NULL;
+    text::foldText((const char16_t*) chars, env->GetStringLength(query), foldMode, &pattern);
+    env->ReleaseStringChars(query, chars);
+
+    std::vector<jint> ranges;
+    {
+        PdfiumGuard guard;
+        if (!isLivePage(page)) return NULL;
+        PageTextCache *cache = getPageText(page);
+        if (cache == NULL) return NULL;
+        if (cache->folded.mode() != foldMode) {
+            cache->folded.build(getPageTextContent(cache), foldMode);
+        }
+        cache->folded.findAll(pattern, &ranges);
+    }
+
+    jintArray result = env->NewIntArray(ranges.size());
+    if (result == NULL) return NULL;
+    env->SetIntArrayRegion(result, 0, ranges.size(), ranges.data());
+    return result;
+}
+
 JNI_FUNC(jobject, PdfiumCore, nativePageCoordsToDevice)(JNI_ARGS, jlong pagePtr, jint startX, jint startY, jint sizeX,
                                             jint sizeY, jint rotate, jdouble pageX, jdouble pageY) {
     FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
     int deviceX, deviceY;
 
-    FPDF_PageToDevice(page, startX, startY, sizeX, sizeY, rotate, pageX, pageY, &deviceX, &deviceY);
+    {
+        PdfiumGuard guard;
+        FPDF_PageToDevice(page, startX, startY, sizeX, sizeY, rotate, pageX, pageY, &deviceX,
+                          &deviceY);
+    }
 
     jclass clazz = env->FindClass("android/graphics/Point");
     jmethodID constructorID = env->GetMethodID(clazz, "<init>", "(II)V");
     return env->NewObject(clazz, constructorID, deviceX, deviceY);
 }
 
+JNI_FUNC(jboolean, PdfiumCore, nativeMapPageCoordsToDevice)(JNI_ARGS, jlong pagePtr, jint startX, jint startY,
+                                            jint sizeX, jint sizeY, jint rotate,
+                                            jfloatArray pageCoords, jfloatArray deviceCoords) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PageTransform deviceToPage, pageToDevice;
+    if (!getDeviceToPageTransform(page, startX, startY, sizeX, sizeY, rotate, &deviceToPage)
+            || !invertTransform(deviceToPage, &pageToDevice)) {
+        LOGE("Cannot compute page to device transform");
+        return JNI_FALSE;
+    }
+    return mapCoordsArray(env, pageToDevice, pageCoords, deviceCoords, true);
+}
+
+JNI_FUNC(jboolean, PdfiumCore, nativeMapDeviceCoordsToPage)(JNI_ARGS, jlong pagePtr, jint startX, jint startY,
+                                            jint sizeX, jint sizeY, jint rotate,
+                                            jfloatArray deviceCoords, jfloatArray pageCoords) {
+    FPDF_PAGE page = reinterpret_cast<FPDF_PAGE>(pagePtr);
+    PageTransform deviceToPage;
+    if (!getDeviceToPageTransform(page, startX, startY, sizeX, sizeY, rotate, &deviceToPage)) {
+        LOGE("Cannot compute device to page transform");
+        return JNI_FALSE;
+    }
+    return mapCoordsArray(env, deviceToPage, deviceCoords, pageCoords, false);
+}
+
+JNI_FUNC(jlong, PdfiumCore, nativeStartPrefetcher)(JNI_ARGS, jlong docPtr, jint maxPages,
+                                                   jboolean loadText, jlong memoryBudget) {
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    if (doc == NULL) {
+        jniThrowException(env, "java/lang/IllegalStateException", "Cannot start prefetcher");
+        return 0;
+    }
+    int pageCount;
+    {
+        PdfiumGuard guard;
+        pageCount = FPDF_GetPageCount(doc->pdfDocument);
+    }
+    PagePrefetcher *prefetcher = new PagePrefetcher(doc, pageCount, (int) maxPages,
+                                                    (bool) loadText, (size_t) memoryBudget);
+    return reinterpret_cast<jlong>(prefetcher);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeUpdatePrefetcher)(JNI_ARGS, jlong prefetcherPtr, jint firstVisible,
+                                                   jint lastVisible, jfloat velocity) {
+    PagePrefetcher *prefetcher = reinterpret_cast<PagePrefetcher*>(prefetcherPtr);
+    prefetcher->update(firstVisible, lastVisible, velocity);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeStopPrefetcher)(JNI_ARGS, jlong prefetcherPtr) {
+    delete reinterpret_cast<PagePrefetcher*>(prefetcherPtr);
+}
+
+
+// Throws IllegalArgumentException if the pattern is invalid
+JNI_FUNC(jlong, PdfiumCore, nativeStartRegexSearch)(JNI_ARGS, jlong docPtr, jstring pattern,
+                                                    jint foldMode, jint fromPage, jint toPage,
+                                                    jobject listener) {
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    jclass clazz = env->GetObjectClass(thiz);
+    // Looked up here, class lookups fail on threads attached from native code
+    jmethodID matchesCallback = env->GetMethodID(clazz, "onSearchMatches",
+            "(Lcom/shockwave/pdfium/PdfiumCore$OnSearchListener;I[I[F)V");
+    jmethodID spanningCallback = env->GetMethodID(clazz, "onSearchSpanningMatch",
+            "(Lcom/shockwave/pdfium/PdfiumCore$OnSearchListener;III[F[F)V");
+    jmethodID finishedCallback = env->GetMethodID(clazz, "onSearchFinished",
+            "(Lcom/shockwave/pdfium/PdfiumCore$OnSearchListener;Z)V");
+    if (matchesCallback == NULL || spanningCallback == NULL || finishedCallback == NULL) {
+        return 0;
+    }
+
+    JavaVM *vm;
+    if (env->GetJavaVM(&vm) != JNI_OK) return 0;
+
+    const jchar *chars = env->GetStringChars(pattern, NULL);
+    if (chars == NULL) return 0;
+    std::u16string source((const char16_t*) chars, env->GetStringLength(pattern));
+    env->ReleaseStringChars(pattern, chars);
+
+    std::string error;
+    std::shared_ptr<const re::Regex> regex = getRegex(source, foldMode, &error);
+    if (!regex) {
+        jniThrowException(env, "java/lang/IllegalArgumentException", error.c_str());
+        return 0;
+    }
+
+    int pageCount;
+    {
+        PdfiumGuard guard;
+        pageCount = FPDF_GetPageCount(doc->pdfDocument);
+    }
+    RegexSearch *search = new RegexSearch(vm, env->NewGlobalRef(thiz),
+                                          env->NewGlobalRef(listener), matchesCallback,
+                                          spanningCallback, finishedCallback, doc, regex,
+                                          std::max(fromPage, 0), std::min(toPage, pageCount - 1));
+    return reinterpret_cast<jlong>(search);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeStopSearch)(JNI_ARGS, jlong searchPtr) {
+    reinterpret_cast<RegexSearch*>(searchPtr)->stop(env);
+}
+
+JNI_FUNC(jlong, PdfiumCore, nativeOpenRenderCache)(JNI_ARGS, jstring directory, jlong maxBytes) {
+    const char *cdirectory = env->GetStringUTFChars(directory, NULL);
+    if (cdirectory == NULL) return 0;
+    RenderCache *cache = new RenderCache(cdirectory, (size_t) maxBytes);
+    env->ReleaseStringUTFChars(directory, cdirectory);
+    return reinterpret_cast<jlong>(cache);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeCloseRenderCache)(JNI_ARGS, jlong cachePtr) {
+    delete reinterpret_cast<RenderCache*>(cachePtr);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeClearRenderCache)(JNI_ARGS, jlong cachePtr) {
+    reinterpret_cast<RenderCache*>(cachePtr)->clear();
+}
+
+// Estimated render time in milliseconds of whole pages, -1 for pages which cannot be loaded.
+// Size is either page size scaled by pixelsPerPoint or, if pixelsPerPoint is not positive,
+// width x height pixels for every page.
+JNI_FUNC(jfloatArray, PdfiumCore, nativeEstimateRenderCost)(JNI_ARGS, jlong docPtr,
+                                                            jintArray pageIndices,
+                                                            jfloat pixelsPerPoint,
+                                                            jint width, jint height) {
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    const int count = env->GetArrayLength(pageIndices);
+    std::vector<jint> indices(count);
+    std::vector<jfloat> costs(count, -1.0f);
+    env->GetIntArrayRegion(pageIndices, 0, count, indices.data());
+
+    int pageCount;
+    {
+        PdfiumGuard guard;
+        pageCount = FPDF_GetPageCount(doc->pdfDocument);
+    }
+    for (int i = 0; i < count; i++) {
+        int pageIndex = indices[i];
+        if (pageIndex < 0 || pageIndex >= pageCount) continue;
+
+        // Pages not open are parsed below, so the lock is taken per page and foreground calls
+        // waiting for it get in between pages
+        YieldingPdfiumGuard guard;
+
+        double megapixels = (double) width * height / 1e6;
+        if (pixelsPerPoint > 0) {
+            double pageWidth, pageHeight;
+            if (!FPDF_GetPageSizeByIndex(doc->pdfDocument, pageIndex, &pageWidth,
+                                         &pageHeight)) {
+                continue;
+            }
+            megapixels = pageWidth * pageHeight * pixelsPerPoint * pixelsPerPoint / 1e6;
+        }
+
+        const RenderCostModel::Complexity *complexity =
+                doc->costModel.findComplexity(pageIndex);
+        if (complexity == NULL) {
+            // Counting objects needs parsed content; pages not open are parsed once and closed
+            FPDF_PAGE page = NULL;
+            bool temporary = false;
+            std::map<int, FPDF_PAGE>::iterator opened = doc->openedPages.find(pageIndex);
+            std::map<int, PrefetchedPage>::iterator prefetched =
+                    doc->prefetchedPages.find(pageIndex);
+            if (opened != doc->openedPages.end()) {
+                page = opened->second;
+            } else if (prefetched != doc->prefetchedPages.end()) {
+                page = prefetched->second.page;
+            } else {
+                page = FPDF_LoadPage(doc->pdfDocument, pageIndex);
+                temporary = true;
+            }
+            if (page == NULL) continue;
+            complexity = &doc->costModel.getComplexity(pageIndex, page);
+            if (temporary) FPDF_ClosePage(page);
+        }
+        costs[i] = (jfloat) doc->costModel.estimateMillis(*complexity, megapixels);
+    }
+
+    jfloatArray result = env->NewFloatArray(count);
+    if (result == NULL) return NULL;
+    env->SetFloatArrayRegion(result, 0, count, costs.data());
+    return result;
+}
+
+// Returns {acquisitions, total hold, max hold, total wait, max wait}, times in nanoseconds
+JNI_FUNC(jlongArray, PdfiumCore, nativeGetLockStats)(JNI_ARGS, jboolean reset) {
+    PdfiumLockStats stats = sPdfiumLock.getStats(reset);
+    jlong values[5] = { stats.acquisitions, stats.totalHoldNanos, stats.maxHoldNanos,
+                        stats.totalWaitNanos, stats.maxWaitNanos };
+    jlongArray result = env->NewLongArray(5);
+    if (result == NULL) return NULL;
+    env->SetLongArrayRegion(result, 0, 5, values);
+    return result;
+}
+
+JNI_FUNC(jlong, PdfiumCore, nativeOpenDocumentAsync)(JNI_ARGS, jint fd, jstring password,
+                                                     jobject task) {
+    jclass clazz = env->GetObjectClass(thiz);
+    // Looked up here, class lookups fail on threads attached from native code
+    jmethodID callback = env->GetMethodID(clazz, "onDocumentOpenResult",
+                                          "(Lcom/shockwave/pdfium/PdfOpenTask;JILjava/lang/String;)V");
+    if (callback == NULL) return 0;
+
+    JavaVM *vm;
+    if (env->GetJavaVM(&vm) != JNI_OK) return 0;
+
+    const char *cpassword = NULL;
+    if (password != NULL) {
+        cpassword = env->GetStringUTFChars(password, NULL);
+    }
+    AsyncDocumentOpen *open = new AsyncDocumentOpen(vm, env->NewGlobalRef(thiz), callback,
+                                                    env->NewGlobalRef(task), fd, cpassword);
+    if (cpassword != NULL) {
+        env->ReleaseStringUTFChars(password, cpassword);
+    }
+    open->start();
+    return reinterpret_cast<jlong>(open);
+}
+
+JNI_FUNC(void, PdfiumCore, nativeCancelOpen)(JNI_ARGS, jlong openPtr) {
+    reinterpret_cast<AsyncDocumentOpen*>(openPtr)->cancel();
+}
+
+// Returns {bytes written, duration in nanoseconds}
+JNI_FUNC(jlongArray, PdfiumCore, nativeSaveDocument)(JNI_ARGS, jlong docPtr, jint fd, jint flags,
+                                                     jint fileVersion) {
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    long long start = nowNanos();
+
+    FdWriter writer(fd);
+    FPDF_BOOL saved;
+    {
+        PdfiumGuard guard;
+        saved = fileVersion > 0
+                ? FPDF_SaveWithVersion(doc->pdfDocument, &writer, flags, fileVersion)
+                : FPDF_SaveAsCopy(doc->pdfDocument, &writer, flags);
+    }
+    if (!writer.flush() || writer.getError() != 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException",
+                             "cannot write document: %s", strerror(writer.getError()));
+        return NULL;
+    }
+    if (!saved) {
+        jniThrowException(env, "java/io/IOException", "cannot save document");
+        return NULL;
+    }
+
+    jlong result[2] = { (jlong) writer.getBytesWritten(), (jlong) (nowNanos() - start) };
+    jlongArray array = env->NewLongArray(2);
+    if (array == NULL) return NULL;
+    env->SetLongArrayRegion(array, 0, 2, result);
+    return array;
+}
+
+// Builds output documents from page ranges of open documents and writes each to its fd.
+// Part i appends pages partRanges[i] (null for all pages) of sourcePtrs[partSources[i]] to output
+// partOutputs[i]; parts of one output are applied in array order. Sources are parsed once however
+// many outputs use them. Returns bytes written per output.
+JNI_FUNC(jlongArray, PdfiumCore, nativeAssembleDocuments)(JNI_ARGS, jlongArray sourcePtrs,
+                                                          jintArray outputFds,
+                                                          jintArray partSources,
+                                                          jobjectArray partRanges,
+                                                          jintArray partOutputs) {
+    const int sourceCount = env->GetArrayLength(sourcePtrs);
+    const int outputCount = env->GetArrayLength(outputFds);
+    const int partCount = env->GetArrayLength(partSources);
+    std::vector<jlong> sources(sourceCount);
+    std::vector<jint> fds(outputCount);
+    std::vector<jint> partSource(partCount);
+    std::vector<jint> partOutput(partCount);
+    env->GetLongArrayRegion(sourcePtrs, 0, sourceCount, sources.data());
+    env->GetIntArrayRegion(outputFds, 0, outputCount, fds.data());
+    env->GetIntArrayRegion(partSources, 0, partCount, partSource.data());
+    env->GetIntArrayRegion(partOutputs, 0, partCount, partOutput.data());
+
+    // Validate every range before writing anything
+    std::vector<std::string> ranges(partCount);
+    std::vector<bool> allPages(partCount, false);
+    for (int i = 0; i < partCount; i++) {
+        if (partSource[i] < 0 || partSource[i] >= sourceCount
+                || partOutput[i] < 0 || partOutput[i] >= outputCount) {
+            jniThrowException(env, "java/lang/IllegalArgumentException", "invalid part");
+            return NULL;
+        }
+        jstring spec = (jstring) env->GetObjectArrayElement(partRanges, i);
+        if (spec == NULL) {
+            allPages[i] = true;
+            continue;
+        }
+        DocumentFile *source = reinterpret_cast<DocumentFile*>(sources[partSource[i]]);
+        const char *cspec = env->GetStringUTFChars(spec, NULL);
+        std::vector<PageRange> parsed;
+        int pageCount;
+        {
+            PdfiumGuard guard;
+            pageCount = FPDF_GetPageCount(source->pdfDocument);
+        }
+        bool valid = parsePageRanges(cspec, pageCount, &parsed);
+        if (!valid) {
+            jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                                 "invalid page range: %s", cspec);
+        }
+        env->ReleaseStringUTFChars(spec, cspec);
+        env->DeleteLocalRef(spec);
+        if (!valid) return NULL;
+        ranges[i] = formatPageRanges(parsed);
+    }
+
+    std::vector<jlong> written(outputCount, 0);
+    for (int output = 0; output < outputCount; output++) {
+        PdfiumGuard guard;
+        FPDF_DOCUMENT dest = FPDF_CreateNewDocument();
+        if (dest == NULL) {
+            jniThrowException(env, "java/io/IOException", "cannot create document");
+            return NULL;
+        }
+
+        bool imported = true;
+        bool preferencesCopied = false;
+        for (int i = 0; i < partCount && imported; i++) {
+            if (partOutput[i] != output) continue;
+            FPDF_DOCUMENT source =
+                    reinterpret_cast<DocumentFile*>(sources[partSource[i]])->pdfDocument;
+            imported = FPDF_ImportPages(dest, source, allPages[i] ? NULL : ranges[i].c_str(),
+                                        FPDF_GetPageCount(dest));
+            if (imported && !preferencesCopied) {
+                FPDF_CopyViewerPreferences(dest, source);
+                preferencesCopied = true;
+            }
+        }
+
+        FdWriter writer(fds[output]);
+        bool saved = imported && FPDF_SaveAsCopy(dest, &writer, FPDF_NO_INCREMENTAL)
+                     && writer.flush();
+        FPDF_CloseDocument(dest);
+        if (!saved) {
+            if (writer.getError() != 0) {
+                jniThrowExceptionFmt(env, "java/io/IOException", "cannot write output %d: %s",
+                                     output, strerror(writer.getError()));
+            } else {
+                jniThrowExceptionFmt(env, "java/io/IOException", "cannot assemble output %d",
+                                     output);
+            }
+            return NULL;
+        }
+        written[output] = writer.getBytesWritten();
+    }
+
+    jlongArray result = env->NewLongArray(outputCount);
+    if (result == NULL) return NULL;
+    env->SetLongArrayRegion(result, 0, outputCount, written.data());
+    return result;
+}
+
+// Progress is reported at most this often, and after the last page
+static const long long FLATTEN_PROGRESS_NANOS = 100 * 1000000LL;
+
+// Flattens annotations and form fields of every page into page content and writes the document.
+// Pages are loaded one at a time and closed right after, so memory stays flat for any page count.
+// Pages open in Java must be closed by the caller. Returns number of pages which had something to
+// flatten, or -1 if the listener cancelled; a cancelled document is left partially flattened.
+JNI_FUNC(jint, PdfiumCore, nativeFlattenDocument)(JNI_ARGS, jlong docPtr, jint fd, jint mode,
+                                                  jobject listener) {
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    jmethodID onProgress = NULL;
+    if (listener != NULL) {
+        onProgress = env->GetMethodID(env->GetObjectClass(listener), "onFlattenProgress", "(II)Z");
+        if (onProgress == NULL) return -1;
+    }
+
+    int pageCount;
+    {
+        PdfiumGuard guard;
+        while (!doc->prefetchedPages.empty()) {
+            doc->releasePrefetchedPage(doc->prefetchedPages.begin()->first);
+        }
+        pageCount = FPDF_GetPageCount(doc->pdfDocument);
+    }
+    int flattened = 0;
+    long long lastProgress = nowNanos();
+    for (int i = 0; i < pageCount; i++) {
+        // Lock is taken per page, so renders of other documents interleave with a long flatten
+        int result = FLATTEN_FAIL;
+        FPDF_PAGE page;
+        {
+            PdfiumGuard guard;
+            page = FPDF_LoadPage(doc->pdfDocument, i);
+            if (page != NULL) {
+                result = FPDFPage_Flatten(page, mode);
+                FPDF_ClosePage(page);
+            }
+        }
+        if (page == NULL) {
+            jniThrowExceptionFmt(env, "java/io/IOException", "cannot load page %d", i);
+            return -1;
+        }
+        if (result == FLATTEN_FAIL) {
+            jniThrowExceptionFmt(env, "java/io/IOException", "cannot flatten page %d", i);
+            return -1;
+        }
+        if (result == FLATTEN_SUCCESS) flattened++;
+
+        long long now = nowNanos();
+        if (onProgress != NULL
+                && (now - lastProgress >= FLATTEN_PROGRESS_NANOS || i == pageCount - 1)) {
+            lastProgress = now;
+            jboolean proceed = env->CallBooleanMethod(listener, onProgress, i + 1, pageCount);
+            if (env->ExceptionCheck()) return -1;
+            if (!proceed) return -1;
+        }
+    }
+
+    FdWriter writer(fd);
+    bool saved;
+    {
+        PdfiumGuard guard;
+        saved = FPDF_SaveAsCopy(doc->pdfDocument, &writer, FPDF_NO_INCREMENTAL);
+    }
+    if (!saved || !writer.flush()) {
+        if (writer.getError() != 0) {
+            jniThrowExceptionFmt(env, "java/io/IOException", "cannot write document: %s",
+                                 strerror(writer.getError()));
+        } else {
+            jniThrowException(env, "java/io/IOException", "cannot save document");
+        }
+        return -1;
+    }
+    return flattened;
+}
+
+// Must match PdfiumCore.DUMP_TEXT_*
+static const int DUMP_TEXT_UTF8 = 0;
+static const int DUMP_TEXT_UTF16LE = 1;
+
+// Writes the text of every page to fd, each page followed by a form feed. With boxesFd >= 0, also
+// writes per page an int32 page index and character count, then left, top, right and bottom as
+// float32 for each character of the page text, in text order. Pages are loaded and closed one at
+// a time and output goes through fixed-size buffers, so memory stays flat for any page count.
+// A page which cannot be loaded is written empty. Returns bytes written to fd.
+JNI_FUNC(jlong, PdfiumCore, nativeDumpText)(JNI_ARGS, jlong docPtr, jint fd, jint format,
+                                           jint boxesFd) {
+    DocumentFile *doc = reinterpret_cast<DocumentFile*>(docPtr);
+    if (format != DUMP_TEXT_UTF8 && format != DUMP_TEXT_UTF16LE) {
+        jniThrowException(env, "java/lang/IllegalArgumentException", "Unknown text format");
+        return -1;
+    }
+
+    int pageCount;
+    {
+        PdfiumGuard guard;
+        pageCount = FPDF_GetPageCount(doc->pdfDocument);
+    }
+
+    FdWriter writer(fd);
+    std::unique_ptr<FdWriter> boxesWriter(boxesFd >= 0 ? new FdWriter(boxesFd) : NULL);
+    std::vector<uint32_t> codePoints;
+    std::vector<float> boxes;
+    text::PageText content;
+    for (int i = 0; i < pageCount; i++) {
+        codePoints.clear();
+        boxes.clear();
+        bool loaded = false;
+        {
+            // Lock is taken per page, so other pdfium calls interleave with a long dump
+            PdfiumGuard guard;
+            FPDF_PAGE page = FPDF_LoadPage(doc->pdfDocument, i);
+            FPDF_TEXTPAGE textPage = page != NULL ? FPDFText_LoadPage(page) : NULL;
+            if (textPage != NULL) {
+                loaded = true;
+                int count = FPDFText_CountChars(textPage);
+                for (int c = 0; c < count; c++) {
+                    unsigned int codePoint = FPDFText_GetUnicode(textPage, c);
+                    codePoints.push_back(codePoint);
+                    if (boxesWriter == NULL || codePoint == 0) continue;
+                    double left = 0, right = 0, bottom = 0, top = 0;
+                    FPDFText_GetCharBox(textPage, c, &left, &right, &bottom, &top);
+                    boxes.push_back((float) left);
+                    boxes.push_back((float) top);
+                    boxes.push_back((float) right);
+                    boxes.push_back((float) bottom);
+                }
+                FPDFText_ClosePage(textPage);
+            }
+            if (page != NULL) FPDF_ClosePage(page);
+        }
+        // An indexing job wants the rest of the document, so the page is dumped empty
+        if (!loaded) LOGE("Cannot load page %d, dumping it empty", i);
+
+        // Characters without unicode are left out, like in FPDFText_GetText
+        content.assign(codePoints.data(), codePoints.size());
+        text::U16View pageText = content.text();
+        bool written;
+        if (format == DUMP_TEXT_UTF8) {
+            std::string utf8 = text::toUtf8(pageText);
+            written = writer.write(utf8.data(), utf8.size()) && writer.write("\f", 1);
+        } else {
+            // Android ABIs are little-endian, so UTF-16 units are written as they are
+            const char16_t pageBreak = u'\f';
+            written = writer.write(pageText.data(), pageText.size() * sizeof(char16_t))
+                      && writer.write(&pageBreak, sizeof(pageBreak));
+        }
+        if (written && boxesWriter != NULL) {
+            int32_t header[2] = { i, (int32_t) (boxes.size() / 4) };
+            written = boxesWriter->write(header, sizeof(header))
+                      && boxesWriter->write(boxes.data(), boxes.size() * sizeof(float));
+        }
+        if (!written) break;
+    }
+
+    FdWriter *failed = !writer.flush() ? &writer
+                       : boxesWriter != NULL && !boxesWriter->flush() ? boxesWriter.get() : NULL;
+    if (failed != NULL) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "cannot write text: %s",
+                             strerror(failed->getError()));
+        return -1;
+    }
+    return writer.getBytesWritten();
+}
+
+JNI_FUNC(jstring, PdfiumCore, nativeGetFingerprint)(JNI_ARGS, jint fd, jboolean fullHash) {
+    uint64_t fingerprint;
+    if (!computeFingerprint(fd, fullHash, &fingerprint)) {
+        jniThrowExceptionFmt(env, "java/io/IOException",
+                             "cannot read document: %s", strerror(errno));
+        return NULL;
+    }
+    char text[24];
+    snprintf(text, sizeof(text), "%c%016llx", fullHash ? 'f' : 's',
+             (unsigned long long) fingerprint);
+    return env->NewStringUTF(text);
+}
+
 }//extern C
@@ -0,0 +1,264 @@
+#ifndef _PAGETEXT_HPP_
+#define _PAGETEXT_HPP_
+
+// UTF-16 text of a page fetched once, with non-owning views and per-character lookups, so text
+// scanning code does not allocate per character.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace text {
+
+// Non-owning view of UTF-16 text, like std::u16string_view
+class U16View {
+  public:
+    U16View() : ptr(NULL), length(0) {}
+    U16View(const char16_t *data, size_t length) : ptr(data), length(length) {}
+    // Null-terminated literal, e.g. u" "
+    U16View(const char16_t *str) : ptr(str), length(0) {
+        while (str[length] != 0) length++;
+    }
+
+    const char16_t *data() const { return ptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    char16_t operator[](size_t index) const { return ptr[index]; }
+    const char16_t *begin() const { return ptr; }
+    const char16_t *end() const { return ptr + length; }
+
+    // Clamped to the view like std::u16string_view::substr, without throwing
+    U16View substr(size_t pos, size_t count) const {
+        if (pos > length) pos = length;
+        if (count > length - pos) count = length - pos;
+        return U16View(ptr + pos, count);
+    }
+
+    bool operator==(const U16View &other) const {
+        return length == other.length
+               && (length == 0 || memcmp(ptr, other.ptr, length * sizeof(char16_t)) == 0);
+    }
+
+    bool operator!=(const U16View &other) const { return !(*this == other); }
+
+    bool equalsAscii(const char *ascii, size_t asciiLength) const {
+        if (asciiLength != length) return false;
+        for (size_t i = 0; i < length; i++) {
+            if (ptr[i] != (unsigned char) ascii[i]) return false;
+        }
+        return true;
+    }
+
+    bool equalsAscii(const std::string &ascii) const {
+        return equalsAscii(ascii.data(), ascii.size());
+    }
+
+  private:
+    const char16_t *ptr;
+    size_t length;
+};
+
+enum CharClass {
+    CHAR_OTHER,
+    CHAR_SPACE,
+    CHAR_LINE_BREAK,
+    CHAR_LETTER,
+    CHAR_DIGIT,
+    CHAR_PUNCTUATION
+};
+
+// ASCII is classified exactly; other code points are letters unless they are Unicode spaces or
+// separators, which is what word and link scanning needs
+inline CharClass classify(uint32_t codePoint) {
+    if (codePoint == '\r' || codePoint == '\n' || codePoint == 0x2028 || codePoint == 0x2029) {
+        return CHAR_LINE_BREAK;
+    }
+    if (codePoint == ' ' || codePoint == '\t' || codePoint == 0xA0 || codePoint == 0x3000
+            || (codePoint >= 0x2000 && codePoint <= 0x200A)) {
+        return CHAR_SPACE;
+    }
+    if (codePoint >= '0' && codePoint <= '9') return CHAR_DIGIT;
+    if ((codePoint >= 'a' && codePoint <= 'z') || (codePoint >= 'A' && codePoint <= 'Z')) {
+        return CHAR_LETTER;
+    }
+    if (codePoint < 0x20 || codePoint == 0x7F || codePoint == 0) return CHAR_OTHER;
+    if (codePoint < 0x80) return CHAR_PUNCTUATION;
+    return CHAR_LETTER;
+}
+
+// Text of one page indexed by pdfium character index. Characters without unicode (code point 0)
+// take no text, like in FPDFText_GetText.
+class PageText {
+  public:
+    void assign(const uint32_t *codePoints, size_t count) {
+        units.clear();
+        units.reserve(count);
+        offsets.resize(count + 1);
+        points.assign(codePoints, codePoints + count);
+        classes.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            uint32_t codePoint = codePoints[i];
+            offsets[i] = (uint32_t) units.size();
+            classes[i] = (uint8_t) classify(codePoint);
+            if (codePoint == 0) continue;
+            if (codePoint > 0xFFFF) {
+                codePoint -= 0x10000;
+                units.push_back((char16_t) (0xD800 | (codePoint >> 10)));
+                units.push_back((char16_t) (0xDC00 | (codePoint & 0x3FF)));
+            } else {
+                units.push_back((char16_t) codePoint);
+            }
+        }
+        offsets[count] = (uint32_t) units.size();
+    }
+
+    int charCount() const { return (int) points.size(); }
+
+    U16View text() const { return U16View(units.data(), units.size()); }
+
+    // Text of characters [start, start + count), clamped to the page
+    U16View view(int start, int count) const {
+        int total = charCount();
+        if (start < 0) start = 0;
+        if (start > total) start = total;
+        if (count < 0) count = 0;
+        if (count > total - start) count = total - start;
+        return U16View(units.data() + offsets[start], offsets[start + count] - offsets[start]);
+    }
+
+    uint32_t codePointAt(int index) const {
+        return index >= 0 && index < charCount() ? points[index] : 0;
+    }
+
+    CharClass classAt(int index) const {
+        return index >= 0 && index < charCount() ? (CharClass) classes[index] : CHAR_OTHER;
+    }
+
+    // UTF-16 offset of the character in text()
+    size_t offsetOf(int index) const { return offsets[index]; }
+
+  private:
+    std::vector<char16_t> units;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> points;
+    std::vector<uint8_t> classes;
+};
+
+// Characters [start, end) of one word. joinsNext marks a word hyphenated at the end of a line,
+// which continues in the next word.
+struct WordSpan {
+    int start;
+    int end;
+    bool joinsNext;
+};
+
+inline bool isWordClass(CharClass charClass) {
+    return charClass == CHAR_LETTER || charClass == CHAR_DIGIT;
+}
+
+inline bool isHyphen(uint32_t codePoint) {
+    return codePoint == '-' || codePoint == 0xAD || codePoint == 0x2010;
+}
+
+// Apostrophes and hyphens between word characters stay inside the word, e.g. "don't", "e-mail"
+inline bool isWordJoiner(uint32_t codePoint) {
+    return codePoint == '\'' || codePoint == 0x2019 || isHyphen(codePoint);
+}
+
+// Splits the page into words in one pass, in character order
+inline void findWords(const PageText &content, std::vector<WordSpan> *words) {
+    int count = content.charCount();
+    int i = 0;
+    while (i < count) {
+        if (!isWordClass(content.classAt(i))) {
+            i++;
+            continue;
+        }
+        WordSpan word;
+        word.start = i;
+        word.joinsNext = false;
+        while (i < count) {
+            if (isWordClass(content.classAt(i))) {
+                i++;
+            } else if (isWordJoiner(content.codePointAt(i)) && isWordClass(content.classAt(i + 1))) {
+                i++;
+            } else {
+                break;
+            }
+        }
+        word.end = i;
+
+        // A trailing hyphen before a line break, with the next word on the following line
+        if (i < count && isHyphen(content.codePointAt(i))) {
+            int next = i + 1;
+            while (content.classAt(next) == CHAR_SPACE) next++;
+            if (content.classAt(next) == CHAR_LINE_BREAK) {
+                while (content.classAt(next) == CHAR_SPACE
+                       || content.classAt(next) == CHAR_LINE_BREAK) {
+                    next++;
+                }
+                if (isWordClass(content.classAt(next))) {
+                    word.end = i + 1;
+                    word.joinsNext = true;
+                    i = next;
+                }
+            }
+        }
+        words->push_back(word);
+    }
+}
+
+// Index of the word containing the character, or -1. Words must be sorted, as from findWords.
+inline int findWord(const std::vector<WordSpan> &words, int charIndex) {
+    size_t low = 0;
+    size_t high = words.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (words[mid].start <= charIndex) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || charIndex >= words[low - 1].end) return -1;
+    return (int) low - 1;
+}
+
+// Unpaired surrogates become U+FFFD
+inline std::string toUtf8(U16View text) {
+    std::string utf8;
+    utf8.reserve(text.size() * 3);
+    for (size_t i = 0; i < text.size(); i++) {
+        uint32_t codePoint = text[i];
+        if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
+            if (codePoint <= 0xDBFF && i + 1 < text.size()
+                    && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF) {
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (text[++i] - 0xDC00);
+            } else {
+                codePoint = 0xFFFD;
+            }
+        }
+        if (codePoint <= 0x7F) {
+            utf8.push_back((char) codePoint);
+        } else if (codePoint <= 0x7FF) {
+            utf8.push_back((char) (0xC0 | (codePoint >> 6)));
+            utf8.push_back((char) (0x80 | (codePoint & 0x3F)));
+        } else if (codePoint <= 0xFFFF) {
+            utf8.push_back((char) (0xE0 | (codePoint >> 12)));
+            utf8.push_back((char) (0x80 | ((codePoint >> 6) & 0x3F)));
+            utf8.push_back((char) (0x80 | (codePoint & 0x3F)));
+        } else {
+            utf8.push_back((char) (0xF0 | (codePoint >> 18)));
+            utf8.push_back((char) (0x80 | ((codePoint >> 12) & 0x3F)));
+            utf8.push_back((char) (0x80 | ((codePoint >> 6) & 0x3F)));
+            utf8.push_back((char) (0x80 | (codePoint & 0x3F)));
+        }
+    }
+    return utf8;
+}
+
+} // namespace text
+
+#endif //_PAGETEXT_HPP_
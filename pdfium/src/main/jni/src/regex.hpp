@@ -0,0 +1,794 @@
+#ifndef _REGEX_HPP_
+#define _REGEX_HPP_
+
+// Regular expressions over page text, matched by a Pike VM: every input character is looked at
+// once per program instruction at most, so matching is linear in the text and patterns cannot
+// backtrack catastrophically. Leftmost match, alternatives and quantifiers prefer like in Java
+// (greedy unless followed by '?'). Matches are at most MAX_MATCH_LENGTH characters long, so
+// finding all matches of a page stays linear too: each search scans that far past its start.
+//
+// Syntax: literals, '.', [...] classes with ranges and negation, \d \D \w \W \s \S, \b \B,
+// ^ $ (start and end of a line), groups (...) and (?:...), '|', and * + ? {n} {n,} {n,m},
+// each optionally lazy. Escapes \t \n \r \f \xHH \uHHHH and escaped punctuation.
+// No backreferences or lookaround, they cannot be matched in linear time.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include "pagetext.hpp"
+#include "casefold.hpp"
+
+namespace re {
+
+static const int MAX_REPEAT = 1000;
+static const size_t MAX_PROGRAM_SIZE = 20000;
+// Groups and quantifiers nested in each other; parsing and code generation recurse per level
+static const int MAX_NESTING = 200;
+static const size_t MAX_MATCH_LENGTH = 500;
+
+// Predicates of \d \w \s and their negations, usable inside and outside of brackets
+static const int CLASS_DIGIT = 1;
+static const int CLASS_WORD = 2;
+static const int CLASS_SPACE = 4;
+static const int CLASS_NOT_DIGIT = 8;
+static const int CLASS_NOT_WORD = 16;
+static const int CLASS_NOT_SPACE = 32;
+
+inline bool isDigitChar(uint32_t c) {
+    return text::classify(c) == text::CHAR_DIGIT;
+}
+
+inline bool isWordChar(uint32_t c) {
+    return c == '_' || text::isWordClass(text::classify(c));
+}
+
+inline bool isSpaceChar(uint32_t c) {
+    text::CharClass charClass = text::classify(c);
+    return charClass == text::CHAR_SPACE || charClass == text::CHAR_LINE_BREAK;
+}
+
+inline bool isLineBreak(uint32_t c) {
+    return text::classify(c) == text::CHAR_LINE_BREAK;
+}
+
+struct ClassSet {
+    std::vector<std::pair<uint32_t, uint32_t> > ranges;
+    int predicates = 0;
+    bool negated = false;
+
+    bool contains(uint32_t c) const {
+        return matchesRanges(c) != negated;
+    }
+
+    // Sorts and merges ranges for the binary search in contains
+    void finish() {
+        std::sort(ranges.begin(), ranges.end());
+        size_t merged = 0;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (merged > 0 && ranges[i].first <= ranges[merged - 1].second + 1) {
+                ranges[merged - 1].second = std::max(ranges[merged - 1].second, ranges[i].second);
+            } else {
+                ranges[merged++] = ranges[i];
+            }
+        }
+        ranges.resize(merged);
+    }
+
+  private:
+    bool matchesRanges(uint32_t c) const {
+        if ((predicates & CLASS_DIGIT) && isDigitChar(c)) return true;
+        if ((predicates & CLASS_WORD) && isWordChar(c)) return true;
+        if ((predicates & CLASS_SPACE) && isSpaceChar(c)) return true;
+        if ((predicates & CLASS_NOT_DIGIT) && !isDigitChar(c)) return true;
+        if ((predicates & CLASS_NOT_WORD) && !isWordChar(c)) return true;
+        if ((predicates & CLASS_NOT_SPACE) && !isSpaceChar(c)) return true;
+        size_t low = 0;
+        size_t high = ranges.size();
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (ranges[mid].second < c) {
+                low = mid + 1;
+            } else if (ranges[mid].first > c) {
+                high = mid;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Input for matching: page characters folded like the pattern, one code point per entry, with
+// the page character index of each. Characters without unicode are left out, like in
+// FPDFText_GetText.
+inline void buildInput(const text::PageText &content, int foldMode, std::vector<uint32_t> *input,
+                       std::vector<int> *charIndex) {
+    char16_t folded[text::MAX_FOLDED_UNITS];
+    for (int i = 0; i < content.charCount(); i++) {
+        uint32_t c = content.codePointAt(i);
+        if (c == 0) continue;
+        if (c > 0xFFFF || foldMode == 0) {
+            input->push_back(c);
+            charIndex->push_back(i);
+            continue;
+        }
+        int count = text::foldChar(c, foldMode, folded);
+        for (int u = 0; u < count; u++) {
+            input->push_back(folded[u]);
+            charIndex->push_back(i);
+        }
+    }
+}
+
+class Regex {
+  public:
+    Regex() : foldMode(0) {}
+
+    // Returns false with a message if the pattern is invalid. foldMode takes text::FOLD_* flags
+    // and must be the mode the input is built with.
+    bool compile(const char16_t *pattern, size_t length, int foldMode, std::string *error) {
+        this->foldMode = foldMode;
+        nodes.clear();
+        classes.clear();
+        program.clear();
+
+        source.clear();
+        for (size_t i = 0; i < length; i++) {
+            uint32_t c = pattern[i];
+            if (c >= 0xD800 && c <= 0xDBFF && i + 1 < length
+                    && pattern[i + 1] >= 0xDC00 && pattern[i + 1] <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (pattern[++i] - 0xDC00);
+            }
+            source.push_back(c);
+        }
+        position = 0;
+        depth = 0;
+        errorMessage.clear();
+
+        int root = parseAlternation();
+        if (root >= 0 && position < source.size()) fail("Unmatched )");
+        if (errorMessage.empty()) {
+            emit(root);
+            if (program.size() > MAX_PROGRAM_SIZE) fail("Pattern is too large");
+        }
+        if (!errorMessage.empty()) {
+            if (error != NULL) *error = errorMessage;
+            program.clear();
+            return false;
+        }
+        addInst(OP_MATCH, 0, 0, 0);
+        nodes.clear();
+        source.clear();
+        return true;
+    }
+
+    int getFoldMode() const { return foldMode; }
+
+  private:
+    enum NodeType {
+        NODE_EMPTY,
+        NODE_CHAR,
+        NODE_ANY,
+        NODE_CLASS,
+        NODE_CONCAT,
+        NODE_ALTERNATE,
+        NODE_REPEAT,
+        NODE_LINE_START,
+        NODE_LINE_END,
+        NODE_WORD_BOUNDARY,
+        NODE_NOT_WORD_BOUNDARY
+    };
+
+    struct Node {
+        NodeType type;
+        uint32_t c;
+        int min;
+        int max; // -1 for unbounded
+        bool greedy;
+        std::vector<int> children;
+    };
+
+    enum Opcode {
+        OP_CHAR,
+        OP_ANY,
+        OP_CLASS,
+        OP_SPLIT,
+        OP_JUMP,
+        OP_LINE_START,
+        OP_LINE_END,
+        OP_WORD_BOUNDARY,
+        OP_NOT_WORD_BOUNDARY,
+        OP_MATCH
+    };
+
+    // SPLIT prefers x over y, JUMP goes to x, CLASS matches classes[x]
+    struct Inst {
+        Opcode op;
+        uint32_t c;
+        int x;
+        int y;
+    };
+
+    struct Thread {
+        int pc;
+        size_t start;
+    };
+
+    // Threads in priority order, each instruction at most once per input position
+    struct ThreadList {
+        std::vector<Thread> threads;
+        std::vector<uint32_t> marks;
+        uint32_t generation;
+        // Scratch space of addThread
+        std::vector<int> stack;
+
+        explicit ThreadList(size_t size) : marks(size, 0), generation(1) {}
+
+        void clear() {
+            threads.clear();
+            generation++;
+        }
+
+        bool visit(int pc) {
+            if (marks[pc] == generation) return false;
+            marks[pc] = generation;
+            return true;
+        }
+    };
+
+    int foldMode;
+    std::vector<ClassSet> classes;
+    std::vector<Inst> program;
+
+    // Parser state, released after compiling
+    std::vector<Node> nodes;
+    std::vector<uint32_t> source;
+    size_t position;
+    std::string errorMessage;
+    int depth;
+
+    friend class Matcher;
+
+    // Leftmost match starting at or after from, as [start, end) input positions
+    bool find(const uint32_t *input, size_t length, size_t from, ThreadList *current,
+              ThreadList *next, size_t *matchStart, size_t *matchEnd, size_t *steps) const {
+        if (program.empty()) return false;
+        current->clear();
+        next->clear();
+        bool matched = false;
+
+        for (size_t pos = from; ; pos++) {
+            // New starts go last, so threads that started earlier keep priority
+            if (!matched) addThread(current, 0, pos, input, length, pos);
+            if (current->threads.empty() && (matched || pos >= length)) break;
+
+            *steps += current->threads.size();
+            for (size_t t = 0; t < current->threads.size(); t++) {
+                const Thread &thread = current->threads[t];
+                const Inst &inst = program[thread.pc];
+                bool advance = false;
+                switch (inst.op) {
+                    case OP_MATCH:
+                        matched = true;
+                        *matchStart = thread.start;
+                        *matchEnd = pos;
+                        // Lower priority threads cannot win any more
+                        current->threads.resize(t + 1);
+                        break;
+                    case OP_CHAR:
+                        advance = pos < length && input[pos] == inst.c;
+                        break;
+                    case OP_ANY:
+                        advance = pos < length && !isLineBreak(input[pos]);
+                        break;
+                    case OP_CLASS:
+                        advance = pos < length && classes[inst.x].contains(input[pos]);
+                        break;
+                    default:
+                        break;
+                }
+                if (advance && pos - thread.start < MAX_MATCH_LENGTH) {
+                    addThread(next, thread.pc + 1, thread.start, input, length, pos + 1);
+                }
+            }
+            if (pos >= length) break;
+            std::swap(*current, *next);
+            next->clear();
+        }
+        return matched;
+    }
+
+    // Follows jumps and assertions from pc, adding consuming instructions and matches
+    void addThread(ThreadList *list, int pc, size_t start, const uint32_t *input, size_t length,
+                   size_t pos) const {
+        std::vector<int> &stack = list->stack;
+        stack.assign(1, pc);
+        while (!stack.empty()) {
+            pc = stack.back();
+            stack.pop_back();
+            if (!list->visit(pc)) continue;
+            const Inst &inst = program[pc];
+            switch (inst.op) {
+                case OP_JUMP:
+                    stack.push_back(inst.x);
+                    break;
+                case OP_SPLIT:
+                    stack.push_back(inst.y);
+                    stack.push_back(inst.x);
+                    break;
+                case OP_LINE_START:
+                    if (pos == 0 || isLineBreak(input[pos - 1])) stack.push_back(pc + 1);
+                    break;
+                case OP_LINE_END:
+                    if (pos == length || isLineBreak(input[pos])) stack.push_back(pc + 1);
+                    break;
+                case OP_WORD_BOUNDARY:
+                case OP_NOT_WORD_BOUNDARY: {
+                    bool before = pos > 0 && isWordChar(input[pos - 1]);
+                    bool after = pos < length && isWordChar(input[pos]);
+                    if ((before != after) == (inst.op == OP_WORD_BOUNDARY)) {
+                        stack.push_back(pc + 1);
+                    }
+                    break;
+                }
+                default: {
+                    Thread thread;
+                    thread.pc = pc;
+                    thread.start = start;
+                    list->threads.push_back(thread);
+                    break;
+                }
+            }
+        }
+    }
+
+    void fail(const char *message) {
+        if (!errorMessage.empty()) return;
+        char index[32];
+        snprintf(index, sizeof(index), " near index %d", (int) position);
+        errorMessage = message;
+        errorMessage += index;
+    }
+
+    bool atEnd() const { return position >= source.size(); }
+
+    uint32_t peek() const { return atEnd() ? 0 : source[position]; }
+
+    int addNode(NodeType type) {
+        Node node;
+        node.type = type;
+        node.c = 0;
+        node.min = 0;
+        node.max = 0;
+        node.greedy = true;
+        nodes.push_back(node);
+        return (int) nodes.size() - 1;
+    }
+
+    int parseAlternation() {
+        int first = parseConcatenation();
+        if (atEnd() || peek() != '|') return first;
+        int alternate = addNode(NODE_ALTERNATE);
+        nodes[alternate].children.push_back(first);
+        while (!atEnd() && peek() == '|') {
+            position++;
+            int next = parseConcatenation();
+            nodes[alternate].children.push_back(next);
+        }
+        return alternate;
+    }
+
+    int parseConcatenation() {
+        int concat = addNode(NODE_CONCAT);
+        while (!atEnd() && peek() != '|' && peek() != ')' && errorMessage.empty()) {
+            int atom = parseRepeat();
+            if (atom < 0) break;
+            nodes[concat].children.push_back(atom);
+        }
+        return concat;
+    }
+
+    // Reads digits of a {n,m} bound, returns -1 if there are none
+    int parseNumber() {
+        int value = -1;
+        while (!atEnd() && peek() >= '0' && peek() <= '9') {
+            value = std::min((value < 0 ? 0 : value) * 10 + (int) (peek() - '0'),
+                             MAX_REPEAT + 1);
+            position++;
+        }
+        return value;
+    }
+
+    int parseRepeat() {
+        int atom = parseAtom();
+        int outerDepth = depth;
+        while (atom >= 0 && !atEnd() && errorMessage.empty()) {
+            int min, max;
+            uint32_t c = peek();
+            if (c == '*') {
+                min = 0;
+                max = -1;
+                position++;
+            } else if (c == '+') {
+                min = 1;
+                max = -1;
+                position++;
+            } else if (c == '?') {
+                min = 0;
+                max = 1;
+                position++;
+            } else if (c == '{') {
+                size_t start = position++;
+                min = parseNumber();
+                max = min;
+                if (!atEnd() && peek() == ',') {
+                    position++;
+                    max = parseNumber();
+                }
+                if (min < 0 || atEnd() || peek() != '}') {
+                    // Not a quantifier, '{' is a literal like in most engines
+                    position = start;
+                    break;
+                }
+                position++;
+                if (min > MAX_REPEAT || max > MAX_REPEAT) {
+                    fail("Repetition count is too large");
+                    return -1;
+                }
+                if (max >= 0 && max < min) {
+                    fail("Invalid repetition range");
+                    return -1;
+                }
+            } else {
+                break;
+            }
+            NodeType type = nodes[atom].type;
+            if (type == NODE_LINE_START || type == NODE_LINE_END || type == NODE_WORD_BOUNDARY
+                    || type == NODE_NOT_WORD_BOUNDARY) {
+                fail("Nothing to repeat");
+                return -1;
+            }
+            if (++depth > MAX_NESTING) {
+                fail("Pattern too deeply nested");
+                return -1;
+            }
+            int repeat = addNode(NODE_REPEAT);
+            nodes[repeat].min = min;
+            nodes[repeat].max = max;
+            if (!atEnd() && peek() == '?') {
+                nodes[repeat].greedy = false;
+                position++;
+            }
+            nodes[repeat].children.push_back(atom);
+            atom = repeat;
+        }
+        depth = outerDepth;
+        return atom;
+    }
+
+    // Literal folded like the input; folding may drop it or expand it to two characters
+    int addLiteral(uint32_t c) {
+        char16_t folded[text::MAX_FOLDED_UNITS];
+        int count = 1;
+        folded[0] = (char16_t) c;
+        if (c <= 0xFFFF && foldMode != 0) count = text::foldChar(c, foldMode, folded);
+        if (count == 1) {
+            int node = addNode(NODE_CHAR);
+            nodes[node].c = c <= 0xFFFF ? folded[0] : c;
+            return node;
+        }
+        int concat = addNode(NODE_CONCAT);
+        for (int i = 0; i < count; i++) {
+            int node = addNode(NODE_CHAR);
+            nodes[node].c = folded[i];
+            nodes[concat].children.push_back(node);
+        }
+        return concat;
+    }
+
+    int addClass(const ClassSet &set) {
+        int node = addNode(NODE_CLASS);
+        nodes[node].c = (uint32_t) classes.size();
+        classes.push_back(set);
+        return node;
+    }
+
+    int hexValue(int digits) {
+        uint32_t value = 0;
+        for (int i = 0; i < digits; i++) {
+            uint32_t c = peek();
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                digit = c - 'A' + 10;
+            } else {
+                fail("Invalid hexadecimal escape");
+                return -1;
+            }
+            value = value * 16 + digit;
+            position++;
+        }
+        return (int) value;
+    }
+
+    // Escape after '\', returns the character or -1 with *predicate set for \d \w \s and such
+    int parseEscape(int *predicate) {
+        *predicate = 0;
+        if (atEnd()) {
+            fail("Trailing backslash");
+            return -1;
+        }
+        uint32_t c = source[position++];
+        switch (c) {
+            case 'd': *predicate = CLASS_DIGIT; return -1;
+            case 'D': *predicate = CLASS_NOT_DIGIT; return -1;
+            case 'w': *predicate = CLASS_WORD; return -1;
+            case 'W': *predicate = CLASS_NOT_WORD; return -1;
+            case 's': *predicate = CLASS_SPACE; return -1;
+            case 'S': *predicate = CLASS_NOT_SPACE; return -1;
+            case 't': return '\t';
+            case 'n': return '\n';
+            case 'r': return '\r';
+            case 'f': return '\f';
+            case 'x': return hexValue(2);
+            case 'u': return hexValue(4);
+            default:
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                    fail("Unsupported escape");
+                    return -1;
+                }
+                return (int) c;
+        }
+    }
+
+    // Adds a range and, when folding, the folded form of its members that fold to one
+    // character, so the class matches folded input
+    void addRange(ClassSet *set, uint32_t first, uint32_t last) {
+        set->ranges.push_back(std::make_pair(first, last));
+        if (foldMode == 0) return;
+        char16_t folded[text::MAX_FOLDED_UNITS];
+        for (uint32_t c = first; c <= last && c < 0x500; c++) {
+            if (text::foldChar(c, foldMode, folded) == 1) {
+                set->ranges.push_back(std::make_pair((uint32_t) folded[0], (uint32_t) folded[0]));
+            }
+        }
+        for (uint32_t c = std::max(first, (uint32_t) 0xFF21); c <= last && c <= 0xFF3A; c++) {
+            set->ranges.push_back(std::make_pair(c + 0x20, c + 0x20));
+        }
+    }
+
+    int parseBracket() {
+        ClassSet set;
+        if (!atEnd() && peek() == '^') {
+            set.negated = true;
+            position++;
+        }
+        bool first = true;
+        while (errorMessage.empty()) {
+            if (atEnd()) {
+                fail("Unclosed character class");
+                return -1;
+            }
+            uint32_t c = source[position++];
+            if (c == ']' && !first) break;
+            first = false;
+
+            int low = (int) c;
+            if (c == '\\') {
+                int predicate;
+                low = parseEscape(&predicate);
+                if (predicate != 0) {
+                    set.predicates |= predicate;
+                    continue;
+                }
+                if (low < 0) return -1;
+            }
+            int high = low;
+            if (position + 1 < source.size() && peek() == '-' && source[position + 1] != ']') {
+                position++;
+                uint32_t end = source[position++];
+                high = (int) end;
+                if (end == '\\') {
+                    int predicate;
+                    high = parseEscape(&predicate);
+                    if (predicate != 0) {
+                        fail("Invalid range in character class");
+                        return -1;
+                    }
+                    if (high < 0) return -1;
+                }
+                if (high < low) {
+                    fail("Invalid range in character class");
+                    return -1;
+                }
+            }
+            addRange(&set, (uint32_t) low, (uint32_t) high);
+        }
+        set.finish();
+        return addClass(set);
+    }
+
+    int parseAtom() {
+        uint32_t c = source[position++];
+        switch (c) {
+            case '(': {
+                if (position + 1 < source.size() && peek() == '?') {
+                    if (source[position + 1] != ':') {
+                        fail("Unsupported group");
+                        return -1;
+                    }
+                    position += 2;
+                }
+                if (++depth > MAX_NESTING) {
+                    fail("Pattern too deeply nested");
+                    return -1;
+                }
+                int inner = parseAlternation();
+                depth--;
+                if (atEnd() || peek() != ')') {
+                    fail("Unclosed group");
+                    return -1;
+                }
+                position++;
+                return inner;
+            }
+            case '[':
+                return parseBracket();
+            case '.':
+                return addNode(NODE_ANY);
+            case '^':
+                return addNode(NODE_LINE_START);
+            case '$':
+                return addNode(NODE_LINE_END);
+            case '*':
+            case '+':
+            case '?':
+                position--;
+                fail("Nothing to repeat");
+                return -1;
+            case '\\': {
+                if (!atEnd() && (peek() == 'b' || peek() == 'B')) {
+                    return addNode(source[position++] == 'b' ? NODE_WORD_BOUNDARY
+                                                            : NODE_NOT_WORD_BOUNDARY);
+                }
+                int predicate;
+                int value = parseEscape(&predicate);
+                if (predicate != 0) {
+                    ClassSet set;
+                    set.predicates = predicate;
+                    return addClass(set);
+                }
+                return value < 0 ? -1 : addLiteral((uint32_t) value);
+            }
+            default:
+                return addLiteral(c);
+        }
+    }
+
+    int addInst(Opcode op, uint32_t c, int x, int y) {
+        Inst inst;
+        inst.op = op;
+        inst.c = c;
+        inst.x = x;
+        inst.y = y;
+        program.push_back(inst);
+        return (int) program.size() - 1;
+    }
+
+    void emit(int index) {
+        if (program.size() > MAX_PROGRAM_SIZE) return;
+        // Copied, nodes may not be referenced across the recursion below
+        Node node = nodes[index];
+        switch (node.type) {
+            case NODE_EMPTY:
+                break;
+            case NODE_CHAR:
+                addInst(OP_CHAR, node.c, 0, 0);
+                break;
+            case NODE_ANY:
+                addInst(OP_ANY, 0, 0, 0);
+                break;
+            case NODE_CLASS:
+                addInst(OP_CLASS, 0, (int) node.c, 0);
+                break;
+            case NODE_LINE_START:
+                addInst(OP_LINE_START, 0, 0, 0);
+                break;
+            case NODE_LINE_END:
+                addInst(OP_LINE_END, 0, 0, 0);
+                break;
+            case NODE_WORD_BOUNDARY:
+                addInst(OP_WORD_BOUNDARY, 0, 0, 0);
+                break;
+            case NODE_NOT_WORD_BOUNDARY:
+                addInst(OP_NOT_WORD_BOUNDARY, 0, 0, 0);
+                break;
+            case NODE_CONCAT:
+                for (size_t i = 0; i < node.children.size(); i++) emit(node.children[i]);
+                break;
+            case NODE_ALTERNATE: {
+                std::vector<int> jumps;
+                for (size_t i = 0; i + 1 < node.children.size(); i++) {
+                    int split = addInst(OP_SPLIT, 0, 0, 0);
+                    program[split].x = split + 1;
+                    emit(node.children[i]);
+                    jumps.push_back(addInst(OP_JUMP, 0, 0, 0));
+                    program[split].y = (int) program.size();
+                }
+                emit(node.children.back());
+                for (size_t i = 0; i < jumps.size(); i++) program[jumps[i]].x = program.size();
+                break;
+            }
+            case NODE_REPEAT: {
+                int child = node.children[0];
+                for (int i = 0; i < node.min; i++) emit(child);
+                if (node.max < 0) {
+                    int split = addInst(OP_SPLIT, 0, 0, 0);
+                    emit(child);
+                    addInst(OP_JUMP, 0, split, 0);
+                    setSplit(split, split + 1, (int) program.size(), node.greedy);
+                } else {
+                    std::vector<int> splits;
+                    for (int i = node.min; i < node.max; i++) {
+                        splits.push_back(addInst(OP_SPLIT, 0, 0, 0));
+                        emit(child);
+                        if (program.size() > MAX_PROGRAM_SIZE) return;
+                    }
+                    for (size_t i = 0; i < splits.size(); i++) {
+                        setSplit(splits[i], splits[i] + 1, (int) program.size(), node.greedy);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    void setSplit(int split, int body, int skip, bool greedy) {
+        program[split].x = greedy ? body : skip;
+        program[split].y = greedy ? skip : body;
+    }
+};
+
+// Successive matches of a regex in one input, sharing the thread lists between searches.
+// Matches start at or after from, input before it is only seen by ^ and \b.
+class Matcher {
+  public:
+    Matcher(const Regex &regex, const uint32_t *input, size_t length, size_t from = 0)
+            : regex(regex), input(input), length(length), from(from), steps(0),
+              currentThreads(regex.program.size()), nextThreads(regex.program.size()) {}
+
+    // Next match after the previous one, empty matches included
+    bool next(size_t *matchStart, size_t *matchEnd) {
+        if (from > length
+                || !regex.find(input, length, from, &currentThreads, &nextThreads, matchStart,
+                               matchEnd, &steps)) {
+            from = length + 1;
+            return false;
+        }
+        from = *matchEnd > *matchStart ? *matchEnd : *matchStart + 1;
+        return true;
+    }
+
+    // Thread steps of all searches so far, the work matching took
+    size_t getSteps() const { return steps; }
+
+  private:
+    const Regex &regex;
+    const uint32_t *input;
+    const size_t length;
+    size_t from;
+    size_t steps;
+    Regex::ThreadList currentThreads;
+    Regex::ThreadList nextThreads;
+};
+
+} // namespace re
+
+#endif //_REGEX_HPP_
@@ -0,0 +1,149 @@
+#ifndef _XXHASH_HPP_
+#define _XXHASH_HPP_
+
+// Streaming XXH64, used to identify documents without hashing them in Java.
+// Output matches the reference implementation, so fingerprints can be checked on the server.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace xxh {
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value; // little-endian, like every Android ABI
+}
+
+inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+inline uint64_t mergeRound(uint64_t acc, uint64_t value) {
+    acc ^= round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+class Hash64 {
+  public:
+    explicit Hash64(uint64_t seed = 0) { reset(seed); }
+
+    void reset(uint64_t seed = 0) {
+        v[0] = seed + PRIME1 + PRIME2;
+        v[1] = seed + PRIME2;
+        v[2] = seed;
+        v[3] = seed - PRIME1;
+        this->seed = seed;
+        totalLength = 0;
+        bufferSize = 0;
+    }
+
+    void update(const void *data, size_t length) {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        const uint8_t *end = p + length;
+        totalLength += length;
+
+        if (bufferSize + length < sizeof(buffer)) {
+            memcpy(buffer + bufferSize, p, length);
+            bufferSize += length;
+            return;
+        }
+        if (bufferSize > 0) {
+            size_t fill = sizeof(buffer) - bufferSize;
+            memcpy(buffer + bufferSize, p, fill);
+            consume(buffer);
+            p += fill;
+            bufferSize = 0;
+        }
+        while (end - p >= (ptrdiff_t) sizeof(buffer)) {
+            consume(p);
+            p += sizeof(buffer);
+        }
+        bufferSize = end - p;
+        memcpy(buffer, p, bufferSize);
+    }
+
+    void update(uint64_t value) {
+        uint8_t bytes[8];
+        for (int i = 0; i < 8; i++) bytes[i] = (uint8_t) (value >> (i * 8));
+        update(bytes, sizeof(bytes));
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (totalLength >= sizeof(buffer)) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; i++) h = mergeRound(h, v[i]);
+        } else {
+            h = seed + PRIME5;
+        }
+        h += totalLength;
+
+        const uint8_t *p = buffer;
+        const uint8_t *end = buffer + bufferSize;
+        while (end - p >= 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * PRIME1 + PRIME4;
+            p += 8;
+        }
+        if (end - p >= 4) {
+            h ^= (uint64_t) read32(p) * PRIME1;
+            h = rotl(h, 23) * PRIME2 + PRIME3;
+            p += 4;
+        }
+        while (p < end) {
+            h ^= (*p++) * PRIME5;
+            h = rotl(h, 11) * PRIME1;
+        }
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+  private:
+    void consume(const uint8_t *p) {
+        v[0] = round(v[0], read64(p));
+        v[1] = round(v[1], read64(p + 8));
+        v[2] = round(v[2], read64(p + 16));
+        v[3] = round(v[3], read64(p + 24));
+    }
+
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t totalLength;
+    uint8_t buffer[32];
+    size_t bufferSize;
+};
+
+inline uint64_t hash64(const void *data, size_t length, uint64_t seed = 0) {
+    Hash64 hash(seed);
+    hash.update(data, length);
+    return hash.digest();
+}
+
+} // namespace xxh
+
+#endif //_XXHASH_HPP_
@@ -10,8 +10,7 @@
 
 class MockPDFLinkHandler : public PDFLinkHandlerInterface {
 public:
-    MOCK_METHOD(std::string, ExtractText, (FPDF_TEXTPAGE text_page, int char_index, int count), (override));
-    MOCK_METHOD(std::string, UTF16ToUTF8, (const unsigned short* utf16, size_t length), (override));
+    MOCK_METHOD(text::U16View, ExtractText, (FPDF_TEXTPAGE text_page, int char_index, int count), (override));
 };
 
 //MockPDFLinkHandler* mockExtractTextInstance = nullptr;
@@ -23,7 +23,7 @@ TEST_F(IsCharacterSpaceTest, ReturnsTrueForSpace) {
     // Set up the mock to return a space
     FPDF_TEXTPAGE mockTextPage = nullptr; // Use a dummy value for the tes
     EXPECT_CALL(mockPdfLinkHandler, ExtractText(mockTextPage, 0, 1))
-            .WillOnce(::testing::Return(" "));
+            .WillOnce(::testing::Return(text::U16View(u" ")));
 
     EXPECT_TRUE(IsCharacterSpace(mockTextPage, 0, &mockPdfLinkHandler));
 }
@@ -32,7 +32,7 @@ TEST_F(IsCharacterSpaceTest, ReturnsTrueForSpace) {
 TEST_F(IsCharacterSpaceTest, ReturnsFalseForNonSpace) {
     // Set up the mock to return a non-space character
     EXPECT_CALL(mockPdfLinkHandler, ExtractText(::testing::_, ::testing::_, ::testing::_))
-            .WillOnce(::testing::Return("a"));
+            .WillOnce(::testing::Return(text::U16View(u"a")));
 
     FPDF_TEXTPAGE mockTextPage = nullptr; // Use a dummy value for the test
     EXPECT_FALSE(IsCharacterSpace(mockTextPage, 1, &mockPdfLinkHandler));
@@ -42,12 +42,502 @@ TEST_F(IsCharacterSpaceTest, ReturnsFalseForNonSpace) {
 TEST_F(IsCharacterSpaceTest, ReturnsFalseForEmptyCharacter) {
     // Set up the mock to return an empty string
     EXPECT_CALL(mockPdfLinkHandler, ExtractText(::testing::_, ::testing::_, ::testing::_))
-            .WillOnce(::testing::Return(""));
+            .WillOnce(::testing::Return(text::U16View(u"")));
 
     FPDF_TEXTPAGE mockTextPage = nullptr; // Use a dummy value for the test
     EXPECT_FALSE(IsCharacterSpace(mockTextPage, 2, &mockPdfLinkHandler));
 }
 
+static std::string normalizePageRanges(const char *spec, int pageCount) {
+    std::vector<PageRange> ranges;
+    if (!parsePageRanges(spec, pageCount, &ranges)) return "invalid";
+    return formatPageRanges(ranges);
+}
+
+// Test single pages, closed and open-ended ranges
+TEST(ParsePageRangesTest, NormalizesRanges) {
+    EXPECT_EQ("1-10,45,60-120", normalizePageRanges("1-10,45,60-", 120));
+    EXPECT_EQ("1-5", normalizePageRanges("-5", 120));
+    EXPECT_EQ("3,7-8", normalizePageRanges(" 3 , 7 - 8 ", 10));
+    EXPECT_EQ("1-10", normalizePageRanges("1-", 10));
+}
+
+// Test malformed specs and pages outside the document
+TEST(ParsePageRangesTest, RejectsInvalidRanges) {
+    EXPECT_EQ("invalid", normalizePageRanges("", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("0", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("5-3", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("1-11", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("1,,2", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("1;2", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("99999999999", 10));
+    EXPECT_EQ("invalid", normalizePageRanges("4294967297", 10));
+}
+
+static CharBox charBox(double left, double bottom, double top) {
+    CharBox box;
+    box.left = left;
+    box.right = left + 5;
+    box.bottom = bottom;
+    box.top = top;
+    return box;
+}
+
+// Test lines, paragraph gaps, column jumps and characters without a box
+TEST(TextBreakDetectorTest, DetectsLinesAndParagraphs) {
+    TextBreakDetector detector;
+    EXPECT_EQ(TextBreakDetector::BREAK_NONE, detector.add(charBox(10, 700, 710)));
+    EXPECT_EQ(TextBreakDetector::BREAK_NONE, detector.add(charBox(15, 698, 712)));
+    EXPECT_EQ(TextBreakDetector::BREAK_NONE, detector.add(charBox(20, 0, 0)));
+    EXPECT_EQ(TextBreakDetector::BREAK_LINE, detector.add(charBox(10, 686, 696)));
+    EXPECT_EQ(TextBreakDetector::BREAK_NONE, detector.add(charBox(15, 686, 696)));
+    EXPECT_EQ(TextBreakDetector::BREAK_PARAGRAPH, detector.add(charBox(10, 650, 660)));
+    EXPECT_EQ(TextBreakDetector::BREAK_PARAGRAPH, detector.add(charBox(300, 700, 710)));
+}
+
+// Test views over characters without unicode and outside the BMP
+TEST(PageTextTest, ViewsAndLookups) {
+    const uint32_t codePoints[] = {'a', ' ', 0, 0x1F600, '7', '.'};
+    text::PageText content;
+    content.assign(codePoints, 6);
+
+    EXPECT_EQ(6, content.charCount());
+    EXPECT_EQ(6u, content.text().size());
+    EXPECT_TRUE(content.view(0, 2) == text::U16View(u"a "));
+    EXPECT_TRUE(content.view(2, 1).empty());
+    EXPECT_EQ(2u, content.view(3, 1).size());
+    EXPECT_EQ(4u, content.offsetOf(4));
+    EXPECT_TRUE(content.view(4, 100).equalsAscii("7."));
+    EXPECT_EQ(0x1F600u, content.codePointAt(3));
+    EXPECT_EQ(text::CHAR_SPACE, content.classAt(1));
+    EXPECT_EQ(text::CHAR_DIGIT, content.classAt(4));
+    EXPECT_EQ(text::CHAR_PUNCTUATION, content.classAt(5));
+    EXPECT_EQ(text::CHAR_OTHER, content.classAt(6));
+    EXPECT_EQ("a \xF0\x9F\x98\x80", text::toUtf8(content.view(0, 4)));
+}
+
+static CharBox rectBox(double left, double right, double bottom, double top) {
+    CharBox box;
+    box.left = left;
+    box.right = right;
+    box.bottom = bottom;
+    box.top = top;
+    return box;
+}
+
+// Test merging runs of a line while keeping lines, columns and empty rects apart
+TEST(MergeLineRectsTest, MergesRunsOfOneLine) {
+    std::vector<CharBox> rects;
+    rects.push_back(rectBox(10, 50, 700, 710));
+    rects.push_back(rectBox(52, 90, 699, 711));
+    rects.push_back(rectBox(90, 90, 700, 710));
+    rects.push_back(rectBox(300, 340, 700, 710));
+    rects.push_back(rectBox(10, 60, 686, 696));
+    mergeLineRects(&rects);
+
+    ASSERT_EQ(3u, rects.size());
+    EXPECT_EQ(10, rects[0].left);
+    EXPECT_EQ(90, rects[0].right);
+    EXPECT_EQ(699, rects[0].bottom);
+    EXPECT_EQ(711, rects[0].top);
+    EXPECT_EQ(300, rects[1].left);
+    EXPECT_EQ(686, rects[2].bottom);
+}
+
+static PositionedChar positionedChar(uint32_t codePoint, double left, double bottom) {
+    PositionedChar c;
+    c.codePoint = codePoint;
+    c.box = rectBox(left, left + 5, bottom, bottom + 10);
+    return c;
+}
+
+// Test regrouping characters drawn out of order into lines with word gaps
+TEST(AppendSortedLinesTest, OrdersLinesAndInsertsWordGaps) {
+    std::vector<PositionedChar> chars;
+    chars.push_back(positionedChar('d', 100, 680));
+    chars.push_back(positionedChar('b', 15, 701));
+    chars.push_back(positionedChar('c', 30, 700));
+    chars.push_back(positionedChar('a', 10, 700));
+    chars.push_back(positionedChar(' ', 95, 680));
+    chars.push_back(positionedChar(0x1F600, 106, 680));
+
+    std::vector<jchar> out;
+    appendSortedLines(&chars, &out);
+    std::vector<jchar> expected = {'a', 'b', ' ', 'c', '\n', 'd', 0xD83D, 0xDE00};
+    EXPECT_EQ(expected, out);
+}
+
+static std::vector<text::WordSpan> wordsOf(const char *ascii) {
+    std::vector<uint32_t> codePoints(ascii, ascii + strlen(ascii));
+    text::PageText content;
+    content.assign(codePoints.data(), codePoints.size());
+    std::vector<text::WordSpan> words;
+    text::findWords(content, &words);
+    return words;
+}
+
+// Test word boundaries, inner apostrophes and hyphenation across a line break
+TEST(FindWordsTest, SplitsWordsAndJoinsHyphenation) {
+    std::vector<text::WordSpan> words = wordsOf("don't stop, hyph-\r\nenated 42 e-mail -");
+    ASSERT_EQ(6u, words.size());
+    EXPECT_EQ(0, words[0].start);
+    EXPECT_EQ(5, words[0].end);
+    EXPECT_EQ(6, words[1].start);
+    EXPECT_EQ(10, words[1].end);
+    EXPECT_EQ(12, words[2].start);
+    EXPECT_EQ(17, words[2].end);
+    EXPECT_TRUE(words[2].joinsNext);
+    EXPECT_EQ(19, words[3].start);
+    EXPECT_FALSE(words[3].joinsNext);
+    EXPECT_EQ(25, words[3].end);
+    EXPECT_EQ(26, words[4].start);
+    EXPECT_EQ(28, words[4].end);
+    EXPECT_EQ(29, words[5].start);
+    EXPECT_EQ(35, words[5].end);
+
+    EXPECT_EQ(0, text::findWord(words, 4));
+    EXPECT_EQ(-1, text::findWord(words, 5));
+    EXPECT_EQ(2, text::findWord(words, 16));
+    EXPECT_EQ(5, text::findWord(words, 34));
+    EXPECT_EQ(-1, text::findWord(words, 35));
+    EXPECT_EQ(-1, text::findWord(words, -1));
+}
+
+static std::vector<int> searchFolded(const char16_t *page, const char16_t *query, int mode) {
+    std::vector<uint32_t> codePoints;
+    for (const char16_t *c = page; *c != 0; c++) codePoints.push_back(*c);
+    text::PageText content;
+    content.assign(codePoints.data(), codePoints.size());
+    text::FoldedText folded;
+    folded.build(content, mode);
+    std::vector<char16_t> pattern;
+    text::foldText(query, std::char_traits<char16_t>::length(query), mode, &pattern);
+    std::vector<int> ranges;
+    folded.findAll(pattern, &ranges);
+    return ranges;
+}
+
+// Test case and diacritic folding, ligatures and ranges over combining marks
+TEST(FoldedTextTest, FindsFoldedMatches) {
+    const char16_t *page = u"R\u00e9sum\u00e9, RESUME, resume\u0301 Stra\u00dfe \u00c6on";
+    const int all = text::FOLD_CASE | text::FOLD_DIACRITICS;
+    EXPECT_EQ(std::vector<int>({16, 22}), searchFolded(page, u"resume", 0));
+    EXPECT_EQ(std::vector<int>({8, 14, 16, 22}), searchFolded(page, u"resume", text::FOLD_CASE));
+    EXPECT_EQ(std::vector<int>({0, 6, 8, 14, 16, 23}), searchFolded(page, u"resume", all));
+    EXPECT_EQ(std::vector<int>({24, 30}), searchFolded(page, u"STRASSE", all));
+    EXPECT_EQ(std::vector<int>({31, 34}), searchFolded(page, u"AEon", text::FOLD_DIACRITICS));
+    EXPECT_TRUE(searchFolded(page, u"aeon", text::FOLD_DIACRITICS).empty());
+    EXPECT_TRUE(searchFolded(page, u"", all).empty());
+}
+
+static std::vector<uint8_t> compressBytes(const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> compressed(lz::maxCompressedSize(data.size()));
+    compressed.resize(lz::compress(data.data(), data.size(), compressed.data(),
+                                   compressed.size()));
+    return compressed;
+}
+
+// Test runs, incompressible bytes and inputs too short to search for matches
+TEST(LzTest, RoundTripsMixedData) {
+    std::vector<uint8_t> mixed(70000, 0xFF);
+    uint32_t random = 12345;
+    for (size_t i = 20000; i < 40000; i++) {
+        random = random * 1103515245 + 12345;
+        mixed[i] = (uint8_t) (random >> 16);
+    }
+    for (size_t i = 40000; i < mixed.size(); i++) mixed[i] = (uint8_t) (i % 7);
+    std::vector<std::vector<uint8_t> > inputs = {mixed, {}, {1}, {1, 2, 3, 1, 2, 3, 1, 2, 3, 1, 2}};
+    for (const std::vector<uint8_t> &input : inputs) {
+        std::vector<uint8_t> compressed = compressBytes(input);
+        ASSERT_FALSE(compressed.empty());
+        std::vector<uint8_t> output(input.size());
+        EXPECT_TRUE(lz::decompress(compressed.data(), compressed.size(), output.data(),
+                                   output.size()));
+        EXPECT_EQ(input, output);
+    }
+}
+
+// Test malformed input is rejected without writing past the output
+TEST(LzTest, RejectsMalformedInput) {
+    std::vector<uint8_t> input(4096, 0);
+    for (size_t i = 0; i < input.size(); i++) input[i] = (uint8_t) (i % 13);
+    std::vector<uint8_t> compressed = compressBytes(input);
+    std::vector<uint8_t> output(input.size());
+    for (size_t size = 0; size < compressed.size(); size++) {
+        EXPECT_FALSE(lz::decompress(compressed.data(), size, output.data(), output.size()));
+    }
+    EXPECT_FALSE(lz::decompress(compressed.data(), compressed.size(), output.data(),
+                                output.size() - 1));
+
+    // One literal, then a match 2 bytes back with a single byte written so far
+    const uint8_t farOffset[] = {0x10, 'a', 2, 0, 0x10, 'b'};
+    const uint8_t zeroOffset[] = {0x10, 'a', 0, 0, 0x10, 'b'};
+    uint8_t small[6];
+    EXPECT_FALSE(lz::decompress(farOffset, sizeof(farOffset), small, sizeof(small)));
+    EXPECT_FALSE(lz::decompress(zeroOffset, sizeof(zeroOffset), small, sizeof(small)));
+}
+
+static RenderTarget cacheTarget(std::vector<uint8_t> *pixels) {
+    RenderTarget target;
+    target.pixels = pixels->data();
+    target.format = ANDROID_BITMAP_FORMAT_RGBA_8888;
+    target.width = 8;
+    target.height = 8;
+    target.stride = 8 * 4;
+    return target;
+}
+
+// Stores pixels under key in a cache in directory, returns the path of the entry file
+static std::string writeCacheEntry(const std::string &directory, const std::string &key,
+                                   std::vector<uint8_t> *pixels) {
+    {
+        // Pending writes are finished when the cache is deleted
+        RenderCache cache(directory, 1 << 20);
+        cache.store(key, cacheTarget(pixels));
+    }
+    DIR *dir = opendir(directory.c_str());
+    std::string path;
+    struct dirent *item;
+    while (dir != NULL && (item = readdir(dir)) != NULL) {
+        std::string name = item->d_name;
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, ".rc") == 0) {
+            path = directory + "/" + name;
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    return path;
+}
+
+static bool loadCacheEntry(const std::string &directory, const std::string &key,
+                           std::vector<uint8_t> *pixels) {
+    RenderCache cache(directory, 1 << 20);
+    return cache.load(key, cacheTarget(pixels));
+}
+
+static void overwrite(const std::string &path, off_t offset, const void *data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ((ssize_t) size, pwrite(fd, data, size, offset));
+    close(fd);
+}
+
+// Test entries round trip, and corrupt sizes, truncated files and payloads are rejected
+TEST(RenderCacheTest, RejectsCorruptEntries) {
+    char directoryTemplate[] = "/tmp/render-cache-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directoryTemplate));
+    std::string directory = directoryTemplate;
+    const std::string key = "doc#3|800x600";
+    std::vector<uint8_t> pixels(8 * 8 * 4);
+    for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (uint8_t) (i / 5);
+    std::vector<uint8_t> loaded(pixels.size());
+
+    std::string path = writeCacheEntry(directory, key, &pixels);
+    ASSERT_FALSE(path.empty());
+    EXPECT_TRUE(loadCacheEntry(directory, key, &loaded));
+    EXPECT_EQ(pixels, loaded);
+
+    // compressedSize of the header, far beyond the file
+    const uint64_t hugeSize = 1ULL << 62;
+    overwrite(path, 32, &hugeSize, sizeof(hugeSize));
+    EXPECT_FALSE(loadCacheEntry(directory, key, &loaded));
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+
+    path = writeCacheEntry(directory, key, &pixels);
+    ASSERT_EQ(0, truncate(path.c_str(), 60));
+    EXPECT_FALSE(loadCacheEntry(directory, key, &loaded));
+
+    path = writeCacheEntry(directory, key, &pixels);
+    struct stat info;
+    ASSERT_EQ(0, stat(path.c_str(), &info));
+    int fd = open(path.c_str(), O_RDONLY);
+    uint8_t last = 0;
+    EXPECT_EQ(1, pread(fd, &last, 1, info.st_size - 1));
+    close(fd);
+    last ^= 0xFF;
+    overwrite(path, info.st_size - 1, &last, 1);
+    EXPECT_FALSE(loadCacheEntry(directory, key, &loaded));
+
+    unlink(path.c_str());
+    rmdir(directory.c_str());
+}
+
+// Test half-transparent yellow over RGBA white and black, opaque blue over gray
+TEST(BlendBytesTest, BlendsColorOverPixels) {
+    uint8_t rgba[] = {255, 255, 255, 255, 0, 0, 0, 255};
+    const uint16_t weight[] = {127, 127, 127, 127};
+    const uint16_t add[] = {255 * 128, 255 * 128, 0, 255 * 128};
+    blendBytes(rgba, 2, 4, weight, add);
+    EXPECT_EQ(std::vector<uint8_t>({255, 255, 127, 255, 128, 128, 0, 255}),
+              std::vector<uint8_t>(rgba, rgba + 8));
+
+    uint8_t gray[] = {0, 200, 255};
+    const uint16_t opaque[] = {0};
+    const uint16_t blue[] = {28 * 255};
+    blendBytes(gray, 3, 1, opaque, blue);
+    EXPECT_EQ(std::vector<uint8_t>({28, 28, 28}), std::vector<uint8_t>(gray, gray + 3));
+}
+
+static std::vector<uint8_t> transformColors(int mode, std::vector<uint8_t> pixels, int bpp) {
+    ColorTransform colors;
+    colors.mode = mode;
+    int width = pixels.size() / bpp;
+    applyColorTransform(colors, pixels.data(), pixels.size(), width, 1, bpp, true);
+    return pixels;
+}
+
+// Test inversion, lightness inversion keeping hues and sepia with and without alpha
+TEST(ColorTransformTest, TransformsPixelsInPlace) {
+    EXPECT_EQ(std::vector<uint8_t>({245, 235, 225, 255}),
+              transformColors(COLOR_MODE_INVERT, {10, 20, 30, 255}, 4));
+    EXPECT_EQ(std::vector<uint8_t>({0, 0, 0, 255, 0, 0, 205, 105, 55}),
+              transformColors(COLOR_MODE_INVERT_LIGHTNESS,
+                              {255, 255, 255, 255, 0, 0, 200, 100, 50}, 3));
+    EXPECT_EQ(std::vector<uint8_t>({255, 255, 240, 0, 0, 0}),
+              transformColors(COLOR_MODE_SEPIA, {255, 255, 255, 0, 0, 0}, 3));
+    EXPECT_EQ(std::vector<uint8_t>({1, 2, 3}), transformColors(COLOR_MODE_NORMAL, {1, 2, 3}, 3));
+}
+
+static std::vector<int> searchRegex(const char16_t *page, const char16_t *pattern, int mode) {
+    std::vector<uint32_t> codePoints;
+    for (const char16_t *c = page; *c != 0; c++) codePoints.push_back(*c);
+    text::PageText content;
+    content.assign(codePoints.data(), codePoints.size());
+    std::vector<uint32_t> input;
+    std::vector<int> charIndex;
+    re::buildInput(content, mode, &input, &charIndex);
+
+    re::Regex regex;
+    std::string error;
+    EXPECT_TRUE(regex.compile(pattern, std::char_traits<char16_t>::length(pattern), mode, &error))
+            << error;
+    std::vector<int> ranges;
+    re::Matcher matcher(regex, input.data(), input.size());
+    size_t start, end;
+    while (matcher.next(&start, &end)) {
+        ranges.push_back(charIndex[start]);
+        ranges.push_back(charIndex[end - 1] + 1);
+    }
+    return ranges;
+}
+
+// Thread steps of finding all matches of pattern in length copies of c
+static size_t countRegexSteps(const char16_t *pattern, char32_t c, size_t length) {
+    re::Regex regex;
+    std::string error;
+    EXPECT_TRUE(regex.compile(pattern, std::char_traits<char16_t>::length(pattern), 0, &error));
+    std::vector<uint32_t> input(length, c);
+    re::Matcher matcher(regex, input.data(), input.size());
+    size_t start, end, matches = 0;
+    while (matcher.next(&start, &end)) matches++;
+    EXPECT_EQ(length, matches);
+    return matcher.getSteps();
+}
+
+// Test classes, repetition, alternation, word boundaries, line anchors and folding
+TEST(RegexTest, FindsLeftmostMatches) {
+    const char16_t *page = u"Due 2024-03-15, paid 12.50 EUR\nRef: AB-1234 ab-99";
+    EXPECT_EQ(std::vector<int>({4, 14}), searchRegex(page, u"\\d{4}-\\d\\d-\\d\\d", 0));
+    EXPECT_EQ(std::vector<int>({21, 26}), searchRegex(page, u"\\d+\\.\\d+", 0));
+    EXPECT_EQ(std::vector<int>({27, 30}), searchRegex(page, u"EUR|USD", 0));
+    EXPECT_EQ(std::vector<int>({0, 3, 31, 34}), searchRegex(page, u"^\\w+", 0));
+    EXPECT_EQ(std::vector<int>({36, 43}), searchRegex(page, u"\\b[A-Z]{2}-\\d+", 0));
+    EXPECT_EQ(std::vector<int>({36, 43, 44, 49}),
+              searchRegex(page, u"\\bab-\\d+", text::FOLD_CASE));
+    EXPECT_EQ(std::vector<int>({0, 3}), searchRegex(page, u"D.*?e", 0));
+    EXPECT_TRUE(searchRegex(page, u"\\bue", 0).empty());
+}
+
+// Test patterns which must be rejected instead of compiled
+TEST(RegexTest, RejectsInvalidPatterns) {
+    std::u16string nested = std::u16string(5000, u'(') + u"a" + std::u16string(5000, u')');
+    std::u16string stacked = u"a" + std::u16string(5000, u'*');
+    std::u16string patterns[] = {u"(ab", u"ab)", u"[a-", u"*a", u"a{2,1}", u"a{5000}", u"\\",
+                                 nested, stacked};
+    for (const std::u16string &pattern : patterns) {
+        re::Regex regex;
+        std::string error;
+        EXPECT_FALSE(regex.compile(pattern.data(), pattern.size(), 0, &error));
+        EXPECT_FALSE(error.empty());
+    }
+}
+
+// Test all matches are found in linear time, even if each search scans far past its match
+TEST(RegexTest, FindsAllMatchesInLinearTime) {
+    size_t steps = countRegexSteps(u"a[^z]*z|a", 'a', 1000);
+    EXPECT_LT(countRegexSteps(u"a[^z]*z|a", 'a', 2000), 3 * steps);
+}
+
+// Matches on page after searching previous, keeping its text from tailFirst on as the tail
+static JoinedMatches searchAfterPage(const char16_t *previous, int tailFirst,
+                                     const char16_t *page, const char16_t *pattern) {
+    re::Regex regex;
+    std::string error;
+    EXPECT_TRUE(regex.compile(pattern, std::char_traits<char16_t>::length(pattern), 0, &error));
+    std::atomic<bool> stopping(false);
+    std::vector<uint32_t> first(previous, previous + std::char_traits<char16_t>::length(previous));
+    std::vector<uint32_t> second(page, page + std::char_traits<char16_t>::length(page));
+    SearchTail empty, tail, nextTail;
+    JoinedMatches matches;
+    matchJoinedPage(regex, stopping, empty, first.data(), first.size(), tailFirst, &matches,
+                    &tail);
+    matchJoinedPage(regex, stopping, tail, second.data(), second.size(), 0, &matches, &nextTail);
+    return matches;
+}
+
+// Test matches continuing on the next page, and matches the tail must not report again
+TEST(RegexTest, JoinsPageTails) {
+    JoinedMatches matches = searchAfterPage(u"see the quick", 4, u"brown fox", u"quick\\s+brown");
+    EXPECT_EQ(8, matches.spanningStart);
+    EXPECT_EQ(0, matches.spanningFirst);
+    EXPECT_EQ(5, matches.spanningEnd);
+    EXPECT_TRUE(matches.ranges.empty());
+
+    // Matched on the previous page already, the tail starts after it
+    matches = searchAfterPage(u"ab ab", 0, u"ab", u"ab");
+    EXPECT_EQ(-1, matches.spanningStart);
+    EXPECT_EQ(std::vector<int>({0, 2}), matches.ranges);
+
+    // Ends in the tail at the page break
+    matches = searchAfterPage(u"c x", 0, u"z", u"c|x\\s");
+    EXPECT_EQ(-1, matches.spanningStart);
+    EXPECT_TRUE(matches.ranges.empty());
+
+    // A tail cut in a word or line is not the start of one
+    matches = searchAfterPage(u"determ", 2, u"inal", u"\\bterm\\s+\\w+");
+    EXPECT_EQ(-1, matches.spanningStart);
+    matches = searchAfterPage(u"the end", 4, u"start", u"^end\\s+\\w+");
+    EXPECT_EQ(-1, matches.spanningStart);
+    matches = searchAfterPage(u"the\nend", 4, u"start", u"^end\\s+\\w+");
+    EXPECT_EQ(4, matches.spanningStart);
+    EXPECT_EQ(5, matches.spanningEnd);
+}
+
+TEST(PdfiumLockTest, BackgroundStepsAsideForQueuedForeground) {
+    PdfiumLock lock;
+    std::vector<char> order;
+    std::mutex orderMutex;
+    lock.lock(false);
+
+    std::thread foreground([&] {
+        lock.lock(false);
+        { std::lock_guard<std::mutex> guard(orderMutex); order.push_back('f'); }
+        lock.unlock();
+    });
+    while (!lock.hasForegroundWaiters()) std::this_thread::yield();
+
+    // Nested acquisition by the holder does not wait for the queued call
+    lock.lockBehindForeground();
+    lock.unlock();
+
+    // Releasing and taking the lock again lets the queued call in first
+    lock.unlock();
+    lock.lockBehindForeground();
+    { std::lock_guard<std::mutex> guard(orderMutex); order.push_back('b'); }
+    lock.unlock();
+    foreground.join();
+    EXPECT_EQ(std::vector<char>({'f', 'b'}), order);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();